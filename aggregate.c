@@ -0,0 +1,329 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "aggregate.h"
+
+struct aggregate_slot {
+    uint64_t zobrist_hash;
+    uint32_t record;  // index + 1, 0 for empty slots
+};
+
+struct aggregate {
+    size_t budget;
+    size_t moves_memory;  // estimated, including allocator overhead
+    char *spill_prefix;
+
+    // Open addressing. Zobrist hashes are uniform enough to be used
+    // directly.
+    struct aggregate_slot *slots;
+    size_t capacity;
+    size_t size;
+
+    // Inline, in the order they were first seen. Only their moves are
+    // allocated separately.
+    struct master_record *records;
+    size_t records_capacity;
+
+    // Oldest first.
+    FILE **runs;
+    size_t num_runs;
+};
+
+static const size_t AGGREGATE_MIN_CAPACITY = 1024;
+
+// Heap usage of an allocation, as with glibc: an 8 byte header and 16 byte
+// granularity.
+static size_t heap_size(size_t size) {
+    return size ? (size + 8 + 15) & ~(size_t) 15 : 0;
+}
+
+static size_t aggregate_memory(const struct aggregate *agg) {
+    return heap_size(agg->capacity * sizeof(struct aggregate_slot)) +
+           heap_size(agg->records_capacity * sizeof(struct master_record)) +
+           agg->moves_memory;
+}
+
+static void aggregate_reset(struct aggregate *agg) {
+    free(agg->slots);
+    agg->capacity = AGGREGATE_MIN_CAPACITY;
+    agg->slots = calloc(agg->capacity, sizeof(struct aggregate_slot));
+    if (!agg->slots) abort();
+    agg->size = 0;
+
+    free(agg->records);
+    agg->records = NULL;
+    agg->records_capacity = 0;
+    agg->moves_memory = 0;
+}
+
+struct aggregate *aggregate_new(size_t budget, const char *spill_prefix) {
+    struct aggregate *agg = calloc(1, sizeof(struct aggregate));
+    if (!agg) abort();
+
+    agg->budget = budget;
+    agg->spill_prefix = strdup(spill_prefix);
+    if (!agg->spill_prefix) abort();
+
+    aggregate_reset(agg);
+    return agg;
+}
+
+static void aggregate_clear(struct aggregate *agg) {
+    for (size_t i = 0; i < agg->size; i++) free(agg->records[i].moves);
+    aggregate_reset(agg);
+}
+
+static void aggregate_close_runs(struct aggregate *agg) {
+    for (size_t i = 0; i < agg->num_runs; i++) fclose(agg->runs[i]);
+    free(agg->runs);
+    agg->runs = NULL;
+    agg->num_runs = 0;
+}
+
+void aggregate_free(struct aggregate *agg) {
+    aggregate_clear(agg);
+    aggregate_close_runs(agg);
+    free(agg->slots);
+    free(agg->records);
+    free(agg->spill_prefix);
+    free(agg);
+}
+
+size_t aggregate_num_runs(const struct aggregate *agg) {
+    return agg->num_runs;
+}
+
+static struct aggregate_slot *aggregate_slot(struct aggregate_slot *slots, size_t capacity, uint64_t zobrist_hash) {
+    size_t i = zobrist_hash & (capacity - 1);
+    while (slots[i].record && slots[i].zobrist_hash != zobrist_hash) i = (i + 1) & (capacity - 1);
+    return &slots[i];
+}
+
+static void aggregate_grow(struct aggregate *agg) {
+    size_t capacity = agg->capacity * 2;
+    struct aggregate_slot *slots = calloc(capacity, sizeof(struct aggregate_slot));
+    if (!slots) abort();
+
+    for (size_t i = 0; i < agg->capacity; i++) {
+        if (agg->slots[i].record) *aggregate_slot(slots, capacity, agg->slots[i].zobrist_hash) = agg->slots[i];
+    }
+
+    free(agg->slots);
+    agg->slots = slots;
+    agg->capacity = capacity;
+}
+
+static int cmp_aggregate_slot(const void *l, const void *r) {
+    const struct aggregate_slot *a = (struct aggregate_slot *) l;
+    const struct aggregate_slot *b = (struct aggregate_slot *) r;
+    return (a->zobrist_hash > b->zobrist_hash) - (a->zobrist_hash < b->zobrist_hash);
+}
+
+// Moves the records to the front, sorted by hash. The table can only be
+// cleared afterwards.
+static void aggregate_sort(struct aggregate *agg) {
+    size_t n = 0;
+    for (size_t i = 0; i < agg->capacity; i++) {
+        if (agg->slots[i].record) agg->slots[n++] = agg->slots[i];
+    }
+    for (size_t i = n; i < agg->capacity; i++) agg->slots[i].record = 0;
+
+    qsort(agg->slots, n, sizeof(struct aggregate_slot), cmp_aggregate_slot);
+}
+
+static size_t encoded_size_bound(const struct master_record *record) {
+    // Varints of up to 10 bytes, 2 byte moves and 6 byte game ids.
+    return 20 + record->num_moves * (2 + 4 * 10) + record->num_refs * (6 + 10);
+}
+
+// Run format: uint64 hash, uint32 size, encoded record, repeated.
+static bool aggregate_spill(struct aggregate *agg) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.%zu.run", agg->spill_prefix, agg->num_runs);
+
+    FILE *file = fopen(path, "w+b");
+    if (!file) return false;
+    unlink(path);
+
+    FILE **runs = realloc(agg->runs, (agg->num_runs + 1) * sizeof(FILE *));
+    if (!runs) abort();
+    agg->runs = runs;
+    agg->runs[agg->num_runs++] = file;
+
+    aggregate_sort(agg);
+
+    uint8_t *buffer = NULL;
+    size_t buffer_size = 0;
+    bool ok = true;
+
+    for (size_t i = 0; i < agg->size && ok; i++) {
+        const struct aggregate_slot *slot = &agg->slots[i];
+        const struct master_record *record = &agg->records[slot->record - 1];
+
+        size_t bound = encoded_size_bound(record);
+        if (bound > buffer_size) {
+            buffer_size = bound;
+            buffer = realloc(buffer, buffer_size);
+            if (!buffer) abort();
+        }
+
+        uint32_t size = encode_master_record(buffer, record) - buffer;
+        ok = 1 == fwrite(&slot->zobrist_hash, sizeof(uint64_t), 1, file) &&
+             1 == fwrite(&size, sizeof(uint32_t), 1, file) &&
+             size == fwrite(buffer, 1, size, file);
+    }
+
+    free(buffer);
+    aggregate_clear(agg);
+    return ok && fflush(file) == 0;
+}
+
+bool aggregate_add(struct aggregate *agg, uint64_t zobrist_hash,
+                   move_t move, const struct master_ref *ref, int wdl) {
+    struct aggregate_slot *slot = aggregate_slot(agg->slots, agg->capacity, zobrist_hash);
+    if (!slot->record) {
+        if (agg->size == agg->records_capacity) {
+            agg->records_capacity = agg->records_capacity ? agg->records_capacity * 2 : AGGREGATE_MIN_CAPACITY / 2;
+            agg->records = realloc(agg->records, agg->records_capacity * sizeof(struct master_record));
+            if (!agg->records) abort();
+        }
+
+        slot->zobrist_hash = zobrist_hash;
+        slot->record = ++agg->size;
+        agg->records[agg->size - 1].num_moves = 0;
+        agg->records[agg->size - 1].num_refs = 0;
+        agg->records[agg->size - 1].moves = NULL;
+    }
+
+    struct master_record *record = &agg->records[slot->record - 1];
+    size_t moves_size = heap_size(record->num_moves * sizeof(struct move_stats));
+    master_record_add_move(record, move, ref, wdl);
+    agg->moves_memory += heap_size(record->num_moves * sizeof(struct move_stats)) - moves_size;
+
+    // Keep the load factor below 1/2.
+    if (2 * agg->size > agg->capacity) aggregate_grow(agg);
+
+    if (aggregate_memory(agg) > agg->budget) return aggregate_spill(agg);
+    return true;
+}
+
+// Next record of a run or of the sorted table, in hash order.
+struct aggregate_source {
+    FILE *file;  // NULL for the table
+    size_t index;
+
+    uint64_t zobrist_hash;
+    struct master_record *record;  // NULL when exhausted, owned for runs
+};
+
+static bool aggregate_source_next(struct aggregate *agg, struct aggregate_source *source,
+                                  uint8_t **buffer, size_t *buffer_size) {
+    if (!source->file) {
+        if (source->index < agg->size) {
+            source->zobrist_hash = agg->slots[source->index].zobrist_hash;
+            source->record = &agg->records[agg->slots[source->index++].record - 1];
+        } else {
+            source->record = NULL;
+        }
+        return true;
+    }
+
+    uint32_t size;
+    if (1 != fread(&source->zobrist_hash, sizeof(uint64_t), 1, source->file)) {
+        source->record = NULL;
+        return feof(source->file);
+    }
+    if (1 != fread(&size, sizeof(uint32_t), 1, source->file)) return false;
+
+    if (size > *buffer_size) {
+        *buffer_size = size;
+        *buffer = realloc(*buffer, *buffer_size);
+        if (!*buffer) abort();
+    }
+    if (size != fread(*buffer, 1, size, source->file)) return false;
+
+    source->record = master_record_new();
+    decode_master_record(*buffer, source->record);
+    return true;
+}
+
+// Oldest source first on equal hashes.
+static bool aggregate_source_less(const struct aggregate_source *a, const struct aggregate_source *b) {
+    if (a->zobrist_hash != b->zobrist_hash) return a->zobrist_hash < b->zobrist_hash;
+    return a < b;
+}
+
+static void aggregate_heap_down(struct aggregate_source **heap, size_t size, size_t i) {
+    while (true) {
+        size_t smallest = i;
+        size_t l = 2 * i + 1, r = 2 * i + 2;
+        if (l < size && aggregate_source_less(heap[l], heap[smallest])) smallest = l;
+        if (r < size && aggregate_source_less(heap[r], heap[smallest])) smallest = r;
+        if (smallest == i) return;
+
+        struct aggregate_source *tmp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+bool aggregate_finish(struct aggregate *agg, aggregate_visit visit, void *opq) {
+    aggregate_sort(agg);
+
+    // Runs from oldest to newest, then the table.
+    size_t num_sources = agg->num_runs + 1;
+    struct aggregate_source *sources = calloc(num_sources, sizeof(struct aggregate_source));
+    struct aggregate_source **heap = calloc(num_sources, sizeof(struct aggregate_source *));
+    if (!sources || !heap) abort();
+
+    uint8_t *buffer = NULL;
+    size_t buffer_size = 0;
+    bool ok = true;
+
+    size_t heap_size = 0;
+    for (size_t i = 0; i < num_sources; i++) {
+        if (i < agg->num_runs) {
+            sources[i].file = agg->runs[i];
+            ok = ok && 0 == fseek(sources[i].file, 0, SEEK_SET);
+        }
+        ok = ok && aggregate_source_next(agg, &sources[i], &buffer, &buffer_size);
+        if (sources[i].record) heap[heap_size++] = &sources[i];
+    }
+    for (size_t i = heap_size; i-- > 0; ) aggregate_heap_down(heap, heap_size, i);
+
+    while (heap_size && ok) {
+        struct aggregate_source *top = heap[0];
+        uint64_t zobrist_hash = top->zobrist_hash;
+        struct master_record *record = top->record;
+        bool owned = top->file;
+
+        do {
+            if (top->record != record) {
+                master_record_merge(record, top->record);
+                if (top->file) master_record_free(top->record);
+            }
+
+            ok = aggregate_source_next(agg, top, &buffer, &buffer_size);
+            if (!top->record) heap[0] = heap[--heap_size];
+            aggregate_heap_down(heap, heap_size, 0);
+            top = heap[0];
+        } while (heap_size && ok && top->zobrist_hash == zobrist_hash);
+
+        visit(zobrist_hash, record, opq);
+        if (owned) master_record_free(record);
+    }
+
+    for (size_t i = 0; i < agg->num_runs; i++) {
+        if (sources[i].record) master_record_free(sources[i].record);
+    }
+
+    free(buffer);
+    free(heap);
+    free(sources);
+    aggregate_clear(agg);
+    aggregate_close_runs(agg);
+    return ok;
+}
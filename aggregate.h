@@ -0,0 +1,34 @@
+#ifndef AGGREGATE_H_
+#define AGGREGATE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "encode.h"
+#include "move.h"
+
+// Master records built in memory, one per position, so that the database is
+// written only once per key. Over the memory budget, the table is spilled to
+// disk as a run sorted by hash. Runs are merged at the end.
+
+struct aggregate;
+
+// Runs are temporary files named after spill_prefix. They are unlinked as
+// soon as they are open.
+struct aggregate *aggregate_new(size_t budget, const char *spill_prefix);
+void aggregate_free(struct aggregate *agg);
+
+// Returns false if a spill failed.
+bool aggregate_add(struct aggregate *agg, uint64_t zobrist_hash,
+                   move_t move, const struct master_ref *ref, int wdl);
+
+size_t aggregate_num_runs(const struct aggregate *agg);
+
+// Visits every position once, in ascending order of hashes. Records of
+// the same position from different runs are merged in the order they were
+// added. Empties the aggregate.
+typedef void (*aggregate_visit)(uint64_t zobrist_hash, const struct master_record *record, void *opq);
+bool aggregate_finish(struct aggregate *agg, aggregate_visit visit, void *opq);
+
+#endif  // #ifndef AGGREGATE_H_
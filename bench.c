@@ -0,0 +1,306 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include <event2/event.h>
+#include <event2/http.h>
+#include <event2/keyvalq_struct.h>
+
+#include "attacks.h"
+#include "bitboard.h"
+#include "board.h"
+#include "metrics.h"
+#include "querylog.h"
+
+// Closed-loop load generator: each of the concurrent clients sends its next
+// request as soon as the previous one completes.
+
+struct bench {
+    struct event_base *base;
+    const char *host;
+    int port;
+    bool keep_alive;
+
+    char **uris;
+    size_t num_uris;
+    size_t next_uri;
+
+    unsigned long max_requests;
+    unsigned long started;
+    unsigned long completed;
+    unsigned long errors;
+    bool stopping;
+    int active_clients;
+
+    struct histogram *latency;
+};
+
+struct client {
+    struct bench *bench;
+    struct evhttp_connection *conn;
+    uint64_t start;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void client_send(struct client *client);
+
+static void client_done(struct client *client) {
+    struct bench *bench = client->bench;
+    if (--bench->active_clients == 0) event_base_loopexit(bench->base, NULL);
+}
+
+static void on_response(struct evhttp_request *req, void *arg) {
+    struct client *client = arg;
+    struct bench *bench = client->bench;
+
+    histogram_record(bench->latency, now_ns() - client->start);
+    bench->completed++;
+    if (!req || evhttp_request_get_response_code(req) != HTTP_OK) bench->errors++;
+
+    // Without keep-alive the connection frees itself on completion.
+    if (!bench->keep_alive) client->conn = NULL;
+
+    client_send(client);
+}
+
+static void client_send(struct client *client) {
+    struct bench *bench = client->bench;
+    if (bench->stopping || (bench->max_requests && bench->started >= bench->max_requests)) {
+        client_done(client);
+        return;
+    }
+
+    if (!client->conn) {
+        client->conn = evhttp_connection_base_new(bench->base, NULL, bench->host, bench->port);
+        if (!client->conn) {
+            puts("could not create connection");
+            abort();
+        }
+    }
+
+    struct evhttp_request *req = evhttp_request_new(on_response, client);
+    if (!req) abort();
+
+    struct evkeyvalq *headers = evhttp_request_get_output_headers(req);
+    evhttp_add_header(headers, "Host", bench->host);
+    if (!bench->keep_alive) {
+        evhttp_add_header(headers, "Connection", "close");
+        evhttp_connection_free_on_completion(client->conn);
+    }
+
+    const char *uri = bench->uris[bench->next_uri++ % bench->num_uris];
+    bench->started++;
+    client->start = now_ns();
+    if (evhttp_make_request(client->conn, req, EVHTTP_REQ_GET, uri) != 0) {
+        puts("could not make request");
+        abort();
+    }
+}
+
+static void stop_bench(evutil_socket_t fd, short events, void *arg) {
+    struct bench *bench = arg;
+    bench->stopping = true;
+}
+
+static char *master_uri(const char *query) {
+    size_t size = strlen("/master?") + strlen(query) + 1;
+    char *uri = malloc(size);
+    if (!uri) abort();
+    snprintf(uri, size, "/master?%s", query);
+    return uri;
+}
+
+// Random playouts from the starting position. Shallow positions are more
+// likely, like in real traffic.
+static char **synthetic_uris(size_t num_uris, int max_plies, unsigned int seed) {
+    char **uris = calloc(num_uris, sizeof(char *));
+    if (!uris) abort();
+
+    srand(seed);
+
+    for (size_t i = 0; i < num_uris; i++) {
+        board_t pos;
+        board_reset(&pos);
+
+        int plies = rand() % (max_plies + 1);
+        plies = rand() % (plies + 1);
+        for (int ply = 0; ply < plies; ply++) {
+            move_t moves[255];
+            move_t *end = board_legal_moves(&pos, moves, BB_ALL, BB_ALL);
+            if (end == moves) break;
+            board_move(&pos, moves[rand() % (end - moves)]);
+        }
+
+        char fen[255];
+        board_shredder_fen(&pos, fen);
+
+        char *encoded = evhttp_uriencode(fen, -1, 0);
+        if (!encoded) abort();
+
+        size_t size = strlen("fen=") + strlen(encoded) + 1;
+        char *query = malloc(size);
+        if (!query) abort();
+        snprintf(query, size, "fen=%s", encoded);
+        free(encoded);
+
+        uris[i] = master_uri(query);
+        free(query);
+    }
+
+    return uris;
+}
+
+void usage(const char *name) {
+    printf("usage: %s [-H host] [-p port] [-c concurrency] [-n requests] [-d seconds]\n"
+           "          [-l query-log] [-s synthetic-positions] [-D max-plies] [-K] [-h]\n", name);
+}
+
+int main(int argc, char *argv[]) {
+    struct bench bench = {};
+    bench.host = "127.0.0.1";
+    bench.port = 5555;
+    bench.keep_alive = true;
+
+    int concurrency = 16;
+    int duration = 0;
+    const char *log_path = NULL;
+    size_t num_synthetic = 10000;
+    int max_plies = 16;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "H:p:c:n:d:l:s:D:Kh")) != -1) {
+        switch (opt) {
+            case 'H':
+                bench.host = optarg;
+                break;
+            case 'p':
+                bench.port = atoi(optarg);
+                break;
+            case 'c':
+                concurrency = atoi(optarg);
+                break;
+            case 'n':
+                bench.max_requests = atol(optarg);
+                break;
+            case 'd':
+                duration = atoi(optarg);
+                break;
+            case 'l':
+                log_path = optarg;
+                break;
+            case 's':
+                num_synthetic = atol(optarg);
+                break;
+            case 'D':
+                max_plies = atoi(optarg);
+                break;
+            case 'K':
+                bench.keep_alive = false;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (concurrency <= 0 || !num_synthetic || max_plies < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (!bench.max_requests && !duration) bench.max_requests = 100000;
+
+    attacks_init();
+
+    struct querylog *log = NULL;
+    if (log_path) {
+        log = querylog_read(log_path);
+        if (!log || !log->num_queries) {
+            printf("could not read queries from %s\n", log_path);
+            return 1;
+        }
+
+        bench.num_uris = log->num_queries;
+        bench.uris = calloc(bench.num_uris, sizeof(char *));
+        if (!bench.uris) abort();
+        for (size_t i = 0; i < bench.num_uris; i++) bench.uris[i] = master_uri(log->queries[i]);
+        querylog_free(log);
+    } else {
+        bench.num_uris = num_synthetic;
+        bench.uris = synthetic_uris(num_synthetic, max_plies, 1);
+    }
+
+    bench.latency = calloc(1, sizeof(struct histogram));
+    if (!bench.latency) abort();
+
+    bench.base = event_base_new();
+    if (!bench.base) {
+        puts("could not initialize event_base");
+        abort();
+    }
+
+    struct event *timer = NULL;
+    if (duration) {
+        struct timeval tv = { duration, 0 };
+        timer = evtimer_new(bench.base, stop_bench, &bench);
+        if (!timer) abort();
+        evtimer_add(timer, &tv);
+    }
+
+    struct client *clients = calloc(concurrency, sizeof(struct client));
+    if (!clients) abort();
+
+    uint64_t start = now_ns();
+
+    bench.active_clients = concurrency;
+    for (int i = 0; i < concurrency; i++) {
+        clients[i].bench = &bench;
+        client_send(&clients[i]);
+    }
+
+    event_base_dispatch(bench.base);
+
+    double seconds = (now_ns() - start) / 1e9;
+
+    printf("{\n");
+    printf("  \"source\": \"%s\",\n", log_path ? "log" : "synthetic");
+    printf("  \"uris\": %zu,\n", bench.num_uris);
+    printf("  \"concurrency\": %d,\n", concurrency);
+    printf("  \"keepAlive\": %s,\n", bench.keep_alive ? "true" : "false");
+    printf("  \"requests\": %lu,\n", bench.completed);
+    printf("  \"errors\": %lu,\n", bench.errors);
+    printf("  \"seconds\": %.3f,\n", seconds);
+    printf("  \"throughput\": %.1f,\n", bench.completed / seconds);
+    printf("  \"latencyMs\": {\n");
+    printf("    \"mean\": %.3f,\n", bench.latency->count ? bench.latency->sum / 1e6 / bench.latency->count : 0.0);
+    printf("    \"p50\": %.3f,\n", histogram_quantile(bench.latency, 0.5) / 1e6);
+    printf("    \"p99\": %.3f,\n", histogram_quantile(bench.latency, 0.99) / 1e6);
+    printf("    \"p999\": %.3f,\n", histogram_quantile(bench.latency, 0.999) / 1e6);
+    printf("    \"max\": %.3f\n", histogram_quantile(bench.latency, 1) / 1e6);
+    printf("  }\n");
+    printf("}\n");
+
+    for (int i = 0; i < concurrency; i++) {
+        if (clients[i].conn) evhttp_connection_free(clients[i].conn);
+    }
+    free(clients);
+
+    if (timer) event_free(timer);
+    event_base_free(bench.base);
+
+    for (size_t i = 0; i < bench.num_uris; i++) free(bench.uris[i]);
+    free(bench.uris);
+    free(bench.latency);
+    return 0;
+}
@@ -758,6 +758,40 @@ bool board_parse_san(const board_t *pos, const char *san, move_t *move) {
     return *move != 0;
 }
 
+bool board_parse_uci(const board_t *pos, const char *uci, move_t *move) {
+    size_t len = strlen(uci);
+    if (len != 4 && len != 5) return false;
+
+    if (uci[0] < 'a' || uci[0] > 'h' || uci[1] < '1' || uci[1] > '8') return false;
+    if (uci[2] < 'a' || uci[2] > 'h' || uci[3] < '1' || uci[3] > '8') return false;
+
+    square_t from = square(uci[0] - 'a', uci[1] - '1');
+    square_t to = square(uci[2] - 'a', uci[3] - '1');
+
+    piece_type_t promotion = kNone;
+    if (len == 5) {
+        promotion = piece_type_from_symbol(uci[4]);
+        if (!promotion) return false;
+    }
+
+    // Castling moves are internally encoded as king captures rook.
+    if (board_piece_type_at(pos, from) == kKing && square_rank(from) == square_rank(to) &&
+            abs(square_file(to) - square_file(from)) == 2) {
+        to = square(square_file(to) > square_file(from) ? 7 : 0, square_rank(from));
+    }
+
+    move_t moves[64];
+    move_t *end = board_legal_moves(pos, moves, BB_SQUARE(from), BB_SQUARE(to));
+    for (move_t *current = moves; current < end; current++) {
+        if (move_piece_type(*current) == promotion) {
+            *move = *current;
+            return true;
+        }
+    }
+
+    return false;
+}
+
 bool board_is_en_passant(const board_t *pos, move_t move) {
     int diff = abs(move_to(move) - move_from(move));
     if (diff != 7 && diff != 9) return false;
@@ -775,17 +809,9 @@ bool board_is_castling(const board_t *pos, move_t move) {
     return BB_SQUARE(move_to(move)) & pos->occupied_co[pos->turn];
 }
 
-char *board_san(const board_t *pos, move_t move, char *san) {
-    if (!move) {
-        strcpy(san, "--");
-        return san;
-    }
-
-    board_t pos_after = *pos;
-    board_move(&pos_after, move);
-    bool check = board_checkers(&pos_after, pos_after.turn);
-    bool checkmate = check && board_is_checkmate(&pos_after);
-
+// Renders a move, given the squares of other pieces of the same type that
+// could also move to the target square, and whether it checks or mates.
+static char *board_san_render(const board_t *pos, move_t move, uint64_t others, bool check, bool checkmate, char *san) {
     // Castling.
     if (board_is_castling(pos, move)) {
         *san++ = 'O';
@@ -808,18 +834,6 @@ char *board_san(const board_t *pos, move_t move, char *san) {
         // Add piece type to SAN.
         *san++ = piece_symbol(piece_type, kWhite);
 
-        // Get ambiguous move candidates: Not exactly the current move but to
-        // the same square.
-        uint64_t from_mask = board_pieces(pos, piece_type, pos->turn) & ~BB_SQUARE(move_from(move));
-        uint64_t to_mask = BB_SQUARE(move_to(move));
-
-        uint64_t others = 0;
-        move_t moves[64];
-        move_t *end = board_legal_moves(pos, moves, from_mask, to_mask);
-        for (move_t *current = moves; current < end; current++) {
-            others |= BB_SQUARE(move_from(*current));
-        }
-
         // Disambiguate.
         if (others) {
             bool row = false, column = false;
@@ -856,6 +870,104 @@ char *board_san(const board_t *pos, move_t move, char *san) {
     return san;
 }
 
+char *board_san(const board_t *pos, move_t move, char *san) {
+    if (!move) {
+        strcpy(san, "--");
+        return san;
+    }
+
+    board_t pos_after = *pos;
+    board_move(&pos_after, move);
+    bool check = board_checkers(&pos_after, pos_after.turn);
+    bool checkmate = check && board_is_checkmate(&pos_after);
+
+    // Get ambiguous move candidates: Not exactly the current move but to
+    // the same square.
+    uint64_t others = 0;
+    piece_type_t piece_type = board_piece_type_at(pos, move_from(move));
+    if (piece_type != kPawn && !board_is_castling(pos, move)) {
+        uint64_t from_mask = board_pieces(pos, piece_type, pos->turn) & ~BB_SQUARE(move_from(move));
+        uint64_t to_mask = BB_SQUARE(move_to(move));
+
+        move_t moves[64];
+        move_t *end = board_legal_moves(pos, moves, from_mask, to_mask);
+        for (move_t *current = moves; current < end; current++) {
+            others |= BB_SQUARE(move_from(*current));
+        }
+    }
+
+    return board_san_render(pos, move, others, check, checkmate, san);
+}
+
+void board_san_all(const board_t *pos, const move_t *moves, size_t num_moves, char *sans) {
+    // Shared by all moves: the legal moves, for disambiguation.
+    move_t legal[255];
+    move_t *legal_end = board_legal_moves(pos, legal, BB_ALL, BB_ALL);
+
+    // Shared by all moves: the squares from which each piece type would
+    // give check. Moves from squares on a line to the king might discover
+    // or uncover a check, so they take the slow path, like castling and en
+    // passant.
+    uint64_t check_squares[7] = {};
+    uint64_t king_lines = 0;
+    uint64_t king = board_pieces(pos, kKing, !pos->turn);
+    if (king) {
+        uint8_t king_square = bb_lsb(king);
+        uint64_t occupied = pos->occupied[kAll];
+        check_squares[kPawn] = attacks_pawn(king_square, !pos->turn);
+        check_squares[kKnight] = attacks_knight(king_square);
+        check_squares[kBishop] = attacks_bishop(king_square, occupied);
+        check_squares[kRook] = attacks_rook(king_square, occupied);
+        check_squares[kQueen] = check_squares[kBishop] | check_squares[kRook];
+        king_lines = check_squares[kQueen];
+    }
+
+    for (size_t i = 0; i < num_moves; i++) {
+        move_t move = moves[i];
+        char *san = sans + i * LEN_SAN;
+
+        if (!move) {
+            strcpy(san, "--");
+            continue;
+        }
+
+        piece_type_t piece_type = board_piece_type_at(pos, move_from(move));
+
+        bool check;
+        if (!king) {
+            check = false;
+        } else if ((BB_SQUARE(move_from(move)) & king_lines) ||
+                board_is_castling(pos, move) || board_is_en_passant(pos, move)) {
+            board_t pos_after = *pos;
+            board_move(&pos_after, move);
+            check = board_checkers(&pos_after, pos_after.turn);
+        } else {
+            piece_type_t after = move_piece_type(move) ? move_piece_type(move) : piece_type;
+            check = BB_SQUARE(move_to(move)) & check_squares[after];
+        }
+
+        // Only checks need a look at the replies.
+        bool checkmate = false;
+        if (check) {
+            board_t pos_after = *pos;
+            board_move(&pos_after, move);
+            checkmate = board_is_checkmate(&pos_after);
+        }
+
+        uint64_t others = 0;
+        if (piece_type != kPawn) {
+            for (move_t *current = legal; current < legal_end; current++) {
+                if (move_to(*current) == move_to(move) && move_from(*current) != move_from(move) &&
+                        board_piece_type_at(pos, move_from(*current)) == piece_type) {
+                    others |= BB_SQUARE(move_from(*current));
+                }
+            }
+        }
+
+        board_san_render(pos, move, others, check, checkmate, san);
+    }
+}
+
 move_t board_legal_en_passant(const board_t *pos) {
     if (!pos->ep_square) return 0;
 
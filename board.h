@@ -2,6 +2,7 @@
 #define BOARD_H_
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "move.h"
@@ -44,10 +45,15 @@ move_t *board_pseudo_legal_moves(const struct board *pos, move_t *moves, uint64_
 move_t *board_legal_moves(const struct board *pos, move_t *moves, uint64_t from_mask, uint64_t to_mask);
 uint64_t board_zobrist_hash(const struct board *pos, const uint64_t array[]);
 bool board_parse_san(const struct board *pos, const char *san, move_t *move);
+bool board_parse_uci(const struct board *pos, const char *uci, move_t *move);
 
 static const size_t LEN_SAN = 8;
 char *board_san(const struct board *pos, move_t move, char *san);
 
+// Same as board_san() for each move, but shares the move generation. sans
+// holds num_moves buffers of LEN_SAN chars.
+void board_san_all(const struct board *pos, const move_t *moves, size_t num_moves, char *sans);
+
 extern const uint64_t POLYGLOT[];
 
 #endif  // #ifndef BOARD_H_
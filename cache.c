@@ -0,0 +1,290 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "cache.h"
+
+#define CACHE_SHARDS 16
+
+struct cache_entry {
+    struct cache_entry *next;
+
+    // Circular list, visited by the clock hand.
+    struct cache_entry *clock_prev;
+    struct cache_entry *clock_next;
+    bool referenced;
+
+    uint64_t hash;
+    size_t key_size;
+    char key[CACHE_MAX_KEY_SIZE];
+
+    struct cache_value *value;
+};
+
+struct cache_shard {
+    pthread_mutex_t lock;
+
+    struct cache_entry **buckets;
+    size_t num_buckets;
+
+    struct cache_entry *hand;
+
+    size_t budget;
+    size_t bytes;
+
+    unsigned long entries;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long insertions;
+    unsigned long evictions;
+};
+
+struct cache {
+    struct cache_shard shards[CACHE_SHARDS];
+};
+
+struct cache_value *cache_value_new(const char *data, size_t size) {
+    struct cache_value *value = malloc(sizeof(struct cache_value) + size);
+    if (!value) abort();
+
+    value->refs = 1;
+    value->size = size;
+    if (data) memcpy(value->data, data, size);
+    return value;
+}
+
+struct cache_value *cache_value_ref(struct cache_value *value) {
+    __atomic_add_fetch(&value->refs, 1, __ATOMIC_RELAXED);
+    return value;
+}
+
+void cache_value_release(struct cache_value *value) {
+    if (__atomic_sub_fetch(&value->refs, 1, __ATOMIC_ACQ_REL) == 0) free(value);
+}
+
+static uint64_t cache_hash(const char *key, size_t key_size) {
+    // FNV-1a.
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < key_size; i++) {
+        hash ^= (uint8_t) key[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static size_t cache_entry_cost(const struct cache_entry *entry) {
+    return sizeof(struct cache_entry) + sizeof(struct cache_value) + entry->value->size;
+}
+
+struct cache *cache_new(size_t budget) {
+    struct cache *cache = calloc(1, sizeof(struct cache));
+    if (!cache) abort();
+
+    for (size_t i = 0; i < CACHE_SHARDS; i++) {
+        struct cache_shard *shard = &cache->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->budget = budget / CACHE_SHARDS;
+        shard->num_buckets = 64;
+        shard->buckets = calloc(shard->num_buckets, sizeof(struct cache_entry *));
+        if (!shard->buckets) abort();
+    }
+
+    return cache;
+}
+
+void cache_free(struct cache *cache) {
+    for (size_t i = 0; i < CACHE_SHARDS; i++) {
+        struct cache_shard *shard = &cache->shards[i];
+
+        for (size_t b = 0; b < shard->num_buckets; b++) {
+            struct cache_entry *entry = shard->buckets[b];
+            while (entry) {
+                struct cache_entry *next = entry->next;
+                cache_value_release(entry->value);
+                free(entry);
+                entry = next;
+            }
+        }
+
+        free(shard->buckets);
+        pthread_mutex_destroy(&shard->lock);
+    }
+
+    free(cache);
+}
+
+static struct cache_shard *cache_shard(struct cache *cache, uint64_t hash) {
+    return &cache->shards[hash >> 60];
+}
+
+static struct cache_entry **cache_find(struct cache_shard *shard, uint64_t hash,
+                                       const char *key, size_t key_size) {
+    struct cache_entry **entry = &shard->buckets[hash & (shard->num_buckets - 1)];
+    for (; *entry; entry = &(*entry)->next) {
+        if ((*entry)->hash == hash && (*entry)->key_size == key_size &&
+                memcmp((*entry)->key, key, key_size) == 0) {
+            break;
+        }
+    }
+    return entry;
+}
+
+static void cache_grow(struct cache_shard *shard) {
+    size_t num_buckets = shard->num_buckets * 2;
+    struct cache_entry **buckets = calloc(num_buckets, sizeof(struct cache_entry *));
+    if (!buckets) abort();
+
+    for (size_t b = 0; b < shard->num_buckets; b++) {
+        struct cache_entry *entry = shard->buckets[b];
+        while (entry) {
+            struct cache_entry *next = entry->next;
+            entry->next = buckets[entry->hash & (num_buckets - 1)];
+            buckets[entry->hash & (num_buckets - 1)] = entry;
+            entry = next;
+        }
+    }
+
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->num_buckets = num_buckets;
+}
+
+static void cache_evict(struct cache_shard *shard) {
+    // Give referenced entries a second chance, evict the first one that was
+    // not touched since the hand last passed.
+    while (shard->hand->referenced) {
+        shard->hand->referenced = false;
+        shard->hand = shard->hand->clock_next;
+    }
+
+    struct cache_entry *victim = shard->hand;
+    struct cache_entry **link = cache_find(shard, victim->hash, victim->key, victim->key_size);
+    assert(*link == victim);
+    *link = victim->next;
+
+    if (victim->clock_next == victim) {
+        shard->hand = NULL;
+    } else {
+        victim->clock_prev->clock_next = victim->clock_next;
+        victim->clock_next->clock_prev = victim->clock_prev;
+        shard->hand = victim->clock_next;
+    }
+
+    shard->bytes -= cache_entry_cost(victim);
+    shard->entries--;
+    shard->evictions++;
+
+    cache_value_release(victim->value);
+    free(victim);
+}
+
+struct cache_value *cache_get(struct cache *cache, const char *key, size_t key_size) {
+    uint64_t hash = cache_hash(key, key_size);
+    struct cache_shard *shard = cache_shard(cache, hash);
+    struct cache_value *value = NULL;
+
+    pthread_mutex_lock(&shard->lock);
+    struct cache_entry *entry = *cache_find(shard, hash, key, key_size);
+    if (entry) {
+        entry->referenced = true;
+        value = cache_value_ref(entry->value);
+        shard->hits++;
+    } else {
+        shard->misses++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    return value;
+}
+
+void cache_put(struct cache *cache, const char *key, size_t key_size, struct cache_value *value) {
+    if (key_size > CACHE_MAX_KEY_SIZE) return;
+
+    uint64_t hash = cache_hash(key, key_size);
+    struct cache_shard *shard = cache_shard(cache, hash);
+
+    pthread_mutex_lock(&shard->lock);
+
+    struct cache_entry *entry = *cache_find(shard, hash, key, key_size);
+    if (entry) {
+        // Replace the value of an existing entry.
+        shard->bytes -= cache_entry_cost(entry);
+        cache_value_release(entry->value);
+        entry->value = cache_value_ref(value);
+        shard->bytes += cache_entry_cost(entry);
+    } else {
+        size_t cost = sizeof(struct cache_entry) + sizeof(struct cache_value) + value->size;
+        if (cost > shard->budget) {
+            pthread_mutex_unlock(&shard->lock);
+            return;
+        }
+
+        entry = malloc(sizeof(struct cache_entry));
+        if (!entry) abort();
+
+        entry->hash = hash;
+        entry->key_size = key_size;
+        memcpy(entry->key, key, key_size);
+        entry->value = cache_value_ref(value);
+        entry->referenced = false;
+
+        if (shard->entries >= shard->num_buckets) cache_grow(shard);
+
+        struct cache_entry **bucket = &shard->buckets[hash & (shard->num_buckets - 1)];
+        entry->next = *bucket;
+        *bucket = entry;
+
+        // Insert right behind the hand, so that the entry is visited last.
+        if (shard->hand) {
+            entry->clock_next = shard->hand;
+            entry->clock_prev = shard->hand->clock_prev;
+            entry->clock_prev->clock_next = entry;
+            shard->hand->clock_prev = entry;
+        } else {
+            entry->clock_next = entry->clock_prev = entry;
+            shard->hand = entry;
+        }
+
+        shard->bytes += cost;
+        shard->entries++;
+        shard->insertions++;
+    }
+
+    while (shard->bytes > shard->budget) cache_evict(shard);
+
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void cache_stats(struct cache *cache, struct cache_stats *stats) {
+    memset(stats, 0, sizeof(struct cache_stats));
+
+    for (size_t i = 0; i < CACHE_SHARDS; i++) {
+        struct cache_shard *shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->insertions += shard->insertions;
+        stats->evictions += shard->evictions;
+        stats->entries += shard->entries;
+        stats->bytes += shard->bytes;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+void cache_foreach(struct cache *cache,
+                   void (*visit)(const char *key, size_t key_size, const struct cache_value *value, void *opq),
+                   void *opq) {
+    for (size_t i = 0; i < CACHE_SHARDS; i++) {
+        struct cache_shard *shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+
+        for (size_t b = 0; b < shard->num_buckets; b++) {
+            for (struct cache_entry *entry = shard->buckets[b]; entry; entry = entry->next) {
+                visit(entry->key, entry->key_size, entry->value, opq);
+            }
+        }
+
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
@@ -0,0 +1,48 @@
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+static const size_t CACHE_MAX_KEY_SIZE = 32;
+
+// Immutable, reference counted blob. Values handed out by cache_get() stay
+// valid until released, even if the entry is evicted in the meantime.
+struct cache_value {
+    int refs;
+    size_t size;
+    char data[];
+};
+
+struct cache_value *cache_value_new(const char *data, size_t size);
+struct cache_value *cache_value_ref(struct cache_value *value);
+void cache_value_release(struct cache_value *value);
+
+struct cache_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long insertions;
+    unsigned long evictions;
+    unsigned long entries;
+    size_t bytes;
+};
+
+struct cache;
+
+// Thread safe, sharded cache with CLOCK eviction. The budget covers keys,
+// values and per entry overhead.
+struct cache *cache_new(size_t budget);
+void cache_free(struct cache *cache);
+
+struct cache_value *cache_get(struct cache *cache, const char *key, size_t key_size);
+void cache_put(struct cache *cache, const char *key, size_t key_size, struct cache_value *value);
+
+void cache_stats(struct cache *cache, struct cache_stats *stats);
+
+// Visits all entries. Must not call back into the cache.
+void cache_foreach(struct cache *cache,
+                   void (*visit)(const char *key, size_t key_size, const struct cache_value *value, void *opq),
+                   void *opq);
+
+#endif  // #ifndef CACHE_H_
@@ -0,0 +1,124 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <zlib.h>
+#include <brotli/encode.h>
+
+#include "compress.h"
+
+// Compressed variants are computed once and then cached, so spend the CPU.
+static const int GZIP_LEVEL = 9;
+static const int BROTLI_QUALITY = 9;
+
+// Quality value of a single Accept-Encoding element, like "br;q=0.5".
+static double compress_quality(const char *params, size_t len) {
+    const char *q = NULL;
+    for (const char *c = params; c + 1 < params + len; c++) {
+        if ((c[0] == 'q' || c[0] == 'Q') && c[1] == '=') q = c + 2;
+    }
+    return q ? atof(q) : 1.0;
+}
+
+enum content_encoding compress_negotiate(const char *accept_encoding) {
+    if (!accept_encoding) return ENCODING_IDENTITY;
+
+    // Negative until mentioned. An explicit quality, even q=0, takes
+    // precedence over the wildcard.
+    double gzip = -1, brotli = -1, wildcard = -1;
+
+    const char *element = accept_encoding;
+    while (*element) {
+        size_t len = strcspn(element, ",");
+
+        // Split coding and parameters.
+        while (*element == ' ' && len) element++, len--;
+        size_t coding_len = strcspn(element, ";, ");
+        if (coding_len > len) coding_len = len;
+
+        double quality = compress_quality(element + coding_len, len - coding_len);
+        if (coding_len == 2 && strncasecmp(element, "br", 2) == 0) brotli = quality;
+        else if (coding_len == 4 && strncasecmp(element, "gzip", 4) == 0) gzip = quality;
+        else if (coding_len == 1 && element[0] == '*') wildcard = quality;
+
+        element += len;
+        if (*element == ',') element++;
+    }
+
+    if (gzip < 0) gzip = wildcard;
+    if (brotli < 0) brotli = wildcard;
+
+    if (brotli > 0 && brotli >= gzip) return ENCODING_BROTLI;
+    if (gzip > 0) return ENCODING_GZIP;
+    return ENCODING_IDENTITY;
+}
+
+const char *compress_encoding_name(enum content_encoding encoding) {
+    switch (encoding) {
+        case ENCODING_GZIP:
+            return "gzip";
+        case ENCODING_BROTLI:
+            return "br";
+        default:
+            return "identity";
+    }
+}
+
+// Compression runs into per thread scratch space of the worst case size.
+// Cached values get exactly the compressed size, so that the cache budget
+// accounts for what is really allocated.
+static __thread char *scratch = NULL;
+static __thread size_t scratch_size = 0;
+
+static char *compress_scratch(size_t size) {
+    if (size > scratch_size) {
+        free(scratch);
+        scratch = malloc(size);
+        if (!scratch) abort();
+        scratch_size = size;
+    }
+    return scratch;
+}
+
+static struct cache_value *compress_gzip(const char *data, size_t size) {
+    z_stream stream = {};
+    if (deflateInit2(&stream, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) abort();
+
+    size_t bound = deflateBound(&stream, size) + 32;
+    char *out = compress_scratch(bound);
+
+    stream.next_in = (Bytef *) data;
+    stream.avail_in = size;
+    stream.next_out = (Bytef *) out;
+    stream.avail_out = bound;
+
+    if (deflate(&stream, Z_FINISH) != Z_STREAM_END) abort();
+    struct cache_value *value = cache_value_new(out, stream.total_out);
+    deflateEnd(&stream);
+    return value;
+}
+
+static struct cache_value *compress_brotli(const char *data, size_t size) {
+    size_t encoded_size = BrotliEncoderMaxCompressedSize(size);
+    if (!encoded_size) abort();
+
+    char *out = compress_scratch(encoded_size);
+    if (!BrotliEncoderCompress(BROTLI_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_GENERIC,
+                               size, (const uint8_t *) data,
+                               &encoded_size, (uint8_t *) out)) {
+        abort();
+    }
+
+    return cache_value_new(out, encoded_size);
+}
+
+struct cache_value *compress_value(const char *data, size_t size, enum content_encoding encoding) {
+    switch (encoding) {
+        case ENCODING_GZIP:
+            return compress_gzip(data, size);
+        case ENCODING_BROTLI:
+            return compress_brotli(data, size);
+        default:
+            return cache_value_new(data, size);
+    }
+}
@@ -0,0 +1,24 @@
+#ifndef COMPRESS_H_
+#define COMPRESS_H_
+
+#include <stddef.h>
+
+#include "cache.h"
+
+// Smaller bodies are not worth the framing overhead.
+static const size_t COMPRESS_MIN_SIZE = 256;
+
+enum content_encoding {
+    ENCODING_IDENTITY,
+    ENCODING_GZIP,
+    ENCODING_BROTLI,
+};
+
+// Pick the best supported encoding from an Accept-Encoding header.
+enum content_encoding compress_negotiate(const char *accept_encoding);
+
+const char *compress_encoding_name(enum content_encoding encoding);
+
+struct cache_value *compress_value(const char *data, size_t size, enum content_encoding encoding);
+
+#endif  // #ifndef COMPRESS_H_
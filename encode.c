@@ -64,17 +64,28 @@ const uint8_t *decode_uint48(const uint8_t *buffer, uint64_t *value) {
 
 static const char BASE_62[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
 
-uint8_t *encode_game_id(uint8_t *buffer, const char *game_id) {
-    uint64_t bytes = 0;
+// A leading _ stands for the digit 62, above any lichess id. Games without
+// a lichess id get those.
+bool game_id_number(const char *game_id, uint64_t *number) {
+    *number = 0;
 
     for (int i = 0; i < 8; i++) {
-        bytes = bytes * 62;
-        if (game_id[i] >= '0' && game_id[i] <= '9') bytes += game_id[i] - '0';
-        else if (game_id[i] >= 'A' && game_id[i] <= 'Z') bytes += game_id[i] - 'A' + 10;
-        else if (game_id[i] >= 'a' && game_id[i] <= 'z') bytes += game_id[i] - 'a' + 10 + 26;
-        else assert(false);
+        *number = *number * 62;
+        if (i == 0 && game_id[i] == '_') *number += 62;
+        else if (game_id[i] >= '0' && game_id[i] <= '9') *number += game_id[i] - '0';
+        else if (game_id[i] >= 'A' && game_id[i] <= 'Z') *number += game_id[i] - 'A' + 10;
+        else if (game_id[i] >= 'a' && game_id[i] <= 'z') *number += game_id[i] - 'a' + 10 + 26;
+        else return false;
     }
 
+    return true;
+}
+
+uint8_t *encode_game_id(uint8_t *buffer, const char *game_id) {
+    uint64_t bytes;
+    bool valid = game_id_number(game_id, &bytes);
+    assert(valid);
+
     return encode_uint48(buffer, bytes);
 }
 
@@ -82,11 +93,12 @@ const uint8_t *decode_game_id(const uint8_t *buffer, char *game_id) {
     uint64_t bytes;
     buffer = decode_uint48(buffer, &bytes);
 
-    for (int i = 7; i >= 0; i--) {
+    for (int i = 7; i >= 1; i--) {
         lldiv_t r = lldiv(bytes, 62);
         game_id[i] = BASE_62[r.rem];
         bytes = r.quot;
     }
+    game_id[0] = bytes < 62 ? BASE_62[bytes] : '_';
 
     game_id[8] = 0;
 
@@ -109,15 +121,21 @@ void master_record_free(struct master_record *record) {
     free(record);
 }
 
-void master_record_add_move(struct master_record *record,
-                            move_t move, const struct master_ref *ref, int wdl) {
+static int cmp_master_refs(const void *l, const void *r);
 
+static void master_record_add_ref(struct master_record *record, const struct master_ref *ref) {
     if (record->num_refs < MASTER_MAX_REFS) {
         record->refs[record->num_refs++] = *ref;
-    } else if (record->refs[MASTER_MAX_REFS - 1].average_rating <= ref->average_rating) {
+    } else if (cmp_master_refs(ref, &record->refs[MASTER_MAX_REFS - 1]) < 0) {
         // Replace lowest rated game.
         record->refs[MASTER_MAX_REFS - 1] = *ref;
     }
+}
+
+void master_record_add_move(struct master_record *record,
+                            move_t move, const struct master_ref *ref, int wdl) {
+
+    master_record_add_ref(record, ref);
 
     for (size_t i = 0; i < record->num_moves; i++) {
         if (record->moves[i].move == move) {
@@ -147,6 +165,39 @@ void master_record_add_move(struct master_record *record,
     master_record_sort(record);
 }
 
+static void master_record_sort_refs(struct master_record *record);
+
+void master_record_merge(struct master_record *record, const struct master_record *other) {
+    // Refs and moves are totally ordered, so the result does not depend on
+    // the order of merges.
+    for (size_t i = 0; i < other->num_refs; i++) {
+        master_record_add_ref(record, &other->refs[i]);
+        master_record_sort_refs(record);
+    }
+
+    for (size_t i = 0; i < other->num_moves; i++) {
+        const struct move_stats *stats = &other->moves[i];
+
+        size_t j = 0;
+        while (j < record->num_moves && record->moves[j].move != stats->move) j++;
+
+        if (j == record->num_moves) {
+            struct move_stats *moves =
+                realloc(record->moves, sizeof(struct move_stats) * (record->num_moves + 1));
+            if (!moves) abort();
+            record->moves = moves;
+            record->moves[record->num_moves++] = *stats;
+        } else {
+            record->moves[j].white += stats->white;
+            record->moves[j].draws += stats->draws;
+            record->moves[j].black += stats->black;
+            record->moves[j].average_rating_sum += stats->average_rating_sum;
+        }
+    }
+
+    master_record_sort(record);
+}
+
 uint8_t *encode_master_record(uint8_t *buffer, const struct master_record *record) {
     buffer = encode_uint(buffer, record->num_refs);
 
@@ -235,7 +286,7 @@ static int cmp_move_stats(const void *l, const void *r) {
     unsigned long b_total = b->white + b->draws + b->black;
     if (a_total < b_total) return 1;
     else if (a_total > b_total) return -1;
-    else return 0;
+    else return (a->move > b->move) - (a->move < b->move);
 }
 
 static int cmp_master_refs(const void *l, const void *r) {
@@ -243,12 +294,16 @@ static int cmp_master_refs(const void *l, const void *r) {
     const struct master_ref *b = (struct master_ref *) r;
     if (a->average_rating < b->average_rating) return 1;
     else if (a->average_rating > b->average_rating) return -1;
-    else return 0;
+    else return memcmp(a->game_id, b->game_id, 8);
+}
+
+static void master_record_sort_refs(struct master_record *record) {
+    qsort(record->refs, record->num_refs, sizeof(struct master_ref), cmp_master_refs);
 }
 
 void master_record_sort(struct master_record *record) {
     qsort(record->moves, record->num_moves, sizeof(struct move_stats), cmp_move_stats);
-    qsort(record->refs, record->num_refs, sizeof(struct master_ref), cmp_master_refs);
+    master_record_sort_refs(record);
 }
 
 unsigned long master_record_white(const struct master_record *record) {
@@ -2,6 +2,7 @@
 #define ENCODE_H_
 
 #include <stdint.h>
+#include <stdbool.h>
 
 #include "move.h"
 
@@ -11,6 +12,7 @@ const uint8_t *decode_uint(const uint8_t *buffer, unsigned long *value);
 uint8_t *encode_uint48(uint8_t *buffer, uint64_t value);
 const uint8_t *decode_uint48(const uint8_t *buffer, uint64_t *value);
 
+bool game_id_number(const char *game_id, uint64_t *number);
 uint8_t *encode_game_id(uint8_t *buffer, const char *game_id);
 const uint8_t *decode_game_id(const uint8_t *buffer, char *game_id);
 
@@ -43,6 +45,9 @@ struct master_record *master_record_new();
 void master_record_add_move(struct master_record *record,
                             move_t move, const struct master_ref *ref, int wdl);
 
+// Adds the games of other, as if they had been added after those of record.
+void master_record_merge(struct master_record *record, const struct master_record *other);
+
 uint8_t *encode_master_record(uint8_t *buffer, const struct master_record *record);
 const uint8_t *decode_master_record(const uint8_t *buffer, struct master_record *record);
 void master_record_print(const struct master_record *record);
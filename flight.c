@@ -0,0 +1,102 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "flight.h"
+
+#define FLIGHT_BUCKETS 1024
+
+struct flight_entry {
+    struct flight_entry *next;
+
+    size_t key_size;
+    char key[FLIGHT_MAX_KEY_SIZE];
+
+    struct iopool_job *waiters;
+    struct iopool_job *last_waiter;
+};
+
+struct flight {
+    pthread_mutex_t lock;
+    struct flight_entry *buckets[FLIGHT_BUCKETS];
+};
+
+static uint64_t flight_hash(const char *key, size_t key_size) {
+    // FNV-1a.
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < key_size; i++) {
+        hash ^= (unsigned char) key[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static struct flight_entry **flight_find(struct flight *flight, const char *key, size_t key_size) {
+    struct flight_entry **entry = &flight->buckets[flight_hash(key, key_size) % FLIGHT_BUCKETS];
+    while (*entry && ((*entry)->key_size != key_size || memcmp((*entry)->key, key, key_size) != 0)) {
+        entry = &(*entry)->next;
+    }
+    return entry;
+}
+
+struct flight *flight_new(void) {
+    struct flight *flight = calloc(1, sizeof(struct flight));
+    if (!flight) abort();
+
+    pthread_mutex_init(&flight->lock, NULL);
+    return flight;
+}
+
+void flight_free(struct flight *flight) {
+    for (size_t b = 0; b < FLIGHT_BUCKETS; b++) {
+        while (flight->buckets[b]) {
+            struct flight_entry *next = flight->buckets[b]->next;
+            free(flight->buckets[b]);
+            flight->buckets[b] = next;
+        }
+    }
+
+    pthread_mutex_destroy(&flight->lock);
+    free(flight);
+}
+
+bool flight_join(struct flight *flight, const char *key, size_t key_size, struct iopool_job *job) {
+    assert(key_size <= FLIGHT_MAX_KEY_SIZE);
+
+    pthread_mutex_lock(&flight->lock);
+    struct flight_entry **entry = flight_find(flight, key, key_size);
+
+    if (*entry) {
+        job->next = NULL;
+        if ((*entry)->last_waiter) (*entry)->last_waiter->next = job;
+        else (*entry)->waiters = job;
+        (*entry)->last_waiter = job;
+        pthread_mutex_unlock(&flight->lock);
+        return false;
+    }
+
+    struct flight_entry *leader = calloc(1, sizeof(struct flight_entry));
+    if (!leader) abort();
+    leader->key_size = key_size;
+    memcpy(leader->key, key, key_size);
+    *entry = leader;
+
+    pthread_mutex_unlock(&flight->lock);
+    return true;
+}
+
+struct iopool_job *flight_land(struct flight *flight, const char *key, size_t key_size) {
+    pthread_mutex_lock(&flight->lock);
+    struct flight_entry **entry = flight_find(flight, key, key_size);
+
+    struct flight_entry *leader = *entry;
+    assert(leader);
+    *entry = leader->next;
+    pthread_mutex_unlock(&flight->lock);
+
+    struct iopool_job *waiters = leader->waiters;
+    free(leader);
+    return waiters;
+}
@@ -0,0 +1,29 @@
+#ifndef FLIGHT_H_
+#define FLIGHT_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "iopool.h"
+
+static const size_t FLIGHT_MAX_KEY_SIZE = 64;
+
+// Single-flight table: identical lookups that arrive while the first one is
+// still in progress wait for its result instead of repeating the work.
+
+struct flight;
+
+struct flight *flight_new(void);
+
+// Waiters of flights that have not landed are dropped.
+void flight_free(struct flight *flight);
+
+// Returns true if the job is the first for the key and should do the work.
+// Otherwise the job has been queued behind it.
+bool flight_join(struct flight *flight, const char *key, size_t key_size, struct iopool_job *job);
+
+// Called by the leader once done. Returns the waiters in arrival order,
+// linked by next, and forgets the key.
+struct iopool_job *flight_land(struct flight *flight, const char *key, size_t key_size);
+
+#endif  // #ifndef FLIGHT_H_
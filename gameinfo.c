@@ -0,0 +1,234 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "encode.h"
+#include "gameinfo.h"
+
+static const char GAMEINFO_MAGIC[8] = "MSTRINFO";
+static const uint32_t GAMEINFO_VERSION = 1;
+
+struct gameinfo_table {
+    const char *data;
+    size_t size;
+
+    const struct gameinfo_entry *entries;
+    uint32_t num_games;
+
+    const char *pool;
+    uint64_t pool_size;
+};
+
+struct gameinfo_table *gameinfo_open(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < sizeof(struct gameinfo_header)) {
+        close(fd);
+        return NULL;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return NULL;
+
+    const struct gameinfo_header *header = data;
+    if (memcmp(header->magic, GAMEINFO_MAGIC, 8) != 0 ||
+            header->version != GAMEINFO_VERSION ||
+            sizeof(struct gameinfo_header) + header->num_games * sizeof(struct gameinfo_entry) > header->pool_offset ||
+            header->pool_offset + header->pool_size > st.st_size) {
+        munmap(data, st.st_size);
+        return NULL;
+    }
+
+    struct gameinfo_table *table = malloc(sizeof(struct gameinfo_table));
+    if (!table) abort();
+
+    table->data = data;
+    table->size = st.st_size;
+    table->entries = (const struct gameinfo_entry *) (table->data + sizeof(struct gameinfo_header));
+    table->num_games = header->num_games;
+    table->pool = table->data + header->pool_offset;
+    table->pool_size = header->pool_size;
+    return table;
+}
+
+void gameinfo_close(struct gameinfo_table *table) {
+    munmap((void *) table->data, table->size);
+    free(table);
+}
+
+const struct gameinfo_entry *gameinfo_find(const struct gameinfo_table *table, const char *game_id) {
+    uint64_t id;
+    if (!game_id_number(game_id, &id)) return NULL;
+
+    size_t lo = 0, hi = table->num_games;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (table->entries[mid].id < id) lo = mid + 1;
+        else if (table->entries[mid].id > id) hi = mid;
+        else return &table->entries[mid];
+    }
+
+    return NULL;
+}
+
+const char *gameinfo_string(const struct gameinfo_table *table, uint32_t offset) {
+    if (offset >= table->pool_size) return "";
+    return table->pool + offset;
+}
+
+size_t gameinfo_size(const struct gameinfo_table *table) {
+    return table->num_games;
+}
+
+struct gameinfo_writer {
+    struct gameinfo_entry *entries;
+    size_t num_games;
+    size_t capacity;
+
+    char *pool;
+    size_t pool_size;
+    size_t pool_capacity;
+
+    // Open addressing, pool offset + 1 per slot, 0 for empty slots.
+    uint32_t *strings;
+    size_t num_strings;
+    size_t strings_capacity;
+};
+
+struct gameinfo_writer *gameinfo_writer_new() {
+    struct gameinfo_writer *writer = calloc(1, sizeof(struct gameinfo_writer));
+    if (!writer) abort();
+
+    writer->strings_capacity = 1024;
+    writer->strings = calloc(writer->strings_capacity, sizeof(uint32_t));
+    if (!writer->strings) abort();
+
+    return writer;
+}
+
+void gameinfo_writer_free(struct gameinfo_writer *writer) {
+    free(writer->entries);
+    free(writer->pool);
+    free(writer->strings);
+    free(writer);
+}
+
+static uint64_t gameinfo_string_hash(const char *value) {
+    // FNV-1a.
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (; *value; value++) {
+        hash ^= (uint8_t) *value;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static void gameinfo_strings_insert(uint32_t *strings, size_t capacity, const char *pool, uint32_t offset) {
+    size_t slot = gameinfo_string_hash(pool + offset) & (capacity - 1);
+    while (strings[slot]) slot = (slot + 1) & (capacity - 1);
+    strings[slot] = offset + 1;
+}
+
+static uint32_t gameinfo_intern(struct gameinfo_writer *writer, const char *value) {
+    size_t slot = gameinfo_string_hash(value) & (writer->strings_capacity - 1);
+    for (; writer->strings[slot]; slot = (slot + 1) & (writer->strings_capacity - 1)) {
+        uint32_t offset = writer->strings[slot] - 1;
+        if (strcmp(writer->pool + offset, value) == 0) return offset;
+    }
+
+    // Append to pool.
+    size_t len = strlen(value) + 1;
+    if (writer->pool_size + len > writer->pool_capacity) {
+        writer->pool_capacity = writer->pool_capacity ? writer->pool_capacity * 2 : 64 * 1024;
+        while (writer->pool_size + len > writer->pool_capacity) writer->pool_capacity *= 2;
+        writer->pool = realloc(writer->pool, writer->pool_capacity);
+        if (!writer->pool) abort();
+    }
+
+    uint32_t offset = writer->pool_size;
+    memcpy(writer->pool + offset, value, len);
+    writer->pool_size += len;
+
+    writer->strings[slot] = offset + 1;
+    writer->num_strings++;
+
+    // Keep the load factor below 1/2.
+    if (2 * writer->num_strings > writer->strings_capacity) {
+        size_t capacity = writer->strings_capacity * 2;
+        uint32_t *strings = calloc(capacity, sizeof(uint32_t));
+        if (!strings) abort();
+
+        for (size_t i = 0; i < writer->strings_capacity; i++) {
+            if (writer->strings[i]) {
+                gameinfo_strings_insert(strings, capacity, writer->pool, writer->strings[i] - 1);
+            }
+        }
+
+        free(writer->strings);
+        writer->strings = strings;
+        writer->strings_capacity = capacity;
+    }
+
+    return offset;
+}
+
+void gameinfo_writer_add(struct gameinfo_writer *writer, const char *game_id, const struct pgn_game_info *game_info) {
+    // Games without player names are never shown as top games.
+    uint64_t id;
+    if (!game_info->white || !game_info->black || !game_id_number(game_id, &id)) return;
+
+    if (writer->num_games == writer->capacity) {
+        writer->capacity = writer->capacity ? writer->capacity * 2 : 1024;
+        writer->entries = realloc(writer->entries, writer->capacity * sizeof(struct gameinfo_entry));
+        if (!writer->entries) abort();
+    }
+
+    struct gameinfo_entry *entry = &writer->entries[writer->num_games++];
+    memset(entry, 0, sizeof(struct gameinfo_entry));
+    entry->id = id;
+    entry->white = gameinfo_intern(writer, game_info->white);
+    entry->black = gameinfo_intern(writer, game_info->black);
+    entry->white_elo = game_info->white_elo;
+    entry->black_elo = game_info->black_elo;
+    entry->year = game_info->year;
+    entry->result = game_info->result;
+}
+
+static int cmp_gameinfo_entry(const void *l, const void *r) {
+    const struct gameinfo_entry *a = (struct gameinfo_entry *) l;
+    const struct gameinfo_entry *b = (struct gameinfo_entry *) r;
+    return (a->id > b->id) - (a->id < b->id);
+}
+
+bool gameinfo_writer_write(struct gameinfo_writer *writer, const char *path) {
+    qsort(writer->entries, writer->num_games, sizeof(struct gameinfo_entry), cmp_gameinfo_entry);
+
+    struct gameinfo_header header = {};
+    memcpy(header.magic, GAMEINFO_MAGIC, 8);
+    header.version = GAMEINFO_VERSION;
+    header.num_games = writer->num_games;
+    header.pool_offset = sizeof(struct gameinfo_header) + writer->num_games * sizeof(struct gameinfo_entry);
+    header.pool_size = writer->pool_size;
+
+    // Write to a temporary file first, so that readers never map a
+    // partially written table.
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    FILE *file = fopen(tmp_path, "wb");
+    if (!file) return false;
+
+    bool ok = 1 == fwrite(&header, sizeof(header), 1, file);
+    if (writer->num_games) ok = ok && writer->num_games == fwrite(writer->entries, sizeof(struct gameinfo_entry), writer->num_games, file);
+    if (writer->pool_size) ok = ok && writer->pool_size == fwrite(writer->pool, 1, writer->pool_size, file);
+    ok = (fclose(file) == 0) && ok;
+
+    return ok && rename(tmp_path, path) == 0;
+}
@@ -0,0 +1,52 @@
+#ifndef GAMEINFO_H_
+#define GAMEINFO_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "pgn.h"
+
+// Compact, memory mapped table with the header information of every game
+// in master-pgn.kct, so that top games can be resolved without reading and
+// parsing PGNs.
+//
+// Layout: header, entries sorted by 48-bit encoded game id, string pool
+// with interned, NUL terminated player names.
+
+struct gameinfo_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_games;
+    uint64_t pool_offset;
+    uint64_t pool_size;
+};
+
+struct gameinfo_entry {
+    uint64_t id;
+    uint32_t white;  // Offset into the string pool.
+    uint32_t black;
+    uint16_t white_elo;
+    uint16_t black_elo;
+    uint16_t year;
+    int8_t result;
+    uint8_t reserved;
+};
+
+struct gameinfo_table;
+
+struct gameinfo_table *gameinfo_open(const char *path);
+void gameinfo_close(struct gameinfo_table *table);
+
+const struct gameinfo_entry *gameinfo_find(const struct gameinfo_table *table, const char *game_id);
+const char *gameinfo_string(const struct gameinfo_table *table, uint32_t offset);
+size_t gameinfo_size(const struct gameinfo_table *table);
+
+struct gameinfo_writer;
+
+struct gameinfo_writer *gameinfo_writer_new();
+void gameinfo_writer_add(struct gameinfo_writer *writer, const char *game_id, const struct pgn_game_info *game_info);
+bool gameinfo_writer_write(struct gameinfo_writer *writer, const char *path);
+void gameinfo_writer_free(struct gameinfo_writer *writer);
+
+#endif  // #ifndef GAMEINFO_H_
@@ -1,34 +1,179 @@
 #include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <kclangc.h>
 
+#include "aggregate.h"
 #include "attacks.h"
 #include "board.h"
 #include "encode.h"
+#include "gameinfo.h"
+#include "pgn.h"
+#include "pgnfile.h"
+#include "pgnstore.h"
+#include "queue.h"
 
-static char master_entry_buffer[8000] = {};
+// Per thread, because shards are written concurrently.
+static __thread char master_entry_buffer[8000] = {};
 
 static KCDB *master_db;
 
+// Positions are aggregated in memory, one table per shard, and written once
+// at the end. Over budget, tables spill sorted runs next to master.kch.
+static size_t aggregate_budget = 1024 * 1024 * 1024;
+static struct aggregate **aggregates;
+
+static struct gameinfo_writer *gameinfo_writer;
+static struct pgnstore_writer *pgnstore_writer;
+
+// Games already counted in master.kch, so that updates never count a game
+// twice. Stored with the records, under a key that no position hash can
+// collide with, and committed in the same transaction.
+static const char INDEXED_GAMES_KEY[] = "indexed-games";
+
+struct game_set {
+    char (*game_ids)[8];
+    size_t size;
+    size_t capacity;
+};
+
+static bool update = false;
+static struct game_set indexed_games;  // sorted, from previous runs
+static struct game_set new_games;
+static size_t num_skipped = 0;
+
+static void game_set_add(struct game_set *set, const char *game_id) {
+    if (set->size == set->capacity) {
+        set->capacity = set->capacity ? set->capacity * 2 : 1024;
+        set->game_ids = realloc(set->game_ids, set->capacity * 8);
+        if (!set->game_ids) abort();
+    }
+    memcpy(set->game_ids[set->size++], game_id, 8);
+}
+
+static int cmp_game_id(const void *l, const void *r) {
+    return memcmp(l, r, 8);
+}
+
+static bool game_set_contains(const struct game_set *set, const char *game_id) {
+    return bsearch(game_id, set->game_ids, set->size, 8, cmp_game_id) != NULL;
+}
+
+static bool read_indexed_games(void) {
+    size_t size;
+    char *value = kcdbget(master_db, INDEXED_GAMES_KEY, strlen(INDEXED_GAMES_KEY), &size);
+    if (!value) return false;
+
+    for (size_t i = 0; i + 8 <= size; i += 8) game_set_add(&indexed_games, value + i);
+    kcfree(value);
+    return true;
+}
+
+static bool write_indexed_games(void) {
+    // Merge with the new games. Both are sorted and disjoint.
+    qsort(new_games.game_ids, new_games.size, 8, cmp_game_id);
+
+    size_t size = indexed_games.size + new_games.size;
+    char *value = malloc(size * 8 + 1);
+    if (!value) abort();
+
+    size_t i = 0, j = 0;
+    for (size_t k = 0; k < size; k++) {
+        bool old = j == new_games.size || (i < indexed_games.size && cmp_game_id(indexed_games.game_ids[i], new_games.game_ids[j]) < 0);
+        memcpy(value + k * 8, old ? indexed_games.game_ids[i++] : new_games.game_ids[j++], 8);
+    }
+
+    bool ok = kcdbset(master_db, INDEXED_GAMES_KEY, strlen(INDEXED_GAMES_KEY), value, size * 8);
+    free(value);
+    return ok;
+}
+
+// Returns false for games that are already counted.
+static bool claim_game(const char *game_id) {
+    if (game_set_contains(&indexed_games, game_id)) {
+        num_skipped++;
+        return false;
+    }
+
+    game_set_add(&new_games, game_id);
+    return true;
+}
+
 struct master_delta {
+    uint64_t zobrist_hash;
     move_t move;
     struct master_ref ref;
     int result;
 };
 
+struct delta_list {
+    struct master_delta *deltas;
+    size_t size;
+    size_t capacity;
+};
+
+static void delta_list_push(struct delta_list *list, const struct master_delta *delta) {
+    if (list->size == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 1024;
+        list->deltas = realloc(list->deltas, list->capacity * sizeof(struct master_delta));
+        if (!list->deltas) abort();
+    }
+    list->deltas[list->size++] = *delta;
+}
+
+// Aggregated records on their way to master.kch, encoded, in ascending
+// order of hashes.
+static const size_t MASTER_BATCH_SIZE = 1024;
+
+struct master_batch {
+    size_t size;
+    uint64_t *hashes;
+    KCSTR *keys;
+    size_t *offsets;
+    size_t *sizes;
+
+    uint8_t *data;
+    size_t data_size;
+    size_t data_capacity;
+};
+
+static const uint8_t *master_batch_find(const struct master_batch *batch, const char *hash, size_t *size) {
+    uint64_t zobrist_hash;
+    memcpy(&zobrist_hash, hash, sizeof(uint64_t));
+
+    size_t lo = 0, hi = batch->size;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (batch->hashes[mid] < zobrist_hash) lo = mid + 1;
+        else if (batch->hashes[mid] > zobrist_hash) hi = mid;
+        else {
+            *size = batch->sizes[mid];
+            return batch->data + batch->offsets[mid];
+        }
+    }
+
+    abort();
+}
+
 const char *merge_master_full(const char *hash, size_t hash_size,
                               const char *buf, size_t buf_size,
                               size_t *sp, void *opq) {
 
-    const struct master_delta *delta = (struct master_delta *) opq;
+    size_t size;
+    const uint8_t *encoded = master_batch_find((const struct master_batch *) opq, hash, &size);
 
     struct master_record *record = master_record_new();
+    struct master_record *delta = master_record_new();
     decode_master_record((const uint8_t *) buf, record);
-    master_record_add_move(record, delta->move, &delta->ref, delta->result);
+    decode_master_record(encoded, delta);
+    master_record_merge(record, delta);
 
     char *end = (char *) encode_master_record((uint8_t *) master_entry_buffer, record);
     *sp = end - master_entry_buffer;
     master_record_free(record);
+    master_record_free(delta);
 
     return master_entry_buffer;
 }
@@ -36,114 +181,727 @@ const char *merge_master_full(const char *hash, size_t hash_size,
 const char *merge_master_empty(const char *hash, size_t hash_size,
                                size_t *sp, void *opq) {
 
-    const struct master_delta *delta = (struct master_delta *) opq;
+    return (const char *) master_batch_find((const struct master_batch *) opq, hash, sp);
+}
 
-    struct master_record *record = master_record_new();
-    master_record_add_move(record, delta->move, &delta->ref, delta->result);
+static void master_batch_flush(struct master_batch *batch) {
+    for (size_t i = 0; i < batch->size; i++) {
+        batch->keys[i].buf = (char *) &batch->hashes[i];
+        batch->keys[i].size = sizeof(uint64_t);
+    }
 
-    char *end = (char *) encode_master_record((uint8_t *) master_entry_buffer, record);
-    *sp = end - master_entry_buffer;
-    master_record_free(record);
+    if (batch->size && !kcdbacceptbulk(master_db, batch->keys, batch->size,
+                                       merge_master_full, merge_master_empty,
+                                       batch, true)) {
+        printf("master.kch accept error: %s\n", kcecodename(kcdbecode(master_db)));
+        abort();
+    }
 
-    return master_entry_buffer;
+    batch->size = 0;
+    batch->data_size = 0;
+}
+
+static void write_master_record(uint64_t zobrist_hash, const struct master_record *record, void *opq) {
+    struct master_batch *batch = opq;
+
+    if (batch->data_size + sizeof(master_entry_buffer) > batch->data_capacity) {
+        batch->data_capacity = batch->data_capacity ? batch->data_capacity * 2 : 64 * 1024;
+        batch->data = realloc(batch->data, batch->data_capacity);
+        if (!batch->data) abort();
+    }
+
+    uint8_t *end = encode_master_record(batch->data + batch->data_size, record);
+    batch->hashes[batch->size] = zobrist_hash;
+    batch->offsets[batch->size] = batch->data_size;
+    batch->sizes[batch->size] = end - (batch->data + batch->data_size);
+    batch->data_size = end - batch->data;
+
+    if (++batch->size == MASTER_BATCH_SIZE) master_batch_flush(batch);
+}
+
+static void write_master_shard(int shard) {
+    struct master_batch batch = {};
+    batch.hashes = malloc(MASTER_BATCH_SIZE * sizeof(uint64_t));
+    batch.keys = malloc(MASTER_BATCH_SIZE * sizeof(KCSTR));
+    batch.offsets = malloc(MASTER_BATCH_SIZE * sizeof(size_t));
+    batch.sizes = malloc(MASTER_BATCH_SIZE * sizeof(size_t));
+    if (!batch.hashes || !batch.keys || !batch.offsets || !batch.sizes) abort();
+
+    size_t num_runs = aggregate_num_runs(aggregates[shard]);
+    if (num_runs) printf("shard %d: merging %zu spilled run(s) ...\n", shard, num_runs);
+
+    if (!aggregate_finish(aggregates[shard], write_master_record, &batch)) {
+        printf("shard %d: could not read back spilled runs\n", shard);
+        abort();
+    }
+    master_batch_flush(&batch);
+
+    free(batch.hashes);
+    free(batch.keys);
+    free(batch.offsets);
+    free(batch.sizes);
+    free(batch.data);
 }
 
+const char *visit_master_info(const char *game_id, size_t game_id_size,
+                              const char *buf, size_t buf_size,
+                              size_t *sp, void *opq) {
+    if (!pgnstore_writer_add(pgnstore_writer, game_id, buf, buf_size)) {
+        printf("master-pgn.dat: could not add %.8s\n", game_id);
+    }
 
-const char *visit_master_pgn(const char *game_id, size_t game_id_size,
-                             const char *buf, size_t buf_size,
-                             size_t *sp, void *opq) {
     char *pgn = strndup(buf, buf_size);
-    char *saveptr_pgn, *saveptr_line;
+    char *saveptr_pgn;
+
+    struct pgn_game_info *game_info = pgn_game_info_read(pgn, &saveptr_pgn);
+    gameinfo_writer_add(gameinfo_writer, game_id, game_info);
+    pgn_game_info_free(game_info);
+
+    free(pgn);
+    return KCVISNOP;
+}
+
+// Positions are partitioned by the top bits of their hash.
+static int shard_of(uint64_t zobrist_hash, int num_shards) {
+    return (zobrist_hash >> 56) % num_shards;
+}
+
+static bool pgn_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static bool header_equals(const char *line, size_t size, const char *header) {
+    return size == strlen(header) && memcmp(line, header, size) == 0;
+}
+
+// Parses integer headers like [WhiteElo "2500"].
+static bool header_int(const char *line, size_t size, const char *prefix, int *value) {
+    size_t prefix_size = strlen(prefix);
+    if (size <= prefix_size || memcmp(line, prefix, prefix_size) != 0) return false;
+
+    *value = 0;
+    for (size_t i = prefix_size; i < size && '0' <= line[i] && line[i] <= '9' && *value < 100000; i++) {
+        *value = *value * 10 + (line[i] - '0');
+    }
+    return true;
+}
+
+// Appends the deltas of a game to the list of their shards, in move order.
+// Reads pgn in place. Games without ratings of both players are skipped.
+static void parse_master_game(const char *game_id, const char *pgn, size_t size, struct delta_list *shards, int num_shards) {
+    const char *end = pgn + size;
 
     int white_elo = 0, black_elo = 0;
     int result = 0;
 
-    char *line = strtok_r(pgn, "\n", &saveptr_pgn);
-
     // Parse headers.
-    for (; line && line[0] == '['; line = strtok_r(NULL, "\n", &saveptr_pgn)) {
-        if (0 == strcmp(line, "[Result \"1/2-1/2\"]")) result = 0;
-        else if (0 == strcmp(line, "[Result \"1-0\"]")) result = 1;
-        else if (0 == strcmp(line, "[Result \"0-1\"]")) result = -1;
-        else if (1 == sscanf(line, "[WhiteElo \"%d\"]", &white_elo)) continue;
-        else if (1 == sscanf(line, "[BlackElo \"%d\"]", &black_elo)) continue;
+    while (pgn < end) {
+        const char *eol = memchr(pgn, '\n', end - pgn);
+        if (!eol) eol = end;
+
+        size_t line_size = eol - pgn;
+        if (line_size && pgn[line_size - 1] == '\r') line_size--;
+
+        if (line_size && pgn[0] == '[') {
+            if (header_equals(pgn, line_size, "[Result \"1/2-1/2\"]")) result = 0;
+            else if (header_equals(pgn, line_size, "[Result \"1-0\"]")) result = 1;
+            else if (header_equals(pgn, line_size, "[Result \"0-1\"]")) result = -1;
+            else if (header_int(pgn, line_size, "[WhiteElo \"", &white_elo)) {}
+            else if (header_int(pgn, line_size, "[BlackElo \"", &black_elo)) {}
+        } else if (line_size) {
+            break;
+        }
+
+        pgn = eol + (eol < end);
     }
 
-    assert(white_elo > 0);
-    assert(black_elo > 0);
+    if (white_elo <= 0 || black_elo <= 0) return;
 
     board_t pos;
     board_reset(&pos);
 
     // Parse movetext.
-    while (line) {
-        char *token = strtok_r(line, " ", &saveptr_line);
-
-        for (; token && pos.fmvn <= 25; token = strtok_r(NULL, " ", &saveptr_line)) {
-            // Skip move numbers and game results.
-            if ('0' <= token[0] && token[0] <= '9') continue;
-
-            // Parse moves.
-            move_t move;
-            if (board_parse_san(&pos, token, &move)) {
-                uint64_t zobrist_hash = board_zobrist_hash(&pos, POLYGLOT);
-
-                struct master_delta delta;
-                delta.move = move;
-                strncpy(delta.ref.game_id, game_id, 8);
-                delta.ref.average_rating = (white_elo + black_elo) / 2;
-                delta.result = result;
-
-                if (!kcdbaccept(master_db, (char *) &zobrist_hash, sizeof(uint64_t),
-                                merge_master_full, merge_master_empty,
-                                &delta, true)) {
-                    printf("master.kch accept error: %s\n", kcecodename(kcdbecode(master_db)));
-                    abort();
-                }
-
-                board_move(&pos, move);
-            } else {
-                char fen[255];
-                board_shredder_fen(&pos, fen);
-                printf("illegal token: %s in %s\n", token, fen);
-            }
+    struct pgn_movetext movetext = { pgn, end, 0 };
+    char san[16];
+    const char *token;
+    size_t token_size;
+    while (pos.fmvn <= 25 && pgn_movetext_next(&movetext, san, sizeof(san), &token, &token_size)) {
+        move_t move;
+        if (san[0] && board_parse_san(&pos, san, &move)) {
+            struct master_delta delta;
+            delta.zobrist_hash = board_zobrist_hash(&pos, POLYGLOT);
+            delta.move = move;
+            strncpy(delta.ref.game_id, game_id, 8);
+            delta.ref.average_rating = (white_elo + black_elo) / 2;
+            delta.result = result;
+            delta_list_push(&shards[shard_of(delta.zobrist_hash, num_shards)], &delta);
+
+            board_move(&pos, move);
+        } else {
+            char fen[255];
+            board_shredder_fen(&pos, fen);
+            printf("illegal token: %.*s in %s\n", (int) token_size, token, fen);
+        }
+    }
+}
+
+static void apply_master_deltas(struct aggregate *agg, struct delta_list *list) {
+    for (size_t i = 0; i < list->size; i++) {
+        const struct master_delta *delta = &list->deltas[i];
+        if (!aggregate_add(agg, delta->zobrist_hash, delta->move, &delta->ref, delta->result)) {
+            puts("could not spill aggregated records");
+            abort();
         }
+    }
+    list->size = 0;
+}
+
+// Indexing runs as a pipeline. The reader (the main thread) collects games
+// into chunks and deals them out to the parsers in turn. Each parser turns
+// its chunks into deltas, partitioned by shard, and hands the chunk to all
+// writers. Writer s takes the chunks back in the same turns and adds the
+// deltas of shard s to its aggregated records, so every record sees its
+// deltas in the same order as with a single thread. Stages are connected
+// by bounded queues, one per pair of threads. The last writer to finish
+// with a chunk sends it back to the reader.
+static int num_threads = 1;
+static const size_t CHUNK_GAMES = 256;
+static const size_t QUEUE_CHUNKS = 4;
+
+struct index_chunk {
+    size_t num_games;
+    char (*game_ids)[8];
+    size_t *offsets;
+    size_t *sizes;
+
+    // Games back to back.
+    char *data;
+    size_t data_size;
+    size_t data_capacity;
+
+    struct delta_list *shards;
+    int writers_left;
+};
+
+struct stage_stats {
+    size_t games;
+    size_t bytes;
+    size_t deltas;
+    uint64_t elapsed_ns;
+    uint64_t waited_ns;  // for other stages
+};
+
+struct index_parser {
+    pthread_t thread;
+    struct queue *input;
+    struct queue **outputs;  // per writer
+    struct stage_stats stats;
+};
 
-        line = strtok_r(NULL, "\n", &saveptr_pgn);
+struct index_writer {
+    pthread_t thread;
+    int shard;
+    struct queue *free_chunks;  // back to the reader
+    struct stage_stats stats;
+};
+
+static struct index_parser *parsers;
+static struct index_writer *writers;
+static struct index_chunk *chunk;  // being filled
+static size_t num_chunks = 0, max_chunks;
+static size_t num_dealt = 0;
+static uint64_t pipeline_start_ns;
+static struct stage_stats reader_stats;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void stage_push(struct stage_stats *stats, struct queue *queue, void *item) {
+    uint64_t start = now_ns();
+    if (queue_push(queue, item)) stats->waited_ns += now_ns() - start;
+}
+
+static void *stage_pop(struct stage_stats *stats, struct queue *queue) {
+    void *item;
+    uint64_t start = now_ns();
+    if (queue_pop(queue, &item)) stats->waited_ns += now_ns() - start;
+    return item;
+}
+
+static void *index_parser_run(void *arg) {
+    struct index_parser *parser = arg;
+
+    struct index_chunk *chunk;
+    while ((chunk = stage_pop(&parser->stats, parser->input))) {
+        for (size_t i = 0; i < chunk->num_games; i++) {
+            parse_master_game(chunk->game_ids[i], chunk->data + chunk->offsets[i], chunk->sizes[i], chunk->shards, num_threads);
+        }
+
+        parser->stats.games += chunk->num_games;
+        parser->stats.bytes += chunk->data_size;
+        for (int s = 0; s < num_threads; s++) parser->stats.deltas += chunk->shards[s].size;
+
+        chunk->writers_left = num_threads;
+        for (int s = 0; s < num_threads; s++) stage_push(&parser->stats, parser->outputs[s], chunk);
     }
 
-    free(pgn);
+    for (int s = 0; s < num_threads; s++) stage_push(&parser->stats, parser->outputs[s], NULL);
+    parser->stats.elapsed_ns = now_ns() - pipeline_start_ns;
+    return NULL;
+}
+
+static void *index_writer_run(void *arg) {
+    struct index_writer *writer = arg;
+
+    struct index_chunk *chunk;
+    for (size_t n = 0; (chunk = stage_pop(&writer->stats, parsers[n % num_threads].outputs[writer->shard])); n++) {
+        writer->stats.games += chunk->num_games;
+        writer->stats.deltas += chunk->shards[writer->shard].size;
+        apply_master_deltas(aggregates[writer->shard], &chunk->shards[writer->shard]);
+
+        if (__atomic_sub_fetch(&chunk->writers_left, 1, __ATOMIC_ACQ_REL) == 0) {
+            chunk->num_games = 0;
+            chunk->data_size = 0;
+            stage_push(&writer->stats, writer->free_chunks, chunk);
+        }
+    }
+
+    writer->stats.elapsed_ns = now_ns() - pipeline_start_ns;
+    return NULL;
+}
+
+static struct index_chunk *index_chunk_new(void) {
+    struct index_chunk *chunk = calloc(1, sizeof(struct index_chunk));
+    if (!chunk) abort();
+    chunk->game_ids = malloc(CHUNK_GAMES * 8);
+    chunk->offsets = malloc(CHUNK_GAMES * sizeof(size_t));
+    chunk->sizes = malloc(CHUNK_GAMES * sizeof(size_t));
+    chunk->shards = calloc(num_threads, sizeof(struct delta_list));
+    if (!chunk->game_ids || !chunk->offsets || !chunk->sizes || !chunk->shards) abort();
+    return chunk;
+}
+
+static void index_chunk_free(struct index_chunk *chunk) {
+    for (int s = 0; s < num_threads; s++) free(chunk->shards[s].deltas);
+    free(chunk->shards);
+    free(chunk->game_ids);
+    free(chunk->offsets);
+    free(chunk->sizes);
+    free(chunk->data);
+    free(chunk);
+}
+
+static bool index_chunk_recycle(void) {
+    for (int s = 0; s < num_threads; s++) {
+        if (queue_try_pop(writers[s].free_chunks, (void **) &chunk)) return true;
+    }
+    return false;
+}
+
+// Recycles a chunk, unless there are not enough to keep all stages busy.
+static void index_chunk_acquire(void) {
+    if (index_chunk_recycle()) return;
+
+    if (num_chunks < max_chunks) {
+        chunk = index_chunk_new();
+        num_chunks++;
+        return;
+    }
+
+    uint64_t start = now_ns();
+    for (int attempt = 0; !index_chunk_recycle(); attempt++) queue_backoff(attempt);
+    reader_stats.waited_ns += now_ns() - start;
+}
+
+static void index_pipeline_deal(void) {
+    stage_push(&reader_stats, parsers[num_dealt++ % num_threads].input, chunk);
+    chunk = NULL;
+}
+
+const char *visit_master_pipeline(const char *game_id, size_t game_id_size,
+                                  const char *buf, size_t buf_size,
+                                  size_t *sp, void *opq) {
+    visit_master_info(game_id, game_id_size, buf, buf_size, sp, opq);
+    if (!claim_game(game_id)) return KCVISNOP;
+
+    if (!chunk) index_chunk_acquire();
+
+    if (chunk->data_size + buf_size > chunk->data_capacity) {
+        chunk->data_capacity = chunk->data_size + buf_size > 2 * chunk->data_capacity ? chunk->data_size + buf_size : 2 * chunk->data_capacity;
+        chunk->data = realloc(chunk->data, chunk->data_capacity);
+        if (!chunk->data) abort();
+    }
+
+    memcpy(chunk->game_ids[chunk->num_games], game_id, 8);
+    memcpy(chunk->data + chunk->data_size, buf, buf_size);
+    chunk->offsets[chunk->num_games] = chunk->data_size;
+    chunk->sizes[chunk->num_games] = buf_size;
+    chunk->data_size += buf_size;
+
+    reader_stats.games++;
+    reader_stats.bytes += buf_size;
+    if (++chunk->num_games == CHUNK_GAMES) index_pipeline_deal();
+
     return KCVISNOP;
 }
 
-int main() {
+static void index_pipeline_start(void) {
+    pipeline_start_ns = now_ns();
+
+    // Enough chunks for full queues, one being parsed by each parser, one
+    // being written and one being filled.
+    max_chunks = num_threads * (2 * QUEUE_CHUNKS + 1) + 2;
+
+    parsers = calloc(num_threads, sizeof(struct index_parser));
+    writers = calloc(num_threads, sizeof(struct index_writer));
+    if (!parsers || !writers) abort();
+
+    for (int i = 0; i < num_threads; i++) {
+        parsers[i].input = queue_new(QUEUE_CHUNKS);
+        parsers[i].outputs = calloc(num_threads, sizeof(struct queue *));
+        if (!parsers[i].outputs) abort();
+        for (int s = 0; s < num_threads; s++) parsers[i].outputs[s] = queue_new(QUEUE_CHUNKS);
+
+        writers[i].shard = i;
+        writers[i].free_chunks = queue_new(max_chunks);
+    }
+
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&parsers[i].thread, NULL, index_parser_run, &parsers[i])) abort();
+        if (pthread_create(&writers[i].thread, NULL, index_writer_run, &writers[i])) abort();
+    }
+}
+
+static void stage_print(const char *name, const struct stage_stats *stats, const char *unit, size_t count) {
+    uint64_t busy_ns = stats->elapsed_ns - stats->waited_ns;
+    printf("%s: %zu %s in %.2f s, busy %.2f s (%.0f %s/s), waited %.2f s\n",
+           name, count, unit, stats->elapsed_ns / 1e9, busy_ns / 1e9,
+           busy_ns ? count / (busy_ns / 1e9) : 0.0, unit, stats->waited_ns / 1e9);
+}
+
+static void index_pipeline_finish(void) {
+    if (chunk && chunk->num_games) index_pipeline_deal();
+    for (int i = 0; i < num_threads; i++) stage_push(&reader_stats, parsers[i].input, NULL);
+    reader_stats.elapsed_ns = now_ns() - pipeline_start_ns;
+
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(parsers[i].thread, NULL);
+        pthread_join(writers[i].thread, NULL);
+    }
+
+    // Stage throughput. The stage that waited least is the bottleneck.
+    stage_print("reader", &reader_stats, "games", reader_stats.games);
+    for (int i = 0; i < num_threads; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "parser %d", i);
+        stage_print(name, &parsers[i].stats, "games", parsers[i].stats.games);
+    }
+    for (int i = 0; i < num_threads; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "writer %d", i);
+        stage_print(name, &writers[i].stats, "deltas", writers[i].stats.deltas);
+    }
+
+    if (chunk) index_chunk_free(chunk);
+    while (index_chunk_recycle()) index_chunk_free(chunk);
+    chunk = NULL;
+
+    for (int i = 0; i < num_threads; i++) {
+        queue_free(parsers[i].input);
+        for (int s = 0; s < num_threads; s++) queue_free(parsers[i].outputs[s]);
+        free(parsers[i].outputs);
+        queue_free(writers[i].free_chunks);
+    }
+    free(parsers);
+    free(writers);
+}
+
+static void *write_master_shard_run(void *arg) {
+    write_master_shard((intptr_t) arg);
+    return NULL;
+}
+
+// One thread per shard. No two threads touch the same key.
+static void write_master_shards(void) {
+    pthread_t *threads = calloc(num_threads, sizeof(pthread_t));
+    if (!threads) abort();
+
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&threads[i], NULL, write_master_shard_run, (void *) (intptr_t) i)) abort();
+    }
+    for (int i = 0; i < num_threads; i++) pthread_join(threads[i], NULL);
+
+    free(threads);
+}
+
+// Games from PGN files are identified by their lichess URL, if they have
+// one.
+static bool pgn_lichess_id(const char *pgn, size_t size, char *game_id) {
+    static const char SITE[] = "[Site \"https://lichess.org/";
+    const char *end = pgn + size;
+
+    for (const char *line = pgn; line < end && line[0] == '['; ) {
+        const char *eol = memchr(line, '\n', end - line);
+        if (!eol) eol = end;
+
+        uint64_t number;
+        if ((size_t) (eol - line) >= strlen(SITE) + 8 && memcmp(line, SITE, strlen(SITE)) == 0 &&
+                line[strlen(SITE)] != '_' && game_id_number(line + strlen(SITE), &number)) {
+            memcpy(game_id, line + strlen(SITE), 8);
+            return true;
+        }
+
+        line = eol + 1;
+    }
+
+    return false;
+}
+
+// Whether two texts are the same game, up to whitespace and line endings.
+static bool pgn_text_equal(const char *a, size_t a_size, const char *b, size_t b_size) {
+    size_t i = 0, j = 0;
+    for (bool first = true; ; first = false) {
+        bool a_gap = false, b_gap = false;
+        while (i < a_size && pgn_space(a[i])) i++, a_gap = true;
+        while (j < b_size && pgn_space(b[j])) j++, b_gap = true;
+        if (i == a_size || j == b_size) return i == a_size && j == b_size;
+        if (!first && a_gap != b_gap) return false;
+        if (a[i++] != b[j++]) return false;
+    }
+}
+
+// FNV-1a, consistent with pgn_text_equal().
+static uint64_t pgn_text_hash(const char *pgn, size_t size) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    bool first = true, gap = false;
+    for (size_t i = 0; i < size; i++) {
+        if (pgn_space(pgn[i])) {
+            gap = true;
+            continue;
+        }
+        if (gap && !first) hash = (hash ^ ' ') * 0x100000001b3ULL;
+        hash = (hash ^ (uint8_t) pgn[i]) * 0x100000001b3ULL;
+        gap = first = false;
+    }
+    return hash;
+}
+
+// Other games get an id derived from their text, starting with a _, which
+// no lichess id does. Collisions between different texts move on to the
+// next candidate.
+static void pgn_synthetic_id(uint64_t hash, int attempt, char *game_id) {
+    uint8_t encoded[6];
+    encode_uint48(encoded, 218340105584896ULL + (hash + attempt * 0x9e3779b97f4a7c15ULL) % 3521614606208ULL);  // 62^8, 62^7
+    char c_game_id[9];
+    decode_game_id(encoded, c_game_id);
+    memcpy(game_id, c_game_id, 8);
+}
+
+// Adds the games of a PGN file to master-pgn.kct and hands new ones to the
+// visitor, straight from the mapped or decompressed blocks.
+static bool index_pgn_file(KCDB *master_pgn_db, const char *path, KCVISITFULL visit) {
+    struct pgnfile *file = pgnfile_open(path);
+    if (!file) {
+        printf("%s: open error\n", path);
+        return false;
+    }
+
+    size_t num_games = 0, num_duplicates = 0, num_conflicts = 0;
+
+    const char *pgn;
+    size_t size;
+    while (pgnfile_next(file, &pgn, &size)) {
+        char game_id[8];
+        bool lichess = pgn_lichess_id(pgn, size, game_id);
+        uint64_t hash = lichess ? 0 : pgn_text_hash(pgn, size);
+
+        bool added = false;
+        for (int attempt = 0; ; attempt++) {
+            if (!lichess) pgn_synthetic_id(hash, attempt, game_id);
+
+            if (kcdbadd(master_pgn_db, game_id, 8, pgn, size)) {
+                added = true;
+                break;
+            }
+
+            if (kcdbecode(master_pgn_db) != KCEDUPREC) {
+                printf("master-pgn.kct add error: %s\n", kcecodename(kcdbecode(master_pgn_db)));
+                abort();
+            }
+
+            // Already visited with the games of master-pgn.kct, unless the
+            // text is different.
+            size_t stored_size;
+            char *stored = kcdbget(master_pgn_db, game_id, 8, &stored_size);
+            bool same = stored && pgn_text_equal(stored, stored_size, pgn, size);
+            if (stored) kcfree(stored);
+
+            if (same) {
+                num_duplicates++;
+                break;
+            } else if (lichess) {
+                printf("%s: %.8s is already in master-pgn.kct with a different text\n", path, game_id);
+                num_conflicts++;
+                break;
+            }
+        }
+
+        if (!added) continue;
+
+        size_t sp;
+        visit(game_id, 8, pgn, size, &sp, NULL);
+        num_games++;
+    }
+
+    bool ok = pgnfile_ok(file) && !num_conflicts;
+    if (!pgnfile_ok(file)) printf("%s: read error\n", path);
+    printf("%s: %zu games, %zu already in master-pgn.kct, %zu conflicting ids\n", path, num_games, num_duplicates, num_conflicts);
+
+    pgnfile_close(file);
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    bool info_only = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "guj:M:h")) != -1) {
+        switch (opt) {
+            case 'g':
+                info_only = true;
+                break;
+            case 'u':
+                update = true;
+                break;
+            case 'j':
+                num_threads = atoi(optarg);
+                if (num_threads <= 0) num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+                break;
+            case 'M':
+                aggregate_budget = atol(optarg) * 1024 * 1024;
+                break;
+            default:
+                printf("usage: %s [-g] [-u] [-j threads] [-M memory-mb] [file.pgn[.gz|.zst] ...]\n", argv[0]);
+                puts("  -g  only build master-info.dat and master-pgn.dat");
+                puts("  -u  add games that are not yet in master.kch, instead of rebuilding it");
+                puts("  -j  parse and write on this many threads each, one shard per writer (0: all cores)");
+                puts("  -M  memory for aggregated records before spilling to disk (default 1024)");
+                puts("games from the given files are added to master-pgn.kct in the same pass");
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
     attacks_init();
 
     KCDB *master_pgn_db = kcdbnew();
-    if (!kcdbopen(master_pgn_db, "master-pgn.kct", KCOREADER)) {
+    if (!kcdbopen(master_pgn_db, "master-pgn.kct", optind < argc ? KCOWRITER | KCOREADER | KCOCREATE : KCOREADER)) {
         printf("master-pgn.kct open error: %s\n", kcecodename(kcdbecode(master_pgn_db)));
         return 1;
     }
 
-    master_db = kcdbnew();
-    if (!kcdbopen(master_db, "master.kch", KCOCREATE | KCOWRITER | KCOREADER)) {
-        printf("master.kch open error: %s\n", kcecodename(kcdbecode(master_db)));
+    gameinfo_writer = gameinfo_writer_new();
+
+    pgnstore_writer = pgnstore_writer_open("master-pgn.dat");
+    if (!pgnstore_writer) {
+        puts("master-pgn.dat open error");
         return 1;
     }
 
-    if (!kcdbiterate(master_pgn_db, visit_master_pgn, NULL, false)) {
-        printf("master-pgn.kct iterate error: %s\n", kcecodename(kcdbecode(master_pgn_db)));
+    // Any failure leaves master.kch, master-info.dat and master-pgn.dat as
+    // they were, except for a rebuild of master.kch, which is incomplete.
+    bool ok = true;
+
+    if (info_only) {
+        if (!kcdbiterate(master_pgn_db, visit_master_info, NULL, false)) {
+            printf("master-pgn.kct iterate error: %s\n", kcecodename(kcdbecode(master_pgn_db)));
+        }
+        for (int i = optind; i < argc; i++) ok = index_pgn_file(master_pgn_db, argv[i], visit_master_info) && ok;
+    } else {
+        master_db = kcdbnew();
+        if (!kcdbopen(master_db, "master.kch", KCOWRITER | KCOREADER | (update ? 0 : KCOCREATE | KCOTRUNCATE))) {
+            printf("master.kch open error: %s\n", kcecodename(kcdbecode(master_db)));
+            return 1;
+        }
+
+        if (update) {
+            if (!read_indexed_games()) {
+                puts("master.kch does not record which games it contains, rebuild it without -u");
+                return 1;
+            }
+            printf("master.kch contains %zu games.\n", indexed_games.size);
+        }
+
+        aggregates = calloc(num_threads, sizeof(struct aggregate *));
+        if (!aggregates) abort();
+        for (int i = 0; i < num_threads; i++) {
+            char spill_prefix[64];
+            snprintf(spill_prefix, sizeof(spill_prefix), "master.kch.%d", i);
+            aggregates[i] = aggregate_new(aggregate_budget / num_threads, spill_prefix);
+        }
+
+        // Nothing is written before the end, so an update either lands
+        // completely, together with the new games, or not at all.
+        if (update && !kcdbbegintran(master_db, false)) {
+            printf("master.kch transaction error: %s\n", kcecodename(kcdbecode(master_db)));
+            abort();
+        }
+
+        index_pipeline_start();
+        if (!kcdbiterate(master_pgn_db, visit_master_pipeline, NULL, false)) {
+            printf("master-pgn.kct iterate error: %s\n", kcecodename(kcdbecode(master_pgn_db)));
+            ok = false;
+        }
+        for (int i = optind; i < argc; i++) ok = index_pgn_file(master_pgn_db, argv[i], visit_master_pipeline) && ok;
+        index_pipeline_finish();
+
+        if (ok) {
+            write_master_shards();
+
+            if (!write_indexed_games()) {
+                printf("master.kch set error: %s\n", kcecodename(kcdbecode(master_db)));
+                abort();
+            }
+        }
+
+        if (update && !kcdbendtran(master_db, ok)) {
+            printf("master.kch %s error: %s\n", ok ? "commit" : "rollback", kcecodename(kcdbecode(master_db)));
+            abort();
+        }
+
+        if (ok) printf("indexed %zu new games, skipped %zu already in master.kch.\n", new_games.size, num_skipped);
+        else if (update) puts("master.kch left unchanged.");
+        else puts("master.kch is incomplete, fix the errors above and rebuild it.");
+
+        for (int i = 0; i < num_threads; i++) aggregate_free(aggregates[i]);
+        free(aggregates);
+        free(indexed_games.game_ids);
+        free(new_games.game_ids);
+
+        if (!kcdbclose(master_db)) {
+            printf("master.kch close error: %s\n", kcecodename(kcdbecode(master_db)));
+        }
+
+        kcdbdel(master_db);
     }
 
-    if (!kcdbclose(master_pgn_db)) {
-        printf("master-pgn.kct close error: %s\n", kcecodename(kcdbecode(master_pgn_db)));
+    if (ok && !gameinfo_writer_write(gameinfo_writer, "master-info.dat")) {
+        puts("master-info.dat write error");
     }
+    gameinfo_writer_free(gameinfo_writer);
 
-    if (!kcdbclose(master_db)) {
-        printf("master.kch close error: %s\n", kcecodename(kcdbecode(master_db)));
+    if (!ok) {
+        pgnstore_writer_abort(pgnstore_writer);
+    } else if (!pgnstore_writer_close(pgnstore_writer)) {
+        puts("master-pgn.dat write error");
+    }
+
+    if (!kcdbclose(master_pgn_db)) {
+        printf("master-pgn.kct close error: %s\n", kcecodename(kcdbecode(master_pgn_db)));
     }
 
     kcdbdel(master_pgn_db);
-    kcdbdel(master_db);
-    return 0;
+    return ok ? 0 : 1;
 }
@@ -0,0 +1,197 @@
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "iopool.h"
+
+struct iopool_ring {
+    struct iopool_job **jobs;
+    size_t capacity;
+    size_t head;
+    size_t size;
+};
+
+struct iopool {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+
+    // Priority jobs are taken first, background jobs last.
+    struct iopool_ring queue;
+    struct iopool_ring priority;
+    struct iopool_ring background;
+    int num_background;  // running
+    int max_background;
+
+    bool stopping;
+
+    int num_threads;
+    pthread_t *threads;
+};
+
+struct iopool_loop {
+    pthread_mutex_t lock;
+    struct iopool_job *completed;  // newest first
+    struct event *wake;
+};
+
+void iopool_complete(struct iopool_job *job) {
+    // Hand the job back. Only the first completion of a batch needs to wake
+    // up the loop.
+    struct iopool_loop *loop = job->loop;
+    pthread_mutex_lock(&loop->lock);
+    job->next = loop->completed;
+    loop->completed = job;
+    bool wake = !job->next;
+    pthread_mutex_unlock(&loop->lock);
+
+    if (wake) event_active(loop->wake, EV_READ, 0);
+}
+
+static void iopool_ring_init(struct iopool_ring *ring, size_t capacity) {
+    ring->capacity = capacity;
+    ring->jobs = calloc(capacity, sizeof(struct iopool_job *));
+    if (!ring->jobs) abort();
+}
+
+static bool iopool_ring_push(struct iopool_ring *ring, struct iopool_job *job) {
+    if (ring->size == ring->capacity) return false;
+    ring->jobs[(ring->head + ring->size) % ring->capacity] = job;
+    ring->size++;
+    return true;
+}
+
+static struct iopool_job *iopool_ring_pop(struct iopool_ring *ring) {
+    struct iopool_job *job = ring->jobs[ring->head];
+    ring->head = (ring->head + 1) % ring->capacity;
+    ring->size--;
+    return job;
+}
+
+static bool iopool_ready(const struct iopool *pool) {
+    return pool->queue.size || pool->priority.size ||
+           (pool->background.size && pool->num_background < pool->max_background);
+}
+
+static void *iopool_run(void *arg) {
+    struct iopool *pool = arg;
+
+    while (true) {
+        pthread_mutex_lock(&pool->lock);
+        while (!iopool_ready(pool) && !pool->stopping) {
+            pthread_cond_wait(&pool->not_empty, &pool->lock);
+        }
+        if (pool->stopping) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+
+        struct iopool_job *job;
+        if (pool->priority.size) job = iopool_ring_pop(&pool->priority);
+        else if (pool->queue.size) job = iopool_ring_pop(&pool->queue);
+        else {
+            job = iopool_ring_pop(&pool->background);
+            pool->num_background++;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        bool background = job->background;
+        job->run(job);
+        iopool_complete(job);
+
+        if (background) {
+            pthread_mutex_lock(&pool->lock);
+            pool->num_background--;
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+}
+
+struct iopool *iopool_new(int num_threads, size_t max_queued) {
+    struct iopool *pool = calloc(1, sizeof(struct iopool));
+    if (!pool) abort();
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->not_empty, NULL);
+
+    iopool_ring_init(&pool->queue, max_queued);
+    iopool_ring_init(&pool->priority, max_queued);
+    iopool_ring_init(&pool->background, max_queued);
+    pool->max_background = num_threads / 4 > 1 ? num_threads / 4 : 1;
+
+    pool->num_threads = num_threads;
+    pool->threads = calloc(num_threads, sizeof(pthread_t));
+    if (!pool->threads) abort();
+
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, iopool_run, pool)) abort();
+    }
+
+    return pool;
+}
+
+void iopool_free(struct iopool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->num_threads; i++) pthread_join(pool->threads[i], NULL);
+
+    pthread_cond_destroy(&pool->not_empty);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool->queue.jobs);
+    free(pool->priority.jobs);
+    free(pool->background.jobs);
+    free(pool);
+}
+
+static void iopool_loop_wake(evutil_socket_t fd, short events, void *arg) {
+    struct iopool_loop *loop = arg;
+
+    pthread_mutex_lock(&loop->lock);
+    struct iopool_job *job = loop->completed;
+    loop->completed = NULL;
+    pthread_mutex_unlock(&loop->lock);
+
+    // Complete in submission order.
+    struct iopool_job *ordered = NULL;
+    while (job) {
+        struct iopool_job *next = job->next;
+        job->next = ordered;
+        ordered = job;
+        job = next;
+    }
+
+    while (ordered) {
+        struct iopool_job *next = ordered->next;
+        ordered->done(ordered);
+        ordered = next;
+    }
+}
+
+struct iopool_loop *iopool_loop_new(struct event_base *base) {
+    struct iopool_loop *loop = calloc(1, sizeof(struct iopool_loop));
+    if (!loop) abort();
+
+    pthread_mutex_init(&loop->lock, NULL);
+    loop->wake = event_new(base, -1, 0, iopool_loop_wake, loop);
+    if (!loop->wake) abort();
+    return loop;
+}
+
+void iopool_loop_free(struct iopool_loop *loop) {
+    event_free(loop->wake);
+    pthread_mutex_destroy(&loop->lock);
+    free(loop);
+}
+
+bool iopool_submit(struct iopool *pool, struct iopool_loop *loop, struct iopool_job *job) {
+    job->loop = loop;
+
+    pthread_mutex_lock(&pool->lock);
+    struct iopool_ring *ring = job->priority ? &pool->priority : job->background ? &pool->background : &pool->queue;
+    bool queued = iopool_ring_push(ring, job);
+    if (queued) pthread_cond_signal(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+    return queued;
+}
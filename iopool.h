@@ -0,0 +1,47 @@
+#ifndef IOPOOL_H_
+#define IOPOOL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <event2/event.h>
+
+// Bounded pool of threads for blocking work (database reads). Jobs run on a
+// pool thread, then their completion runs back on the event loop that
+// submitted them.
+
+struct iopool_loop;
+
+// Embed as the first member of the job context.
+struct iopool_job {
+    void (*run)(struct iopool_job *job);   // on a pool thread
+    void (*done)(struct iopool_job *job);  // on the owning event loop
+    struct iopool_loop *loop;
+    struct iopool_job *next;
+    bool priority;    // taken before all other queued jobs
+    bool background;  // taken only when nothing else is queued
+};
+
+struct iopool;
+
+struct iopool *iopool_new(int num_threads, size_t max_queued);
+
+// Waits for running jobs. Queued jobs are dropped without completion, so
+// stop the event loops first.
+void iopool_free(struct iopool *pool);
+
+// Completion queue of an event loop. Free only after the pool.
+struct iopool_loop *iopool_loop_new(struct event_base *base);
+void iopool_loop_free(struct iopool_loop *loop);
+
+// Returns false if the queue is full. Priority and background jobs each
+// have a queue of the same size to themselves. Background jobs occupy at
+// most a quarter of the threads (at least one), so that they never hold up
+// other jobs for long.
+bool iopool_submit(struct iopool *pool, struct iopool_loop *loop, struct iopool_job *job);
+
+// Completes a job that did not go through the pool, from any thread. Its
+// done callback runs on job->loop.
+void iopool_complete(struct iopool_job *job);
+
+#endif  // #ifndef IOPOOL_H_
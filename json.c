@@ -0,0 +1,108 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "json.h"
+
+static const size_t JSON_MIN_CAPACITY = 16 * 1024;
+
+static inline void json_reserve(struct json *json, size_t size) {
+    if (json->size + size <= json->capacity) return;
+
+    size_t capacity = json->capacity ? json->capacity : JSON_MIN_CAPACITY;
+    while (capacity < json->size + size) capacity *= 2;
+
+    json->data = realloc(json->data, capacity);
+    if (!json->data) abort();
+    json->capacity = capacity;
+}
+
+void json_clear(struct json *json) {
+    json->size = 0;
+    json_reserve(json, 0);
+}
+
+void json_free(struct json *json) {
+    free(json->data);
+    json->data = NULL;
+    json->size = json->capacity = 0;
+}
+
+void json_append(struct json *json, const char *data, size_t size) {
+    json_reserve(json, size);
+    memcpy(json->data + json->size, data, size);
+    json->size += size;
+}
+
+void json_uint(struct json *json, unsigned long value) {
+    char digits[20];
+    size_t n = 0;
+
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+
+    json_reserve(json, n);
+    while (n) json->data[json->size++] = digits[--n];
+}
+
+void json_int(struct json *json, long value) {
+    if (value < 0) {
+        json_literal(json, "-");
+        json_uint(json, -(unsigned long) value);
+    } else {
+        json_uint(json, value);
+    }
+}
+
+static const char HEX[] = "0123456789abcdef";
+
+void json_string(struct json *json, const char *value) {
+    size_t len = strlen(value);
+
+    // Worst case: every byte becomes a \u00XX escape.
+    json_reserve(json, 6 * len + 2);
+
+    char *out = json->data + json->size;
+    *out++ = '"';
+
+    for (const unsigned char *c = (const unsigned char *) value; *c; c++) {
+        switch (*c) {
+            case '"':
+                *out++ = '\\';
+                *out++ = '"';
+                break;
+            case '\\':
+                *out++ = '\\';
+                *out++ = '\\';
+                break;
+            case '\n':
+                *out++ = '\\';
+                *out++ = 'n';
+                break;
+            case '\r':
+                *out++ = '\\';
+                *out++ = 'r';
+                break;
+            case '\t':
+                *out++ = '\\';
+                *out++ = 't';
+                break;
+            default:
+                if (*c < 0x20) {
+                    *out++ = '\\';
+                    *out++ = 'u';
+                    *out++ = '0';
+                    *out++ = '0';
+                    *out++ = HEX[*c >> 4];
+                    *out++ = HEX[*c & 15];
+                } else {
+                    *out++ = *c;
+                }
+                break;
+        }
+    }
+
+    *out++ = '"';
+    json->size = out - json->data;
+}
@@ -0,0 +1,26 @@
+#ifndef JSON_H_
+#define JSON_H_
+
+#include <stddef.h>
+
+// Growable output buffer. Meant to be kept around (e.g. per thread) and
+// cleared between uses, so that it rarely needs to allocate.
+struct json {
+    char *data;
+    size_t size;
+    size_t capacity;
+};
+
+void json_clear(struct json *json);
+void json_free(struct json *json);
+
+void json_append(struct json *json, const char *data, size_t size);
+void json_uint(struct json *json, unsigned long value);
+void json_int(struct json *json, long value);
+
+// Quoted and escaped string.
+void json_string(struct json *json, const char *value);
+
+#define json_literal(json, literal) json_append((json), (literal), sizeof(literal) - 1)
+
+#endif  // #ifndef JSON_H_
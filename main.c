@@ -1,25 +1,600 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 #include <event2/event.h>
 #include <event2/http.h>
 #include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/listener.h>
+#include <event2/thread.h>
 #include <event2/keyvalq_struct.h>
 
 #include <kclangc.h>
 
 #include "attacks.h"
 #include "board.h"
+#include "cache.h"
+#include "compress.h"
 #include "encode.h"
+#include "flight.h"
+#include "gameinfo.h"
+#include "iopool.h"
+#include "json.h"
+#include "metrics.h"
 #include "pgn.h"
+#include "pgnstore.h"
+#include "querylog.h"
+
+// Everything that is replaced when new index files are published.
+struct dataset {
+    int refs;
+    unsigned long generation;
+
+    KCDB *master_pgn_db;
+    KCDB *master_db;
+
+    struct gameinfo_table *master_info;
+    struct pgnstore *master_pgn_store;
+
+    // Caches belong to the data they were filled from.
+    struct cache *master_cache;
+    struct cache *record_cache;
+};
+
+static size_t master_cache_budget;
+static size_t record_cache_budget;
+
+static pthread_mutex_t dataset_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct dataset *current_dataset;
+static unsigned long dataset_generation;
+
+// Dataset used by this thread. Event loops hold a reference and follow
+// swaps. I/O jobs carry the reference of their request.
+static __thread struct dataset *dataset;
+
+static void dataset_close(struct dataset *ds) {
+    if (!kcdbclose(ds->master_pgn_db)) {
+        printf("master-pgn.kct close error: %s\n", kcecodename(kcdbecode(ds->master_pgn_db)));
+    }
+
+    if (!kcdbclose(ds->master_db)) {
+        printf("master.kch close error: %s\n", kcecodename(kcdbecode(ds->master_db)));
+    }
+
+    kcdbdel(ds->master_pgn_db);
+    kcdbdel(ds->master_db);
+
+    if (ds->master_info) gameinfo_close(ds->master_info);
+    if (ds->master_pgn_store) pgnstore_close(ds->master_pgn_store);
+
+    if (ds->master_cache) cache_free(ds->master_cache);
+    if (ds->record_cache) cache_free(ds->record_cache);
+
+    printf("closed dataset generation %lu.\n", ds->generation);
+    free(ds);
+}
+
+struct dataset *dataset_open(void) {
+    struct dataset *ds = calloc(1, sizeof(struct dataset));
+    if (!ds) abort();
+    ds->refs = 1;
+
+    ds->master_pgn_db = kcdbnew();
+    ds->master_db = kcdbnew();
+
+    puts("opening master-pgn.kct ...");
+    if (!kcdbopen(ds->master_pgn_db, "master-pgn.kct", KCOREADER)) {
+        printf("master-pgn.kct open error: %s\n", kcecodename(kcdbecode(ds->master_pgn_db)));
+        kcdbdel(ds->master_pgn_db);
+        kcdbdel(ds->master_db);
+        free(ds);
+        return NULL;
+    }
+
+    puts("opening master.kch ...");
+    if (!kcdbopen(ds->master_db, "master.kch", KCOREADER)) {
+        printf("master.kch open error: %s\n", kcecodename(kcdbecode(ds->master_db)));
+        kcdbclose(ds->master_pgn_db);
+        kcdbdel(ds->master_pgn_db);
+        kcdbdel(ds->master_db);
+        free(ds);
+        return NULL;
+    }
+
+    ds->master_info = gameinfo_open("master-info.dat");
+    if (ds->master_info) printf("mapped master-info.dat with %zu games.\n", gameinfo_size(ds->master_info));
+    else puts("master-info.dat not available, parsing top games from master-pgn.kct.");
+
+    ds->master_pgn_store = pgnstore_open("master-pgn.dat");
+    if (ds->master_pgn_store) printf("mapped master-pgn.dat with %zu games.\n", pgnstore_size(ds->master_pgn_store));
+    else puts("master-pgn.dat not available, serving PGNs from master-pgn.kct.");
+
+    if (master_cache_budget) ds->master_cache = cache_new(master_cache_budget);
+    if (record_cache_budget) ds->record_cache = cache_new(record_cache_budget);
+
+    return ds;
+}
+
+static struct dataset *dataset_ref(struct dataset *ds) {
+    __atomic_add_fetch(&ds->refs, 1, __ATOMIC_RELAXED);
+    return ds;
+}
 
-static KCDB *master_pgn_db;
-static KCDB *master_db;
+// The last reference closes the files, on whichever thread drops it.
+static void dataset_release(struct dataset *ds) {
+    if (__atomic_sub_fetch(&ds->refs, 1, __ATOMIC_ACQ_REL) == 0) dataset_close(ds);
+}
+
+static struct dataset *dataset_acquire(void) {
+    pthread_mutex_lock(&dataset_lock);
+    struct dataset *ds = dataset_ref(current_dataset);
+    pthread_mutex_unlock(&dataset_lock);
+    return ds;
+}
+
+// Takes over the reference to ds.
+static void dataset_publish(struct dataset *ds) {
+    pthread_mutex_lock(&dataset_lock);
+    struct dataset *previous = current_dataset;
+    ds->generation = ++dataset_generation;
+    current_dataset = ds;
+    pthread_mutex_unlock(&dataset_lock);
+
+    if (previous) dataset_release(previous);
+}
+
+static struct querylog_writer *query_log;
+
+// Uncached lookups run here, so that slow reads do not stall the event
+// loops. NULL to do everything on the loops.
+static struct iopool *io_pool;
+static __thread struct iopool_loop *io_loop;
+
+// Identical /master lookups in flight. Only with the I/O pool, so that
+// waiters never block an event loop.
+static struct flight *master_flight;
+static int num_io_threads = 16;
+static const size_t MAX_QUEUED_IO = 4096;
 
 static bool cors = true;
 static bool verbose = true;
 
+// Flips once warm-up has finished. Accessed atomically.
+static bool ready = false;
+static bool stopping = false;
+
+static const int MAX_WORKERS = 256;
+
+struct worker {
+    int id;
+    int port;
+    int cpu;  // -1 if not pinned
+    pthread_t thread;
+    struct event_base *base;
+    struct evhttp *http;
+    struct event *tick;
+    uint64_t last_tick;
+    struct iopool_loop *io_loop;
+    struct event *swap;
+};
+
+static struct worker *workers;
+static int num_workers = 1;
+
+enum endpoint {
+    ENDPOINT_MASTER,
+    ENDPOINT_MASTER_PGN,
+    ENDPOINT_MASTER_BATCH,
+    ENDPOINT_MASTER_LINE,
+    ENDPOINT_READY,
+    ENDPOINT_METRICS,
+    ENDPOINT_ADMIN_RELOAD,
+    ENDPOINT_MASTER_GAME_STATS,
+    NUM_ENDPOINTS,
+};
+
+enum shed_reason {
+    SHED_NONE,
+    SHED_QUEUE_FULL,
+    SHED_EXPENSIVE,
+    SHED_DEADLINE,
+    NUM_SHED_REASONS,
+};
+
+static const char *const SHED_REASON_NAMES[NUM_SHED_REASONS] = {
+    "none", "queue_full", "expensive", "deadline",
+};
+
+static const char *const ENDPOINT_NAMES[NUM_ENDPOINTS] = {
+    "master", "master_pgn", "master_batch", "master_line", "ready", "metrics", "admin_reload",
+    "master_game_stats",
+};
+
+// Written only by the owning thread, summed up by /metrics.
+struct thread_metrics {
+    struct thread_metrics *next;
+
+    uint64_t requests[NUM_ENDPOINTS];
+    uint64_t responses[NUM_ENDPOINTS][5];  // 1xx to 5xx
+    struct histogram latency[NUM_ENDPOINTS];
+
+    struct histogram kcdbget_latency;
+    uint64_t kcdbget_bytes;
+    uint64_t kcdbget_misses;
+
+    uint64_t master_coalesced;
+    uint64_t shed[NUM_SHED_REASONS];
+
+    uint64_t prefetch_positions;
+    uint64_t prefetch_dropped;
+
+    struct histogram render_latency;
+    struct histogram record_size;
+    struct histogram loop_lag;
+};
+
+static struct thread_metrics *all_metrics;
+static __thread struct thread_metrics *local_metrics;
+
+static struct thread_metrics *thread_metrics(void) {
+    if (!local_metrics) {
+        local_metrics = calloc(1, sizeof(struct thread_metrics));
+        if (!local_metrics) abort();
+
+        // Lock-free push. Blocks are never removed before shutdown.
+        local_metrics->next = __atomic_load_n(&all_metrics, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&all_metrics, &local_metrics->next, local_metrics,
+                                            true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    return local_metrics;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Start of the request that is currently dispatched on this thread. A
+// handler that completes the request later sets request_deferred and
+// records it itself.
+static __thread uint64_t request_start;
+static __thread bool request_deferred;
+
+static void record_request(enum endpoint endpoint, uint64_t start) {
+    struct thread_metrics *metrics = thread_metrics();
+    histogram_record(&metrics->latency[endpoint], now_ns() - start);
+    counter_add(&metrics->requests[endpoint], 1);
+}
+
+static char *metered_kcdbget(KCDB *db, const char *key, size_t key_size, size_t *size) {
+    uint64_t start = now_ns();
+    char *value = kcdbget(db, key, key_size, size);
+
+    struct thread_metrics *metrics = thread_metrics();
+    histogram_record(&metrics->kcdbget_latency, now_ns() - start);
+    if (value) counter_add(&metrics->kcdbget_bytes, *size);
+    else counter_add(&metrics->kcdbget_misses, 1);
+    return value;
+}
+
+// Admission control for requests that would wait for the I/O pool. Lookups
+// answered from the caches never queue and are always admitted. Priority
+// requests skip the limits and have their own lane in the pool.
+static int max_deferred = 1024;          // per worker
+static int max_deferred_expensive = 64;  // per worker
+static uint64_t queue_deadline_ns = 1000000000;
+static int priority_port = 0;
+
+// Larger than the defaults.
+static const int EXPENSIVE_MOVES = 12;
+static const int EXPENSIVE_TOP_GAMES = 4;
+
+// Requests of this event loop that wait for the pool.
+static __thread int num_deferred;
+static __thread int num_deferred_expensive;
+
+static bool priority_requested(struct evhttp_request *req) {
+    const char *priority = evhttp_find_header(evhttp_request_get_input_headers(req), "X-Priority");
+    if (priority && strcmp(priority, "high") == 0) return true;
+    if (!priority_port) return false;
+
+    // Internal callers may also connect to a port of their own.
+    struct evhttp_connection *conn = evhttp_request_get_connection(req);
+    struct bufferevent *bev = conn ? evhttp_connection_get_bufferevent(conn) : NULL;
+    if (!bev) return false;
+
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+    return getsockname(bufferevent_getfd(bev), (struct sockaddr *) &sin, &len) == 0 &&
+           sin.sin_family == AF_INET && ntohs(sin.sin_port) == priority_port;
+}
+
+static void shed(struct evhttp_request *req, enum shed_reason reason) {
+    counter_add(&thread_metrics()->shed[reason], 1);
+    evhttp_add_header(evhttp_request_get_output_headers(req), "Retry-After", "1");
+    evhttp_send_error(req, HTTP_SERVUNAVAIL, "Overloaded");
+}
+
+// Replies right away and returns false if the request must not queue.
+static bool admit(struct evhttp_request *req, bool priority, bool expensive) {
+    if (priority) return true;
+
+    if (num_deferred >= max_deferred) {
+        shed(req, SHED_QUEUE_FULL);
+        return false;
+    }
+
+    if (expensive && num_deferred_expensive >= max_deferred_expensive) {
+        shed(req, SHED_EXPENSIVE);
+        return false;
+    }
+
+    return true;
+}
+
+static void deferred_begin(bool expensive) {
+    num_deferred++;
+    if (expensive) num_deferred_expensive++;
+}
+
+static void deferred_end(bool expensive) {
+    num_deferred--;
+    if (expensive) num_deferred_expensive--;
+}
+
+// Checked on the pool thread, for jobs that waited in its queue. Nobody is
+// waiting for the answer anymore.
+static bool deadline_exceeded(uint64_t start, bool priority) {
+    return !priority && queue_deadline_ns && now_ns() - start > queue_deadline_ns;
+}
+
+// Opt-in breakdown of /master requests, see finish_timing().
+enum phase {
+    PHASE_PARSE,
+    PHASE_HASH,
+    PHASE_READ,
+    PHASE_DECODE,
+    PHASE_SAN,
+    PHASE_TOP_GAMES,
+    NUM_PHASES,
+};
+
+static const char *const PHASE_NAMES[NUM_PHASES] = {
+    "parse", "hash", "read", "decode", "san", "top-games",
+};
+
+struct request_timing {
+    uint64_t start;
+    uint64_t phases[NUM_PHASES];
+};
+
+static double timing_sample_rate = 0;
+static uint64_t slow_request_ns = 100000000;
+
+// Set while a timed request is handled on this thread.
+static __thread struct request_timing *request_timing;
+
+static inline uint64_t timing_start(void) {
+    return request_timing ? now_ns() : 0;
+}
+
+static inline void timing_stop(enum phase phase, uint64_t start) {
+    if (request_timing) request_timing->phases[phase] += now_ns() - start;
+}
+
+static bool timing_requested(struct evhttp_request *req) {
+    if (evhttp_find_header(evhttp_request_get_input_headers(req), "X-Server-Timing")) return true;
+    if (timing_sample_rate <= 0) return false;
+
+    // Xorshift, seeded per thread.
+    static __thread uint64_t state;
+    if (!state) state = now_ns() | 1;
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return (state >> 11) * 0x1.0p-53 < timing_sample_rate;
+}
+
+static void finish_timing(struct evhttp_request *req, const struct request_timing *timing, const char *fen) {
+    if (!timing) return;
+
+    uint64_t total = now_ns() - timing->start;
+
+    char header[256];
+    size_t len = 0;
+    for (int i = 0; i < NUM_PHASES; i++) {
+        len += snprintf(header + len, sizeof(header) - len, "%s;dur=%.3f, ", PHASE_NAMES[i], timing->phases[i] / 1e6);
+    }
+    snprintf(header + len, sizeof(header) - len, "total;dur=%.3f", total / 1e6);
+    evhttp_add_header(evhttp_request_get_output_headers(req), "Server-Timing", header);
+
+    if (total >= slow_request_ns) printf("slow: %s fen=%.255s\n", header, fen);
+}
+
+bool lookup_master_record(uint64_t zobrist_hash, struct master_record *record) {
+    uint64_t start = timing_start();
+
+    struct cache_value *value = NULL;
+    if (dataset->record_cache) value = cache_get(dataset->record_cache, (const char *) &zobrist_hash, 8);
+
+    if (!value) {
+        // Also cache misses as empty values.
+        size_t record_size;
+        char *encoded_record = metered_kcdbget(dataset->master_db, (const char *) &zobrist_hash, 8, &record_size);
+        value = cache_value_new(encoded_record, encoded_record ? record_size : 0);
+        if (encoded_record) kcfree(encoded_record);
+
+        if (dataset->record_cache) cache_put(dataset->record_cache, (const char *) &zobrist_hash, 8, value);
+    }
+
+    timing_stop(PHASE_READ, start);
+
+    bool found = value->size > 0;
+    if (found) {
+        histogram_record(&thread_metrics()->record_size, value->size);
+        start = timing_start();
+        decode_master_record((const uint8_t *) value->data, record);
+        timing_stop(PHASE_DECODE, start);
+    }
+    cache_value_release(value);
+    return found;
+}
+
+// Encoded records for many positions, with a single database round trip for
+// everything that is not cached. Empty values for unknown positions.
+static void lookup_master_values(const uint64_t *hashes, size_t num_hashes, struct cache_value **values) {
+    uint64_t start = timing_start();
+
+    KCSTR *keys = malloc(num_hashes * sizeof(KCSTR));
+    KCREC *recs = malloc(num_hashes * sizeof(KCREC));
+    if ((!keys || !recs) && num_hashes) abort();
+
+    size_t num_keys = 0;
+    for (size_t i = 0; i < num_hashes; i++) {
+        values[i] = dataset->record_cache ? cache_get(dataset->record_cache, (const char *) &hashes[i], 8) : NULL;
+        if (!values[i]) {
+            keys[num_keys].buf = (char *) &hashes[i];
+            keys[num_keys].size = 8;
+            num_keys++;
+        }
+    }
+
+    if (num_keys) {
+        struct thread_metrics *metrics = thread_metrics();
+        uint64_t read_start = now_ns();
+        int64_t num_recs = kcdbgetbulk(dataset->master_db, keys, num_keys, recs, false);
+        histogram_record(&metrics->kcdbget_latency, now_ns() - read_start);
+        if (num_recs < 0) {
+            printf("master.kch bulk get error: %s\n", kcecodename(kcdbecode(dataset->master_db)));
+            num_recs = 0;
+        }
+
+        // Records come back in no particular order, and only once for
+        // repeated positions.
+        for (int64_t r = 0; r < num_recs; r++) {
+            struct cache_value *value = NULL;
+            for (size_t i = 0; i < num_hashes; i++) {
+                if (values[i] || recs[r].key.size != 8 || memcmp(recs[r].key.buf, &hashes[i], 8) != 0) continue;
+
+                if (value) {
+                    values[i] = cache_value_ref(value);
+                } else {
+                    values[i] = value = cache_value_new(recs[r].value.buf, recs[r].value.size);
+                    counter_add(&metrics->kcdbget_bytes, recs[r].value.size);
+                    if (dataset->record_cache) cache_put(dataset->record_cache, (const char *) &hashes[i], 8, value);
+                }
+            }
+            kcfree(recs[r].key.buf);
+            kcfree(recs[r].value.buf);
+        }
+
+        // Also cache misses as empty values.
+        for (size_t i = 0; i < num_hashes; i++) {
+            if (values[i]) continue;
+            values[i] = cache_value_new(NULL, 0);
+            counter_add(&metrics->kcdbget_misses, 1);
+            if (dataset->record_cache) cache_put(dataset->record_cache, (const char *) &hashes[i], 8, values[i]);
+        }
+    }
+
+    free(keys);
+    free(recs);
+    timing_stop(PHASE_READ, start);
+}
+
+// Compressed PGN variants share the response cache. The key size alone keeps
+// them apart from master_cache_key.
+struct pgn_cache_key {
+    char game_id[8];
+    uint8_t encoding;
+};
+
+void release_body(const void *data, size_t size, void *body) {
+    cache_value_release(body);
+}
+
+struct pgn_job {
+    struct iopool_job job;
+    struct evhttp_request *req;
+    char game_id[9];
+    enum content_encoding encoding;
+    uint64_t start;
+    struct dataset *dataset;
+    bool queued;  // went through the I/O pool
+    enum shed_reason shed;
+    struct cache_value *body;  // NULL if not found
+};
+
+static void release_mapped_pgn(const void *data, size_t size, void *ds) {
+    dataset_release(ds);
+}
+
+static void pgn_job_run(struct iopool_job *job) {
+    struct pgn_job *pgn_job = (struct pgn_job *) job;
+    struct dataset *ds = pgn_job->dataset;
+
+    if (pgn_job->queued && deadline_exceeded(pgn_job->start, job->priority)) {
+        pgn_job->shed = SHED_DEADLINE;
+        return;
+    }
+
+    size_t pgn_size;
+    char *pgn = NULL;
+    const char *text = ds->master_pgn_store ? pgnstore_find(ds->master_pgn_store, pgn_job->game_id, &pgn_size) : NULL;
+    if (!text) text = pgn = metered_kcdbget(ds->master_pgn_db, pgn_job->game_id, 8, &pgn_size);
+    if (!text) return;
+
+    if (pgn_job->encoding == ENCODING_IDENTITY || pgn_size < COMPRESS_MIN_SIZE) {
+        pgn_job->encoding = ENCODING_IDENTITY;
+        pgn_job->body = cache_value_new(text, pgn_size);
+    } else {
+        pgn_job->body = compress_value(text, pgn_size, pgn_job->encoding);
+
+        struct pgn_cache_key key;
+        memcpy(key.game_id, pgn_job->game_id, 8);
+        key.encoding = pgn_job->encoding;
+        if (ds->master_cache) cache_put(ds->master_cache, (const char *) &key, sizeof(key), pgn_job->body);
+    }
+
+    if (pgn) kcfree(pgn);
+}
+
+static void pgn_reply(struct evhttp_request *req, struct cache_value *body, enum content_encoding encoding) {
+    if (!body) {
+        evhttp_send_error(req, HTTP_NOTFOUND, "Master PGN Not Found");
+        return;
+    }
+
+    if (encoding != ENCODING_IDENTITY) {
+        evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Encoding", compress_encoding_name(encoding));
+    }
+    evbuffer_add_reference(evhttp_request_get_output_buffer(req), body->data, body->size, release_body, body);
+    evhttp_send_reply(req, HTTP_OK, "OK", NULL);
+}
+
+static void pgn_job_done(struct iopool_job *job) {
+    struct pgn_job *pgn_job = (struct pgn_job *) job;
+    if (pgn_job->shed) shed(pgn_job->req, pgn_job->shed);
+    else pgn_reply(pgn_job->req, pgn_job->body, pgn_job->encoding);
+    deferred_end(true);
+    record_request(ENDPOINT_MASTER_PGN, pgn_job->start);
+    dataset_release(pgn_job->dataset);
+    free(pgn_job);
+}
+
 void get_master_pgn(struct evhttp_request *req, void *context) {
     if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
         evhttp_send_error(req, HTTP_BADMETHOD, "Method Not Allowed");
@@ -38,241 +613,2193 @@ void get_master_pgn(struct evhttp_request *req, void *context) {
         return;
     }
 
-    char game_id[9] = {};
+    struct pgn_job local = {};
     int end;
-    if (1 != sscanf(path, "/master/pgn/%8s%n", game_id, &end) ||
-            strlen(game_id) != 8 ||
+    if (1 != sscanf(path, "/master/pgn/%8s%n", local.game_id, &end) ||
+            strlen(local.game_id) != 8 ||
             strlen(path) != end) {
         evhttp_send_error(req, HTTP_NOTFOUND, "Not Found");
         return;
     }
 
-    size_t pgn_size;
-    char *pgn = kcdbget(master_pgn_db, game_id, 8, &pgn_size);
-    if (!pgn) {
-        evhttp_send_error(req, HTTP_NOTFOUND, "Master PGN Not Found");
-        return;
-    }
-
-    struct evbuffer *res = evbuffer_new();
-    if (!res) {
-        puts("could not allocate response buffer");
-        abort();
-    }
-
     struct evkeyvalq *headers = evhttp_request_get_output_headers(req);
     evhttp_add_header(headers, "Content-Type", "application/vnd.chess-pgn; charset=utf-8");
+    evhttp_add_header(headers, "Vary", "Accept-Encoding");
 
-    evbuffer_add(res, pgn, pgn_size);
-    kcfree(pgn);
+    local.encoding = compress_negotiate(
+        evhttp_find_header(evhttp_request_get_input_headers(req), "Accept-Encoding"));
 
-    evhttp_send_reply(req, HTTP_OK, "OK", res);
-    evbuffer_free(res);
-}
+    // Fast paths: cached compressed variant, or mapped text as is.
+    if (local.encoding != ENCODING_IDENTITY && dataset->master_cache) {
+        struct pgn_cache_key key;
+        memcpy(key.game_id, local.game_id, 8);
+        key.encoding = local.encoding;
 
-void get_master(struct evhttp_request *req, void *context) {
-    if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
-        evhttp_send_error(req, HTTP_BADMETHOD, "Method Not Allowed");
-        return;
+        struct cache_value *body = cache_get(dataset->master_cache, (const char *) &key, sizeof(key));
+        if (body) {
+            pgn_reply(req, body, local.encoding);
+            return;
+        }
     }
 
-    const char *uri = evhttp_request_get_uri(req);
-    if (!uri) {
-        puts("evhttp_request_get_uri failed");
+    size_t pgn_size;
+    const char *mapped_pgn = dataset->master_pgn_store ? pgnstore_find(dataset->master_pgn_store, local.game_id, &pgn_size) : NULL;
+    if (mapped_pgn && (local.encoding == ENCODING_IDENTITY || pgn_size < COMPRESS_MIN_SIZE)) {
+        // Reference the mapped text, no allocations or copies. The mapping
+        // must outlive the buffer, even across a reload.
+        evbuffer_add_reference(evhttp_request_get_output_buffer(req), mapped_pgn, pgn_size,
+                               release_mapped_pgn, dataset_ref(dataset));
+        evhttp_send_reply(req, HTTP_OK, "OK", NULL);
         return;
     }
 
-    struct evkeyvalq query;
-    const char *fen = NULL;
-    const char *jsonp = NULL;
-    int moves = 12;
-    int topGames = 4;
-    if (0 == evhttp_parse_query(uri, &query)) {
-        fen = evhttp_find_header(&query, "fen");
-        jsonp = evhttp_find_header(&query, "callback");
+    local.req = req;
+    local.start = request_start;
+    local.dataset = dataset;
+    local.job.run = pgn_job_run;
+    local.job.done = pgn_job_done;
 
-        if (evhttp_find_header(&query, "moves")) {
-            moves = atoi(evhttp_find_header(&query, "moves"));
-        }
+    if (io_pool) {
+        // Exports are expensive.
+        local.job.priority = priority_requested(req);
+        if (!admit(req, local.job.priority, true)) return;
 
-        if (evhttp_find_header(&query, "topGames")) {
-            topGames = atoi(evhttp_find_header(&query, "topGames"));
+        struct pgn_job *job = malloc(sizeof(struct pgn_job));
+        if (!job) abort();
+        *job = local;
+        dataset_ref(job->dataset);
+        deferred_begin(true);
+        request_deferred = true;
+
+        job->queued = true;
+        if (!iopool_submit(io_pool, io_loop, &job->job)) {
+            // Pool is saturated. Only priority requests wait for the read
+            // right here.
+            job->queued = false;
+            if (job->job.priority) pgn_job_run(&job->job);
+            else job->shed = SHED_QUEUE_FULL;
+            pgn_job_done(&job->job);
         }
-    }
-    if (!fen || !strlen(fen)) {
-        evhttp_send_error(req, HTTP_BADREQUEST, "Missing FEN");
         return;
     }
 
-    // Look up positon.
-    board_t pos;
-    if (!board_set_fen(&pos, fen)) {
-        evhttp_send_error(req, HTTP_BADREQUEST, "Invalid FEN");
-    }
+    pgn_job_run(&local.job);
+    if (local.shed) shed(req, local.shed);
+    else pgn_reply(req, local.body, local.encoding);
+}
 
-    if (verbose) printf("master: %.255s\n", fen);
+enum master_format {
+    MASTER_FORMAT_JSON,
+    MASTER_FORMAT_BINARY,
+    MASTER_FORMAT_BINARY_SAN,
+};
 
-    struct evbuffer *res = evbuffer_new();
-    if (!res) {
-        puts("could not allocate response buffer");
-        abort();
-    }
+struct master_cache_key {
+    uint64_t zobrist_hash;
+    int32_t moves;
+    int16_t top_games;
+    uint8_t format;
+    uint8_t encoding;
+};
 
-    // CORS.
-    struct evkeyvalq *headers = evhttp_request_get_output_headers(req);
-    if (cors) evhttp_add_header(headers, "Access-Control-Allow-Origin", "*");
+// Per thread render buffer, reused across requests.
+static __thread struct json render_buffer;
 
-    // Set Content-Type.
-    if (jsonp && strlen(jsonp)) {
-        evhttp_add_header(headers, "Content-Type", "application/javascript");
-        evbuffer_add_printf(res, "%s(", jsonp);
-    } else {
-        evhttp_add_header(headers, "Content-Type", "application/json");
-    }
+static void render_top_game(struct json *json, const char *game_id, int result,
+                            const char *white, int white_elo,
+                            const char *black, int black_elo,
+                            int year) {
+    json_literal(json, "    {\n      \"id\": \"");
+    json_append(json, game_id, 8);
+    json_literal(json, "\",\n      \"winner\": ");
+    if (result > 0) json_literal(json, "\"white\"");
+    else if (result < 0) json_literal(json, "\"black\"");
+    else json_literal(json, "\"draw\"");
+    json_literal(json, ",\n      \"white\": {\n        \"name\": ");
+    json_string(json, white);
+    json_literal(json, ",\n        \"rating\": ");
+    json_int(json, white_elo);
+    json_literal(json, "\n      },\n      \"black\": {\n        \"name\": ");
+    json_string(json, black);
+    json_literal(json, ",\n        \"rating\": ");
+    json_int(json, black_elo);
+    json_literal(json, "\n      },\n      \"year\": ");
+    json_int(json, year);
+}
 
-    uint64_t zobrist_hash = board_zobrist_hash(&pos, POLYGLOT);
+// Records only hold legal moves, and no position has more than 218, so
+// SANs are rendered into stack buffers.
+static const size_t MAX_RENDER_MOVES = 256;
 
-    struct master_record *record = master_record_new();
-    size_t record_size;
-    char *encoded_record = kcdbget(master_db, (const char *) &zobrist_hash, 8, &record_size);
-    if (encoded_record) {
-        decode_master_record((const uint8_t *) encoded_record, record);
-    }
+// SANs of the first num_moves moves of the record, LEN_SAN chars each.
+static void render_sans(const board_t *pos, const struct master_record *record, size_t num_moves, char *sans) {
+    uint64_t start = timing_start();
 
+    move_t list[MAX_RENDER_MOVES];
+    for (size_t i = 0; i < num_moves; i++) list[i] = record->moves[i].move;
+    board_san_all(pos, list, num_moves, sans);
+
+    timing_stop(PHASE_SAN, start);
+}
+
+void render_master(const board_t *pos, const struct master_record *record, int moves, int topGames, struct json *json) {
     unsigned long average_rating_sum = master_record_average_rating_sum(record);
     unsigned long total_white = master_record_white(record);
     unsigned long total_draws = master_record_draws(record);
     unsigned long total_black = master_record_black(record);
     unsigned long total = total_white + total_draws + total_black;
 
-    evbuffer_add_printf(res, "{\n");
-
     // Add totals.
-    evbuffer_add_printf(res, "  \"white\": %lu,\n", total_white);
-    evbuffer_add_printf(res, "  \"draws\": %lu,\n", total_draws);
-    evbuffer_add_printf(res, "  \"black\": %lu,\n", total_black);
-    if (total) evbuffer_add_printf(res, "  \"averageRating\": %lu,\n", average_rating_sum / total);
-    else evbuffer_add_printf(res, "  \"averageRating\": null,\n");
+    json_literal(json, "{\n  \"white\": ");
+    json_uint(json, total_white);
+    json_literal(json, ",\n  \"draws\": ");
+    json_uint(json, total_draws);
+    json_literal(json, ",\n  \"black\": ");
+    json_uint(json, total_black);
+    json_literal(json, ",\n  \"averageRating\": ");
+    if (total) json_uint(json, average_rating_sum / total);
+    else json_literal(json, "null");
 
     // Add move list.
-    evbuffer_add_printf(res, "  \"moves\": [\n");
-    for (size_t i = 0; i < record->num_moves && i < moves; i++) {
+    size_t num_moves = record->num_moves < moves ? record->num_moves : moves;
+    if (num_moves > MAX_RENDER_MOVES) num_moves = MAX_RENDER_MOVES;
+    char sans[MAX_RENDER_MOVES * LEN_SAN];
+    render_sans(pos, record, num_moves, sans);
+
+    json_literal(json, ",\n  \"moves\": [\n");
+    for (size_t i = 0; i < num_moves; i++) {
         unsigned long move_total = record->moves[i].white + record->moves[i].draws + record->moves[i].black;
 
-        char uci[LEN_UCI], san[LEN_SAN];
+        char uci[LEN_UCI];
+        const char *san = sans + i * LEN_SAN;
         move_uci(record->moves[i].move, uci);
-        board_san(&pos, record->moves[i].move, san);
-
-        evbuffer_add_printf(res, "    {\n");
-        evbuffer_add_printf(res, "      \"uci\": \"%s\",\n", uci);
-        evbuffer_add_printf(res, "      \"san\": \"%s\",\n", san);
-        evbuffer_add_printf(res, "      \"white\": %lu,\n", record->moves[i].white);
-        evbuffer_add_printf(res, "      \"draws\": %lu,\n", record->moves[i].draws);
-        evbuffer_add_printf(res, "      \"black\": %lu,\n", record->moves[i].black);
-        if (move_total) {
-            evbuffer_add_printf(res, "      \"averageRating\": %lu\n", record->moves[i].average_rating_sum / move_total);
-        } else {
-            evbuffer_add_printf(res, "      \"averageRating\": null\n");
-        }
-        evbuffer_add_printf(res, "    }%s\n", (i < record->num_moves - 1 && i < moves - 1) ? "," : "");
-    }
 
-    evbuffer_add_printf(res, "  ],\n");
+        json_literal(json, "    {\n      \"uci\": \"");
+        json_append(json, uci, strlen(uci));
+        json_literal(json, "\",\n      \"san\": \"");
+        json_append(json, san, strlen(san));
+        json_literal(json, "\",\n      \"white\": ");
+        json_uint(json, record->moves[i].white);
+        json_literal(json, ",\n      \"draws\": ");
+        json_uint(json, record->moves[i].draws);
+        json_literal(json, ",\n      \"black\": ");
+        json_uint(json, record->moves[i].black);
+        json_literal(json, ",\n      \"averageRating\": ");
+        if (move_total) json_uint(json, record->moves[i].average_rating_sum / move_total);
+        else json_literal(json, "null");
+        if (i < num_moves - 1) json_literal(json, "\n    },\n");
+        else json_literal(json, "\n    }\n");
+    }
 
     // Add top games.
-    evbuffer_add_printf(res, "  \"topGames\": [\n");
+    uint64_t start = timing_start();
+    json_literal(json, "  ],\n  \"topGames\": [\n");
     for (size_t i = 0; i < record->num_refs && i < topGames; i++) {
         char game_id[9] = {};
         strncpy(game_id, record->refs[i].game_id, 8);
 
-        size_t pgn_size;
-        char *pgn = kcdbget(master_pgn_db, game_id, 8, &pgn_size);
-        if (!pgn) continue;
-
-        char *save_ptr;
-        struct pgn_game_info *game_info = pgn_game_info_read(pgn, &save_ptr);
-        if (!game_info->white || !game_info->black) continue;
-
-        evbuffer_add_printf(res, "    {\n");
-        // TODO: winner, white.name, white.rating, black.name, black.rating, -avg rating
-        evbuffer_add_printf(res, "      \"id\": \"%s\",\n", game_id);
-        evbuffer_add_printf(res, "      \"winner\": \"%s\",\n", game_info->result ? (game_info->result > 0 ? "white" : "black") : "draw");
-        evbuffer_add_printf(res, "      \"white\": {\n");
-        evbuffer_add_printf(res, "        \"name\": \"%s\",\n", game_info->white); // XXX TODO !
-        evbuffer_add_printf(res, "        \"rating\": %d\n", game_info->white_elo);
-        evbuffer_add_printf(res, "      },\n");
-        evbuffer_add_printf(res, "      \"black\": {\n");
-        evbuffer_add_printf(res, "        \"name\": \"%s\",\n", game_info->black); // XXX TODO !
-        evbuffer_add_printf(res, "        \"rating\": %d\n", game_info->black_elo);
-        evbuffer_add_printf(res, "      },\n");
-        evbuffer_add_printf(res, "      \"year\": %d\n", game_info->year);
-        evbuffer_add_printf(res, "    }%s\n", (i < record->num_refs - 1 && i < topGames - 1) ? "," : "");
-    }
-    evbuffer_add_printf(res, "  ]\n");
-
-    evbuffer_add_printf(res, "}%s\n", (jsonp && strlen(jsonp)) ? ")" : "");
+        if (dataset->master_info) {
+            const struct gameinfo_entry *entry = gameinfo_find(dataset->master_info, game_id);
+            if (!entry) continue;
 
-    evhttp_send_reply(req, HTTP_OK, "OK", res);
-    evbuffer_free(res);
-}
+            render_top_game(json, game_id, entry->result,
+                            gameinfo_string(dataset->master_info, entry->white), entry->white_elo,
+                            gameinfo_string(dataset->master_info, entry->black), entry->black_elo,
+                            entry->year);
+        } else {
+            // Fall back to parsing the PGN headers.
+            size_t pgn_size;
+            char *pgn = metered_kcdbget(dataset->master_pgn_db, game_id, 8, &pgn_size);
+            if (!pgn) continue;
 
-int serve(int port) {
-    struct event_base *base = event_base_new();
-    if (!base) {
-        puts("could not initialize event_base");
-        abort();
-    }
+            char *save_ptr;
+            struct pgn_game_info *game_info = pgn_game_info_read(pgn, &save_ptr);
+            if (!game_info->white || !game_info->black) {
+                pgn_game_info_free(game_info);
+                kcfree(pgn);
+                continue;
+            }
 
-    struct evhttp *http = evhttp_new(base);
-    if (!http) {
-        puts("could not initialize evhttp");
-        abort();
-    }
+            render_top_game(json, game_id, game_info->result,
+                            game_info->white, game_info->white_elo,
+                            game_info->black, game_info->black_elo,
+                            game_info->year);
 
-    evhttp_set_cb(http, "/master", get_master, NULL); // master
-    evhttp_set_gencb(http, get_master_pgn, NULL);     // master/pgn/{8}
+            pgn_game_info_free(game_info);
+            kcfree(pgn);
+        }
 
-    struct evhttp_bound_socket *socket =
-        evhttp_bind_socket_with_handle(http, "127.0.0.1", port);
-    if (!socket) {
-        printf("could not bind socket to http://127.0.0.1:%d/\n", port);
-        return 1;
+        if (i < record->num_refs - 1 && i < topGames - 1) json_literal(json, "\n    },\n");
+        else json_literal(json, "\n    }\n");
     }
 
-    printf("listening on http://127.0.0.1:%d/ ...\n", port);
+    json_literal(json, "  ]\n}");
+    timing_stop(PHASE_TOP_GAMES, start);
+}
+
+// Binary format for internal consumers. All integers are little endian.
+//
+//  0  char[2]   "MR"
+//  2  uint8     version (1)
+//  3  uint8     flags (1: SAN included)
+//  4  uint16    number of moves
+//  6  uint16    number of top games
+//  8  uint64[4] white, draws, black, average rating sum (totals)
+// 40  moves:    uint16 move_t, [char[8] SAN, NUL padded,]
+//               uint64[4] white, draws, black, average rating sum
+//     games:    char[8] game id, uint16 average rating
+static const size_t MASTER_BINARY_HEADER_SIZE = 40;
 
-    return event_base_dispatch(base);
+static uint8_t *put_uint16(uint8_t *buffer, uint16_t value) {
+    memcpy(buffer, &value, sizeof(value));
+    return buffer + sizeof(value);
 }
 
-int main() {
-    attacks_init();
+static uint8_t *put_uint64(uint8_t *buffer, uint64_t value) {
+    memcpy(buffer, &value, sizeof(value));
+    return buffer + sizeof(value);
+}
 
-    master_pgn_db = kcdbnew();
-    puts("opening master-pgn.kct ...");
-    if (!kcdbopen(master_pgn_db, "master-pgn.kct", KCOREADER)) {
-        printf("master-pgn.kct open error: %s\n", kcecodename(kcdbecode(master_pgn_db)));
-        return 1;
+struct cache_value *render_master_binary(const board_t *pos, const struct master_record *record, int moves, int topGames, bool san) {
+    size_t num_moves = record->num_moves < moves ? record->num_moves : moves;
+    if (num_moves > MAX_RENDER_MOVES) num_moves = MAX_RENDER_MOVES;
+    size_t num_refs = record->num_refs < topGames ? record->num_refs : topGames;
+
+    size_t move_size = 2 + (san ? LEN_SAN : 0) + 4 * 8;
+    struct cache_value *body = cache_value_new(NULL, MASTER_BINARY_HEADER_SIZE + num_moves * move_size + num_refs * 10);
+    uint8_t *buffer = (uint8_t *) body->data;
+
+    *buffer++ = 'M';
+    *buffer++ = 'R';
+    *buffer++ = 1;
+    *buffer++ = san ? 1 : 0;
+    buffer = put_uint16(buffer, num_moves);
+    buffer = put_uint16(buffer, num_refs);
+    buffer = put_uint64(buffer, master_record_white(record));
+    buffer = put_uint64(buffer, master_record_draws(record));
+    buffer = put_uint64(buffer, master_record_black(record));
+    buffer = put_uint64(buffer, master_record_average_rating_sum(record));
+
+    char sans[MAX_RENDER_MOVES * LEN_SAN];
+    if (san) render_sans(pos, record, num_moves, sans);
+
+    for (size_t i = 0; i < num_moves; i++) {
+        buffer = put_uint16(buffer, record->moves[i].move);
+
+        if (san) {
+            // NUL padded.
+            strncpy((char *) buffer, sans + i * LEN_SAN, LEN_SAN);
+            buffer += LEN_SAN;
+        }
+
+        buffer = put_uint64(buffer, record->moves[i].white);
+        buffer = put_uint64(buffer, record->moves[i].draws);
+        buffer = put_uint64(buffer, record->moves[i].black);
+        buffer = put_uint64(buffer, record->moves[i].average_rating_sum);
     }
 
-    master_db = kcdbnew();
-    puts("opening master.kch ...");
-    if (!kcdbopen(master_db, "master.kch", KCOREADER)) {
-        printf("master.kch open error: %s\n", kcecodename(kcdbecode(master_db)));
-        return 1;
+    for (size_t i = 0; i < num_refs; i++) {
+        memcpy(buffer, record->refs[i].game_id, 8);
+        buffer = put_uint16(buffer + 8, record->refs[i].average_rating);
     }
 
-    puts("opened all databases.");
+    assert((char *) buffer == body->data + body->size);
+    return body;
+}
 
-    int ret = serve(5555);
+static struct cache_value *master_body_cached(uint64_t zobrist_hash, int moves, int topGames, enum master_format format) {
+    if (!dataset->master_cache) return NULL;
 
-    if (!kcdbclose(master_pgn_db)) {
-        printf("master-pgn.kct close error: %s\n", kcecodename(kcdbecode(master_pgn_db)));
-    }
+    struct master_cache_key key = { zobrist_hash, moves, topGames, format, ENCODING_IDENTITY };
+    return cache_get(dataset->master_cache, (const char *) &key, sizeof(key));
+}
+
+// Renders and caches the body of a position. value is its encoded record
+// if that was already read, NULL to look it up.
+static struct cache_value *master_body_render(const board_t *pos, uint64_t zobrist_hash, const struct cache_value *value,
+                                              int moves, int topGames, enum master_format format) {
+    uint64_t start = now_ns();
+
+    struct master_record *record = master_record_new();
+    if (!value) lookup_master_record(zobrist_hash, record);
+    else if (value->size) decode_master_record((const uint8_t *) value->data, record);
+
+    struct cache_value *body;
+    if (format == MASTER_FORMAT_JSON) {
+        json_clear(&render_buffer);
+        render_master(pos, record, moves, topGames, &render_buffer);
+        body = cache_value_new(render_buffer.data, render_buffer.size);
+    } else {
+        body = render_master_binary(pos, record, moves, topGames, format == MASTER_FORMAT_BINARY_SAN);
+    }
+    master_record_free(record);
+
+    histogram_record(&thread_metrics()->render_latency, now_ns() - start);
+
+    struct master_cache_key key = { zobrist_hash, moves, topGames, format, ENCODING_IDENTITY };
+    if (dataset->master_cache) cache_put(dataset->master_cache, (const char *) &key, sizeof(key), body);
+    return body;
+}
+
+struct cache_value *master_body(const board_t *pos, uint64_t zobrist_hash, int moves, int topGames, enum master_format format) {
+    struct cache_value *body = master_body_cached(zobrist_hash, moves, topGames, format);
+    if (body) return body;
+    return master_body_render(pos, zobrist_hash, NULL, moves, topGames, format);
+}
+
+// Complete response body in the requested encoding. Compressed variants are
+// produced once and cached next to the plain body. Falls back to identity
+// for small bodies, so check the encoding on return.
+struct cache_value *master_response(const board_t *pos, uint64_t zobrist_hash, int moves, int topGames,
+                                    enum master_format format, enum content_encoding *encoding) {
+    struct master_cache_key key = { zobrist_hash, moves, topGames, format, *encoding };
+
+    if (*encoding != ENCODING_IDENTITY && dataset->master_cache) {
+        struct cache_value *body = cache_get(dataset->master_cache, (const char *) &key, sizeof(key));
+        if (body) return body;
+    }
+
+    struct cache_value *plain = master_body(pos, zobrist_hash, moves, topGames, format);
+    if (*encoding == ENCODING_IDENTITY || plain->size < COMPRESS_MIN_SIZE) {
+        *encoding = ENCODING_IDENTITY;
+        return plain;
+    }
+
+    struct cache_value *body;
+    if (format == MASTER_FORMAT_JSON) {
+        // The trailing newline is not part of the plain body.
+        json_clear(&render_buffer);
+        json_append(&render_buffer, plain->data, plain->size);
+        json_literal(&render_buffer, "\n");
+        body = compress_value(render_buffer.data, render_buffer.size, *encoding);
+    } else {
+        body = compress_value(plain->data, plain->size, *encoding);
+    }
+    cache_value_release(plain);
+
+    if (dataset->master_cache) cache_put(dataset->master_cache, (const char *) &key, sizeof(key), body);
+    return body;
+}
+
+void query_limits(const struct evkeyvalq *query, int *moves, int *topGames) {
+    if (evhttp_find_header(query, "moves")) {
+        *moves = atoi(evhttp_find_header(query, "moves"));
+    }
+
+    if (evhttp_find_header(query, "topGames")) {
+        *topGames = atoi(evhttp_find_header(query, "topGames"));
+    }
+
+    // Negative limits mean no limit. Normalize for the cache key.
+    if (*moves < 0 || *moves > UINT16_MAX) *moves = UINT16_MAX;
+    if (*topGames < 0 || *topGames > MASTER_MAX_REFS) *topGames = MASTER_MAX_REFS;
+}
+
+// Everything needed to produce a /master reply, possibly off the loop.
+struct master_job {
+    struct iopool_job job;
+    struct evhttp_request *req;
+
+    board_t pos;
+    uint64_t zobrist_hash;
+    int moves;
+    int top_games;
+    enum master_format format;
+    enum content_encoding encoding;
+    char *jsonp;  // NULL unless wrapped
+
+    char fen[256];
+    uint64_t start;
+    bool timed;
+    struct request_timing timing;
+
+    struct dataset *dataset;
+    bool leader;  // of a flight
+    bool expensive;
+    bool queued;  // went through the I/O pool
+    enum shed_reason shed;
+    struct cache_value *body;  // NULL if shed
+};
+
+// Different datasets may answer differently. Priority requests are never
+// shed, so they do not wait behind others.
+struct master_flight_key {
+    struct dataset *dataset;
+    struct master_cache_key key;
+    bool priority;
+};
+
+static void master_flight_key(const struct master_job *job, struct master_flight_key *key) {
+    memset(key, 0, sizeof(struct master_flight_key));
+    key->dataset = job->dataset;
+    key->key.zobrist_hash = job->zobrist_hash;
+    key->key.moves = job->moves;
+    key->key.top_games = job->top_games;
+    key->key.format = job->format;
+    key->key.encoding = job->encoding;
+    key->priority = job->job.priority;
+}
+
+// Hands the result of the leader to the requests that waited for it. They
+// complete on their own event loops.
+static void master_land(const struct master_job *leader, const struct master_flight_key *key) {
+    struct iopool_job *waiter = flight_land(master_flight, (const char *) key, sizeof(struct master_flight_key));
+    while (waiter) {
+        struct iopool_job *next = waiter->next;
+        struct master_job *job = (struct master_job *) waiter;
+        job->body = leader->body ? cache_value_ref(leader->body) : NULL;
+        job->encoding = leader->encoding;
+        job->shed = leader->shed;
+        iopool_complete(waiter);
+        waiter = next;
+    }
+}
+
+// Synchronous fast path. Returns a cached body in the requested encoding,
+// or a cached plain body that is too small to be compressed, in which case
+// the encoding falls back to identity. On a miss the encoding is left
+// alone, so that the body is rendered in the requested encoding.
+static struct cache_value *master_cached(const struct master_job *job, enum content_encoding *encoding) {
+    if (!dataset->master_cache) return NULL;
+
+    struct master_cache_key key = { job->zobrist_hash, job->moves, job->top_games, job->format, job->encoding };
+    struct cache_value *body = cache_get(dataset->master_cache, (const char *) &key, sizeof(key));
+    if (body || job->encoding == ENCODING_IDENTITY) {
+        *encoding = job->encoding;
+        return body;
+    }
+
+    // Small bodies are never compressed.
+    key.encoding = ENCODING_IDENTITY;
+    body = cache_get(dataset->master_cache, (const char *) &key, sizeof(key));
+    if (!body) return NULL;
+    if (body->size >= COMPRESS_MIN_SIZE) {
+        cache_value_release(body);
+        return NULL;
+    }
+
+    *encoding = ENCODING_IDENTITY;
+    return body;
+}
+
+static void master_job_run(struct iopool_job *job) {
+    struct master_job *master_job = (struct master_job *) job;
+
+    // Taken before the encoding falls back to identity.
+    struct master_flight_key key;
+    if (master_job->leader) master_flight_key(master_job, &key);
+
+    if (master_job->queued && deadline_exceeded(master_job->start, job->priority)) {
+        master_job->shed = SHED_DEADLINE;
+    } else {
+        // Pool threads serve whichever dataset the request started on.
+        struct dataset *previous = dataset;
+        dataset = master_job->dataset;
+
+        request_timing = master_job->timed ? &master_job->timing : NULL;
+        master_job->body = master_response(&master_job->pos, master_job->zobrist_hash,
+                                           master_job->moves, master_job->top_games,
+                                           master_job->format, &master_job->encoding);
+        request_timing = NULL;
+        dataset = previous;
+    }
+
+    if (master_job->leader) master_land(master_job, &key);
+}
+
+static void master_reply(struct master_job *job) {
+    struct evhttp_request *req = job->req;
+    struct evkeyvalq *headers = evhttp_request_get_output_headers(req);
+    struct cache_value *body = job->body;
+
+    struct evbuffer *res = evbuffer_new();
+    if (!res) {
+        puts("could not allocate response buffer");
+        abort();
+    }
+
+    if (job->format != MASTER_FORMAT_JSON) {
+        evhttp_add_header(headers, "Content-Type", "application/octet-stream");
+        if (job->encoding != ENCODING_IDENTITY) evhttp_add_header(headers, "Content-Encoding", compress_encoding_name(job->encoding));
+        evbuffer_add_reference(res, body->data, body->size, release_body, body);
+    } else if (job->encoding != ENCODING_IDENTITY) {
+        evhttp_add_header(headers, "Content-Type", "application/json");
+        evhttp_add_header(headers, "Content-Encoding", compress_encoding_name(job->encoding));
+        evbuffer_add_reference(res, body->data, body->size, release_body, body);
+    } else {
+        // Set Content-Type.
+        if (job->jsonp) {
+            evhttp_add_header(headers, "Content-Type", "application/javascript");
+            evbuffer_add_printf(res, "%s(", job->jsonp);
+        } else {
+            evhttp_add_header(headers, "Content-Type", "application/json");
+        }
+
+        evbuffer_add_reference(res, body->data, body->size, release_body, body);
+
+        evbuffer_add_printf(res, "%s\n", job->jsonp ? ")" : "");
+    }
+
+    finish_timing(req, job->timed ? &job->timing : NULL, job->fen);
+    evhttp_send_reply(req, HTTP_OK, "OK", res);
+    evbuffer_free(res);
+}
+
+// Speculative reads of the most played continuations, so that the next
+// click is served from the record cache. Background jobs of the I/O pool
+// never hold up replies, so there is no prefetching without I/O threads.
+// 0 to disable.
+static int prefetch_moves = 0;
+static const int MAX_PREFETCH_MOVES = 8;
+static const int MAX_PREFETCH = 16;  // in flight per worker
+
+static __thread int num_prefetch;
+
+struct prefetch_job {
+    struct iopool_job job;
+    struct dataset *dataset;
+    board_t pos;
+    uint64_t zobrist_hash;
+};
+
+static void prefetch_run(struct iopool_job *job) {
+    struct prefetch_job *prefetch = (struct prefetch_job *) job;
+
+    struct dataset *previous = dataset;
+    dataset = prefetch->dataset;
+
+    // Usually still in the record cache, but not if the reply came from the
+    // response cache.
+    struct cache_value *value;
+    lookup_master_values(&prefetch->zobrist_hash, 1, &value);
+    if (value->size) {
+        struct master_record *record = master_record_new();
+        decode_master_record((const uint8_t *) value->data, record);
+
+        uint64_t hashes[MAX_PREFETCH_MOVES];
+        struct cache_value *values[MAX_PREFETCH_MOVES];
+        size_t num_hashes = record->num_moves < prefetch_moves ? record->num_moves : prefetch_moves;
+        for (size_t i = 0; i < num_hashes; i++) {
+            board_t child = prefetch->pos;
+            board_move(&child, record->moves[i].move);
+            hashes[i] = board_zobrist_hash(&child, POLYGLOT);
+        }
+
+        lookup_master_values(hashes, num_hashes, values);
+        for (size_t i = 0; i < num_hashes; i++) cache_value_release(values[i]);
+        counter_add(&thread_metrics()->prefetch_positions, num_hashes);
+
+        master_record_free(record);
+    }
+    cache_value_release(value);
+
+    dataset = previous;
+}
+
+static void prefetch_done(struct iopool_job *job) {
+    struct prefetch_job *prefetch = (struct prefetch_job *) job;
+    num_prefetch--;
+    dataset_release(prefetch->dataset);
+    free(prefetch);
+}
+
+// After the reply to pos was sent, whether or not it was cached. Dropped
+// when over budget.
+static void prefetch_children(const struct master_job *job) {
+    if (!prefetch_moves || !io_pool || !job->dataset->record_cache) return;
+
+    if (num_prefetch >= MAX_PREFETCH) {
+        counter_add(&thread_metrics()->prefetch_dropped, 1);
+        return;
+    }
+
+    struct prefetch_job *prefetch = calloc(1, sizeof(struct prefetch_job));
+    if (!prefetch) abort();
+    prefetch->job.run = prefetch_run;
+    prefetch->job.done = prefetch_done;
+    prefetch->job.background = true;
+    prefetch->dataset = dataset_ref(job->dataset);
+    prefetch->pos = job->pos;
+    prefetch->zobrist_hash = job->zobrist_hash;
+
+    if (!iopool_submit(io_pool, io_loop, &prefetch->job)) {
+        counter_add(&thread_metrics()->prefetch_dropped, 1);
+        dataset_release(prefetch->dataset);
+        free(prefetch);
+        return;
+    }
+    num_prefetch++;
+}
+
+static void master_job_done(struct iopool_job *job) {
+    struct master_job *master_job = (struct master_job *) job;
+    if (master_job->shed) shed(master_job->req, master_job->shed);
+    else master_reply(master_job);
+
+    // Once per flight.
+    if (master_job->leader && !master_job->shed) prefetch_children(master_job);
+    deferred_end(master_job->expensive);
+    record_request(ENDPOINT_MASTER, master_job->start);
+    dataset_release(master_job->dataset);
+    free(master_job->jsonp);
+    free(master_job);
+}
+
+void get_master(struct evhttp_request *req, void *context) {
+    if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+        evhttp_send_error(req, HTTP_BADMETHOD, "Method Not Allowed");
+        return;
+    }
+
+    const char *uri = evhttp_request_get_uri(req);
+    if (!uri) {
+        puts("evhttp_request_get_uri failed");
+        return;
+    }
+
+    if (query_log) {
+        const char *query = evhttp_uri_get_query(evhttp_request_get_evhttp_uri(req));
+        if (query) querylog_writer_add(query_log, query);
+    }
+
+    struct master_job local = {};
+    local.req = req;
+    local.start = request_start;
+    local.dataset = dataset;
+    local.job.run = master_job_run;
+    local.job.done = master_job_done;
+
+    if (timing_requested(req)) {
+        local.timed = true;
+        local.timing.start = now_ns();
+        request_timing = &local.timing;
+    }
+
+    struct evkeyvalq query;
+    const char *fen = NULL;
+    const char *jsonp = NULL;
+    const char *format = NULL;
+    const char *san = NULL;
+    local.moves = 12;
+    local.top_games = 4;
+    if (0 == evhttp_parse_query(uri, &query)) {
+        fen = evhttp_find_header(&query, "fen");
+        jsonp = evhttp_find_header(&query, "callback");
+        format = evhttp_find_header(&query, "format");
+        san = evhttp_find_header(&query, "san");
+        query_limits(&query, &local.moves, &local.top_games);
+    }
+    if (!fen || !strlen(fen)) {
+        evhttp_clear_headers(&query);
+        evhttp_send_error(req, HTTP_BADREQUEST, "Missing FEN");
+        return;
+    }
+
+    // Look up positon.
+    uint64_t start = timing_start();
+    bool valid = board_set_fen(&local.pos, fen);
+    timing_stop(PHASE_PARSE, start);
+    if (!valid) {
+        evhttp_clear_headers(&query);
+        evhttp_send_error(req, HTTP_BADREQUEST, "Invalid FEN");
+        return;
+    }
+
+    if (verbose) printf("master: %.255s\n", fen);
+    snprintf(local.fen, sizeof(local.fen), "%s", fen);
+
+    // Content negotiation.
+    const char *accept = evhttp_find_header(evhttp_request_get_input_headers(req), "Accept");
+    bool binary = format ? strcmp(format, "bin") == 0 : (accept && strstr(accept, "application/octet-stream"));
+    if (binary) local.format = (san && strcmp(san, "1") == 0) ? MASTER_FORMAT_BINARY_SAN : MASTER_FORMAT_BINARY;
+    else local.format = MASTER_FORMAT_JSON;
+
+    // JSONP responses are wrapped outside the cached body, so they are never
+    // compressed.
+    bool wrapped = !binary && jsonp && strlen(jsonp);
+    local.encoding = ENCODING_IDENTITY;
+    if (!wrapped) {
+        local.encoding = compress_negotiate(evhttp_find_header(evhttp_request_get_input_headers(req), "Accept-Encoding"));
+    }
+
+    // CORS.
+    struct evkeyvalq *headers = evhttp_request_get_output_headers(req);
+    if (cors) evhttp_add_header(headers, "Access-Control-Allow-Origin", "*");
+    evhttp_add_header(headers, "Vary", "Accept, Accept-Encoding");
+
+    start = timing_start();
+    local.zobrist_hash = board_zobrist_hash(&local.pos, POLYGLOT);
+    timing_stop(PHASE_HASH, start);
+
+    local.body = master_cached(&local, &local.encoding);
+
+    if (!local.body && io_pool) {
+        local.job.priority = priority_requested(req);
+        local.expensive = local.moves > EXPENSIVE_MOVES || local.top_games > EXPENSIVE_TOP_GAMES;
+        if (!admit(req, local.job.priority, local.expensive)) {
+            request_timing = NULL;
+            evhttp_clear_headers(&query);
+            return;
+        }
+
+        struct master_job *job = malloc(sizeof(struct master_job));
+        if (!job) abort();
+        *job = local;
+        job->jsonp = wrapped ? strdup(jsonp) : NULL;
+        dataset_ref(job->dataset);
+        deferred_begin(job->expensive);
+
+        request_timing = NULL;
+        request_deferred = true;
+        evhttp_clear_headers(&query);
+
+        // Identical requests wait for the first one.
+        struct master_flight_key key;
+        master_flight_key(job, &key);
+        job->job.loop = io_loop;
+        if (!flight_join(master_flight, (const char *) &key, sizeof(key), &job->job)) {
+            counter_add(&thread_metrics()->master_coalesced, 1);
+            return;
+        }
+        job->leader = true;
+
+        job->queued = true;
+        if (!iopool_submit(io_pool, io_loop, &job->job)) {
+            // Pool is saturated. Only priority requests are served right
+            // here. Waiters that joined in the meantime share the outcome.
+            job->queued = false;
+            if (job->job.priority) {
+                master_job_run(&job->job);
+            } else {
+                job->shed = SHED_QUEUE_FULL;
+                master_land(job, &key);
+            }
+            master_job_done(&job->job);
+        }
+        return;
+    }
+
+    local.jsonp = wrapped ? (char *) jsonp : NULL;
+    if (!local.body) master_job_run(&local.job);
+    if (local.shed) {
+        shed(req, local.shed);
+    } else {
+        master_reply(&local);
+        prefetch_children(&local);
+    }
+    request_timing = NULL;
+    evhttp_clear_headers(&query);
+}
+
+static const size_t MAX_BATCH_POSITIONS = 256;
+
+struct batch_entry {
+    size_t index;
+    bool valid;
+    board_t pos;
+    uint64_t zobrist_hash;
+    struct cache_value *body;
+};
+
+static int cmp_batch_entry(const void *l, const void *r) {
+    const struct batch_entry *a = (struct batch_entry *) l;
+    const struct batch_entry *b = (struct batch_entry *) r;
+    if (a->zobrist_hash < b->zobrist_hash) return -1;
+    else if (a->zobrist_hash > b->zobrist_hash) return 1;
+    else return 0;
+}
+
+static int cmp_batch_index(const void *l, const void *r) {
+    const struct batch_entry *a = (struct batch_entry *) l;
+    const struct batch_entry *b = (struct batch_entry *) r;
+    return (a->index > b->index) - (a->index < b->index);
+}
+
+// Bodies of many positions, for /master/batch and /master/line. Records
+// that are not cached are read with a single database round trip, all
+// bodies are rendered on the pool, and the reply is sent from the event
+// loop.
+struct batch_job {
+    struct iopool_job job;
+    struct evhttp_request *req;
+    enum endpoint endpoint;
+    uint64_t start;
+    struct dataset *dataset;
+    bool queued;  // went through the I/O pool
+    enum shed_reason shed;
+
+    int moves;
+    int top_games;
+    struct batch_entry *entries;  // in request order
+    size_t num_entries;
+};
+
+static void batch_job_run(struct iopool_job *job) {
+    struct batch_job *batch = (struct batch_job *) job;
+
+    if (batch->queued && deadline_exceeded(batch->start, job->priority)) {
+        batch->shed = SHED_DEADLINE;
+        return;
+    }
+
+    struct dataset *previous = dataset;
+    dataset = batch->dataset;
+
+    // Look up in key order for locality, then restore request order.
+    struct batch_entry *entries = batch->entries;
+    qsort(entries, batch->num_entries, sizeof(struct batch_entry), cmp_batch_entry);
+
+    uint64_t *hashes = malloc(batch->num_entries * sizeof(uint64_t));
+    struct cache_value **values = malloc(batch->num_entries * sizeof(struct cache_value *));
+    if (!hashes || !values) abort();
+
+    size_t num_hashes = 0;
+    for (size_t i = 0; i < batch->num_entries; i++) {
+        if (!entries[i].valid) continue;
+        entries[i].body = master_body_cached(entries[i].zobrist_hash, batch->moves, batch->top_games, MASTER_FORMAT_JSON);
+        if (!entries[i].body) hashes[num_hashes++] = entries[i].zobrist_hash;
+    }
+
+    lookup_master_values(hashes, num_hashes, values);
+
+    for (size_t i = 0, j = 0; i < batch->num_entries; i++) {
+        if (!entries[i].valid || entries[i].body) continue;
+        entries[i].body = master_body_render(&entries[i].pos, entries[i].zobrist_hash, values[j],
+                                             batch->moves, batch->top_games, MASTER_FORMAT_JSON);
+        cache_value_release(values[j++]);
+    }
+
+    free(hashes);
+    free(values);
+    qsort(entries, batch->num_entries, sizeof(struct batch_entry), cmp_batch_index);
+
+    dataset = previous;
+}
+
+static void batch_reply(struct batch_job *batch) {
+    struct evbuffer *res = evbuffer_new();
+    if (!res) {
+        puts("could not allocate response buffer");
+        abort();
+    }
+
+    struct evkeyvalq *headers = evhttp_request_get_output_headers(batch->req);
+    if (cors) evhttp_add_header(headers, "Access-Control-Allow-Origin", "*");
+    evhttp_add_header(headers, "Content-Type", "application/json");
+
+    evbuffer_add_printf(res, "[\n");
+    for (size_t i = 0; i < batch->num_entries; i++) {
+        struct cache_value *body = batch->entries[i].body;
+        if (body) evbuffer_add_reference(res, body->data, body->size, release_body, body);
+        else evbuffer_add_printf(res, "null");
+        evbuffer_add_printf(res, "%s\n", (i < batch->num_entries - 1) ? "," : "");
+    }
+    evbuffer_add_printf(res, "]\n");
+
+    evhttp_send_reply(batch->req, HTTP_OK, "OK", res);
+    evbuffer_free(res);
+}
+
+static void batch_job_done(struct iopool_job *job) {
+    struct batch_job *batch = (struct batch_job *) job;
+    if (batch->shed) shed(batch->req, batch->shed);
+    else batch_reply(batch);
+    deferred_end(true);
+    record_request(batch->endpoint, batch->start);
+    dataset_release(batch->dataset);
+    free(batch->entries);
+    free(batch);
+}
+
+// Takes entries.
+static void master_batch(struct evhttp_request *req, enum endpoint endpoint,
+                         struct batch_entry *entries, size_t num_entries, int moves, int topGames) {
+    struct batch_job local = {};
+    local.req = req;
+    local.endpoint = endpoint;
+    local.start = request_start;
+    local.dataset = dataset;
+    local.job.run = batch_job_run;
+    local.job.done = batch_job_done;
+    local.moves = moves;
+    local.top_games = topGames;
+    local.entries = entries;
+    local.num_entries = num_entries;
+
+    if (io_pool) {
+        // Many lookups.
+        local.job.priority = priority_requested(req);
+        if (!admit(req, local.job.priority, true)) {
+            free(entries);
+            return;
+        }
+
+        struct batch_job *job = malloc(sizeof(struct batch_job));
+        if (!job) abort();
+        *job = local;
+        dataset_ref(job->dataset);
+        deferred_begin(true);
+        request_deferred = true;
+
+        job->queued = true;
+        if (!iopool_submit(io_pool, io_loop, &job->job)) {
+            // Pool is saturated. Only priority requests are served right
+            // here.
+            job->queued = false;
+            if (job->job.priority) batch_job_run(&job->job);
+            else job->shed = SHED_QUEUE_FULL;
+            batch_job_done(&job->job);
+        }
+        return;
+    }
+
+    batch_job_run(&local.job);
+    if (local.shed) shed(req, local.shed);
+    else batch_reply(&local);
+    free(entries);
+}
+
+void post_master_batch(struct evhttp_request *req, void *context) {
+    if (evhttp_request_get_command(req) != EVHTTP_REQ_POST) {
+        evhttp_send_error(req, HTTP_BADMETHOD, "Method Not Allowed");
+        return;
+    }
+
+    const char *uri = evhttp_request_get_uri(req);
+    if (!uri) {
+        puts("evhttp_request_get_uri failed");
+        return;
+    }
+
+    struct evkeyvalq query;
+    int moves = 12;
+    int topGames = 4;
+    if (0 == evhttp_parse_query(uri, &query)) {
+        query_limits(&query, &moves, &topGames);
+        evhttp_clear_headers(&query);
+    }
+
+    // Parse one FEN per line.
+    struct batch_entry *entries = calloc(MAX_BATCH_POSITIONS, sizeof(struct batch_entry));
+    if (!entries) abort();
+
+    struct evbuffer *input = evhttp_request_get_input_buffer(req);
+    size_t num_entries = 0;
+    char *line;
+    while ((line = evbuffer_readln(input, NULL, EVBUFFER_EOL_ANY))) {
+        if (!strlen(line)) {
+            free(line);
+            continue;
+        }
+
+        if (num_entries >= MAX_BATCH_POSITIONS) {
+            free(line);
+            free(entries);
+            evhttp_send_error(req, HTTP_BADREQUEST, "Too Many Positions");
+            return;
+        }
+
+        struct batch_entry *entry = &entries[num_entries];
+        entry->index = num_entries++;
+        entry->valid = board_set_fen(&entry->pos, line);
+        if (entry->valid) entry->zobrist_hash = board_zobrist_hash(&entry->pos, POLYGLOT);
+        free(line);
+    }
+
+    if (!num_entries) {
+        free(entries);
+        evhttp_send_error(req, HTTP_BADREQUEST, "Missing FEN");
+        return;
+    }
+
+    if (verbose) printf("master batch: %zu positions\n", num_entries);
+
+    master_batch(req, ENDPOINT_MASTER_BATCH, entries, num_entries, moves, topGames);
+}
+
+static const size_t MAX_LINE_PLIES = 128;
+
+void get_master_line(struct evhttp_request *req, void *context) {
+    if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+        evhttp_send_error(req, HTTP_BADMETHOD, "Method Not Allowed");
+        return;
+    }
+
+    const char *uri = evhttp_request_get_uri(req);
+    if (!uri) {
+        puts("evhttp_request_get_uri failed");
+        return;
+    }
+
+    struct evkeyvalq query;
+    const char *fen = NULL;
+    const char *play = NULL;
+    int moves = 12;
+    int topGames = 0;
+    if (0 == evhttp_parse_query(uri, &query)) {
+        fen = evhttp_find_header(&query, "fen");
+        play = evhttp_find_header(&query, "play");
+        query_limits(&query, &moves, &topGames);
+    }
+
+    board_t pos;
+    if (fen && strlen(fen)) {
+        if (!board_set_fen(&pos, fen)) {
+            evhttp_clear_headers(&query);
+            evhttp_send_error(req, HTTP_BADREQUEST, "Invalid FEN");
+            return;
+        }
+    } else {
+        board_reset(&pos);
+    }
+
+    if (verbose) printf("master line: %.255s %.255s\n", fen ? fen : "startpos", play ? play : "");
+
+    // The initial position and the position after every move.
+    struct batch_entry *entries = calloc(MAX_LINE_PLIES + 1, sizeof(struct batch_entry));
+    if (!entries) abort();
+    size_t num_entries = 0;
+
+    char *moves_uci = strdup(play ? play : "");
+    if (!moves_uci) abort();
+
+    char *save_ptr;
+    char *token = strtok_r(moves_uci, ",", &save_ptr);
+    while (true) {
+        struct batch_entry *entry = &entries[num_entries];
+        entry->index = num_entries++;
+        entry->valid = true;
+        entry->pos = pos;
+        entry->zobrist_hash = board_zobrist_hash(&pos, POLYGLOT);
+        if (!token) break;
+
+        move_t move;
+        if (num_entries > MAX_LINE_PLIES || !board_parse_uci(&pos, token, &move)) {
+            free(entries);
+            free(moves_uci);
+            evhttp_clear_headers(&query);
+            evhttp_send_error(req, HTTP_BADREQUEST, num_entries > MAX_LINE_PLIES ? "Line Too Long" : "Illegal Move");
+            return;
+        }
+
+        board_move(&pos, move);
+        token = strtok_r(NULL, ",", &save_ptr);
+    }
+
+    free(moves_uci);
+    evhttp_clear_headers(&query);
+
+    master_batch(req, ENDPOINT_MASTER_LINE, entries, num_entries, moves, topGames);
+}
+
+static const size_t GAME_STATS_MAX_PLIES = 1024;
+
+// Small first batch, so that the first plies arrive right away.
+static const size_t GAME_STATS_FIRST_BATCH = 8;
+static const size_t GAME_STATS_BATCH = 64;
+
+// Streams /master/game/{id}/stats in batches of plies. Each batch is read
+// and rendered on the pool, then sent as a chunk from the event loop.
+struct game_stats_job {
+    struct iopool_job job;
+    struct evhttp_request *req;
+    char game_id[9];
+    uint64_t start;
+    struct dataset *dataset;
+    bool admitted;
+
+    // Replayed by the first run. Position 0 is the initial position,
+    // position i follows moves[i - 1].
+    bool loaded;
+    size_t num_positions;  // 0 if not found
+    uint64_t *hashes;
+    move_t *moves;
+
+    size_t next;
+    bool started;
+    struct evbuffer *chunk;
+};
+
+static void game_stats_load(struct game_stats_job *job) {
+    size_t pgn_size;
+    char *stored = NULL;
+    const char *text = dataset->master_pgn_store ? pgnstore_find(dataset->master_pgn_store, job->game_id, &pgn_size) : NULL;
+    if (!text) text = stored = metered_kcdbget(dataset->master_pgn_db, job->game_id, 8, &pgn_size);
+    if (!text) return;
+
+    job->hashes = malloc((GAME_STATS_MAX_PLIES + 1) * sizeof(uint64_t));
+    job->moves = malloc(GAME_STATS_MAX_PLIES * sizeof(move_t));
+    if (!job->hashes || !job->moves) abort();
+
+    board_t pos;
+    board_reset(&pos);
+    job->hashes[job->num_positions++] = board_zobrist_hash(&pos, POLYGLOT);
+
+    // Replay the main line like the indexer does.
+    struct pgn_movetext movetext = { pgn_skip_headers(text, text + pgn_size), text + pgn_size, 0 };
+    char san[16];
+    const char *token;
+    size_t token_size;
+    while (job->num_positions <= GAME_STATS_MAX_PLIES && pgn_movetext_next(&movetext, san, sizeof(san), &token, &token_size)) {
+        move_t move;
+        if (!san[0] || !board_parse_san(&pos, san, &move)) continue;
+
+        job->moves[job->num_positions - 1] = move;
+        board_move(&pos, move);
+        job->hashes[job->num_positions++] = board_zobrist_hash(&pos, POLYGLOT);
+    }
+
+    if (stored) kcfree(stored);
+}
+
+static void game_stats_run(struct iopool_job *job) {
+    struct game_stats_job *stats = (struct game_stats_job *) job;
+
+    struct dataset *previous = dataset;
+    dataset = stats->dataset;
+
+    if (!stats->loaded) {
+        game_stats_load(stats);
+        stats->loaded = true;
+    }
+
+    size_t batch = stats->next ? GAME_STATS_BATCH : GAME_STATS_FIRST_BATCH;
+    size_t end = stats->next + batch < stats->num_positions ? stats->next + batch : stats->num_positions;
+
+    struct cache_value **values = malloc(GAME_STATS_BATCH * sizeof(struct cache_value *));
+    if (!values) abort();
+    lookup_master_values(stats->hashes + stats->next, end - stats->next, values);
+
+    // SANs need the position before the move, so replay up to the batch.
+    board_t pos;
+    board_reset(&pos);
+    for (size_t i = 0; i + 1 < stats->next; i++) board_move(&pos, stats->moves[i]);
+
+    struct master_record *record = master_record_new();
+    for (size_t i = stats->next; i < end; i++) {
+        struct cache_value *value = values[i - stats->next];
+
+        unsigned long white = 0, draws = 0, black = 0, average_rating_sum = 0;
+        if (value->size) {
+            decode_master_record((const uint8_t *) value->data, record);
+            white = master_record_white(record);
+            draws = master_record_draws(record);
+            black = master_record_black(record);
+            average_rating_sum = master_record_average_rating_sum(record);
+        }
+        cache_value_release(value);
+
+        if (i) {
+            char uci[LEN_UCI], san[LEN_SAN];
+            move_uci(stats->moves[i - 1], uci);
+            board_san(&pos, stats->moves[i - 1], san);
+            board_move(&pos, stats->moves[i - 1]);
+            evbuffer_add_printf(stats->chunk, "{\"ply\":%zu,\"uci\":\"%s\",\"san\":\"%s\",", i, uci, san);
+        } else {
+            evbuffer_add_printf(stats->chunk, "{\"ply\":0,\"uci\":null,\"san\":null,");
+        }
+
+        unsigned long total = white + draws + black;
+        evbuffer_add_printf(stats->chunk, "\"white\":%lu,\"draws\":%lu,\"black\":%lu,\"averageRating\":", white, draws, black);
+        if (total) evbuffer_add_printf(stats->chunk, "%lu}\n", average_rating_sum / total);
+        else evbuffer_add_printf(stats->chunk, "null}\n");
+    }
+    master_record_free(record);
+    free(values);
+
+    stats->next = end;
+    dataset = previous;
+}
+
+static void game_stats_free(struct game_stats_job *job) {
+    if (job->admitted) deferred_end(true);
+    dataset_release(job->dataset);
+    evbuffer_free(job->chunk);
+    free(job->hashes);
+    free(job->moves);
+    free(job);
+}
+
+static void game_stats_done(struct iopool_job *job) {
+    struct game_stats_job *stats = (struct game_stats_job *) job;
+    struct evhttp_request *req = stats->req;
+
+    while (true) {
+        if (!stats->num_positions) {
+            evhttp_send_error(req, HTTP_NOTFOUND, "Master Game Not Found");
+            break;
+        }
+
+        if (!stats->started) {
+            stats->started = true;
+            struct evkeyvalq *headers = evhttp_request_get_output_headers(req);
+            if (cors) evhttp_add_header(headers, "Access-Control-Allow-Origin", "*");
+            evhttp_add_header(headers, "Content-Type", "application/x-ndjson");
+            evhttp_send_reply_start(req, HTTP_OK, "OK");
+        }
+
+        evhttp_send_reply_chunk(req, stats->chunk);
+
+        // Done, or the client went away.
+        if (stats->next == stats->num_positions || !evhttp_request_get_connection(req)) {
+            evhttp_send_reply_end(req);
+            break;
+        }
+
+        if (io_pool && iopool_submit(io_pool, io_loop, &stats->job)) return;
+
+        // Synchronous, or the pool is saturated. The reply has started, so
+        // finish it right here.
+        game_stats_run(&stats->job);
+    }
+
+    record_request(ENDPOINT_MASTER_GAME_STATS, stats->start);
+    game_stats_free(stats);
+}
+
+void get_master_game_stats(struct evhttp_request *req, void *context) {
+    if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+        evhttp_send_error(req, HTTP_BADMETHOD, "Method Not Allowed");
+        return;
+    }
+
+    const struct evhttp_uri *uri = evhttp_request_get_evhttp_uri(req);
+    const char *path = uri ? evhttp_uri_get_path(uri) : NULL;
+    if (!path) {
+        puts("evhttp_uri_get_path failed");
+        return;
+    }
+
+    char game_id[9];
+    int end;
+    if (1 != sscanf(path, "/master/game/%8[^/]/stats%n", game_id, &end) ||
+            strlen(game_id) != 8 ||
+            strlen(path) != end) {
+        evhttp_send_error(req, HTTP_NOTFOUND, "Not Found");
+        return;
+    }
+
+    if (verbose) printf("master game stats: %s\n", game_id);
+
+    bool priority = io_pool && priority_requested(req);
+    if (io_pool && !admit(req, priority, true)) return;
+
+    struct game_stats_job *job = calloc(1, sizeof(struct game_stats_job));
+    if (!job) abort();
+    job->req = req;
+    memcpy(job->game_id, game_id, sizeof(game_id));
+    job->start = request_start;
+    job->dataset = dataset_ref(dataset);
+    job->job.run = game_stats_run;
+    job->job.done = game_stats_done;
+    job->job.priority = priority;
+    job->chunk = evbuffer_new();
+    if (!job->chunk) abort();
+
+    request_deferred = true;
+
+    if (io_pool) {
+        job->admitted = true;
+        deferred_begin(true);
+        if (iopool_submit(io_pool, io_loop, &job->job)) return;
+
+        // Pool is saturated. Only priority requests are served right here.
+        if (!priority) {
+            shed(req, SHED_QUEUE_FULL);
+            record_request(ENDPOINT_MASTER_GAME_STATS, job->start);
+            game_stats_free(job);
+            return;
+        }
+    }
+
+    game_stats_run(&job->job);
+    game_stats_done(&job->job);
+}
+
+void get_ready(struct evhttp_request *req, void *context) {
+    struct evbuffer *res = evbuffer_new();
+    if (!res) {
+        puts("could not allocate response buffer");
+        abort();
+    }
+
+    struct evkeyvalq *headers = evhttp_request_get_output_headers(req);
+    evhttp_add_header(headers, "Content-Type", "text/plain");
+
+    if (__atomic_load_n(&ready, __ATOMIC_ACQUIRE)) {
+        evbuffer_add_printf(res, "ready\n");
+        evhttp_send_reply(req, HTTP_OK, "OK", res);
+    } else {
+        evbuffer_add_printf(res, "warming up\n");
+        evhttp_send_reply(req, HTTP_SERVUNAVAIL, "Service Unavailable", res);
+    }
+
+    evbuffer_free(res);
+}
+
+// Cumulative buckets at powers of two from 2^min_exponent to 2^max_exponent.
+// Values are multiplied by scale, e.g. to report nanoseconds in seconds.
+static void render_histogram(struct evbuffer *res, const char *name, const char *labels,
+                             const struct histogram *histogram, int min_exponent, int max_exponent,
+                             double scale) {
+    const char *sep = labels[0] ? "," : "";
+
+    for (int exponent = min_exponent; exponent <= max_exponent; exponent++) {
+        evbuffer_add_printf(res, "%s_bucket{%s%sle=\"%g\"} %" PRIu64 "\n", name, labels, sep,
+                            (double) (1ULL << exponent) * scale, histogram_count_below(histogram, exponent));
+    }
+    evbuffer_add_printf(res, "%s_bucket{%s%sle=\"+Inf\"} %" PRIu64 "\n", name, labels, sep, histogram->count);
+
+    if (labels[0]) {
+        evbuffer_add_printf(res, "%s_sum{%s} %g\n", name, labels, histogram->sum * scale);
+        evbuffer_add_printf(res, "%s_count{%s} %" PRIu64 "\n", name, labels, histogram->count);
+    } else {
+        evbuffer_add_printf(res, "%s_sum %g\n", name, histogram->sum * scale);
+        evbuffer_add_printf(res, "%s_count %" PRIu64 "\n", name, histogram->count);
+    }
+}
+
+// Quantiles at full histogram resolution, finer than the exported buckets.
+static void render_quantiles(struct evbuffer *res, const char *name, const char *labels,
+                             const struct histogram *histogram, double scale) {
+    static const double QUANTILES[] = { 0.5, 0.9, 0.99, 0.999 };
+
+    const char *sep = labels[0] ? "," : "";
+    for (size_t i = 0; i < sizeof(QUANTILES) / sizeof(QUANTILES[0]); i++) {
+        evbuffer_add_printf(res, "%s{%s%squantile=\"%g\"} %g\n", name, labels, sep, QUANTILES[i],
+                            histogram_quantile(histogram, QUANTILES[i]) * scale);
+    }
+}
+
+static void render_cache_stats(struct evbuffer *res) {
+    static const char *const NAMES[] = { "response", "record" };
+    struct cache *caches[] = { dataset->master_cache, dataset->record_cache };
+
+    struct cache_stats stats[2] = {};
+    for (int i = 0; i < 2; i++) {
+        if (caches[i]) cache_stats(caches[i], &stats[i]);
+    }
+
+    evbuffer_add_printf(res, "# TYPE explorer_cache_hits_total counter\n");
+    for (int i = 0; i < 2; i++) evbuffer_add_printf(res, "explorer_cache_hits_total{cache=\"%s\"} %lu\n", NAMES[i], stats[i].hits);
+    evbuffer_add_printf(res, "# TYPE explorer_cache_misses_total counter\n");
+    for (int i = 0; i < 2; i++) evbuffer_add_printf(res, "explorer_cache_misses_total{cache=\"%s\"} %lu\n", NAMES[i], stats[i].misses);
+    evbuffer_add_printf(res, "# TYPE explorer_cache_evictions_total counter\n");
+    for (int i = 0; i < 2; i++) evbuffer_add_printf(res, "explorer_cache_evictions_total{cache=\"%s\"} %lu\n", NAMES[i], stats[i].evictions);
+    evbuffer_add_printf(res, "# TYPE explorer_cache_entries gauge\n");
+    for (int i = 0; i < 2; i++) evbuffer_add_printf(res, "explorer_cache_entries{cache=\"%s\"} %lu\n", NAMES[i], stats[i].entries);
+    evbuffer_add_printf(res, "# TYPE explorer_cache_bytes gauge\n");
+    for (int i = 0; i < 2; i++) evbuffer_add_printf(res, "explorer_cache_bytes{cache=\"%s\"} %zu\n", NAMES[i], stats[i].bytes);
+
+    evbuffer_add_printf(res, "# TYPE explorer_cache_hit_ratio gauge\n");
+    for (int i = 0; i < 2; i++) {
+        unsigned long lookups = stats[i].hits + stats[i].misses;
+        evbuffer_add_printf(res, "explorer_cache_hit_ratio{cache=\"%s\"} %g\n", NAMES[i],
+                            lookups ? (double) stats[i].hits / lookups : 0.0);
+    }
+}
+
+void get_metrics(struct evhttp_request *req, void *context) {
+    struct thread_metrics *total = calloc(1, sizeof(struct thread_metrics));
+    if (!total) abort();
+
+    for (struct thread_metrics *m = __atomic_load_n(&all_metrics, __ATOMIC_ACQUIRE); m; m = m->next) {
+        for (int e = 0; e < NUM_ENDPOINTS; e++) {
+            total->requests[e] += counter_get(&m->requests[e]);
+            for (int c = 0; c < 5; c++) total->responses[e][c] += counter_get(&m->responses[e][c]);
+            histogram_merge(&total->latency[e], &m->latency[e]);
+        }
+        histogram_merge(&total->kcdbget_latency, &m->kcdbget_latency);
+        total->kcdbget_bytes += counter_get(&m->kcdbget_bytes);
+        total->kcdbget_misses += counter_get(&m->kcdbget_misses);
+        total->master_coalesced += counter_get(&m->master_coalesced);
+        total->prefetch_positions += counter_get(&m->prefetch_positions);
+        total->prefetch_dropped += counter_get(&m->prefetch_dropped);
+        for (int r = 0; r < NUM_SHED_REASONS; r++) total->shed[r] += counter_get(&m->shed[r]);
+        histogram_merge(&total->render_latency, &m->render_latency);
+        histogram_merge(&total->record_size, &m->record_size);
+        histogram_merge(&total->loop_lag, &m->loop_lag);
+    }
+
+    struct evbuffer *res = evbuffer_new();
+    if (!res) {
+        puts("could not allocate response buffer");
+        abort();
+    }
+
+    char labels[64];
+
+    evbuffer_add_printf(res, "# TYPE explorer_requests_total counter\n");
+    for (int e = 0; e < NUM_ENDPOINTS; e++) {
+        evbuffer_add_printf(res, "explorer_requests_total{endpoint=\"%s\"} %" PRIu64 "\n", ENDPOINT_NAMES[e], total->requests[e]);
+    }
+
+    evbuffer_add_printf(res, "# TYPE explorer_responses_total counter\n");
+    for (int e = 0; e < NUM_ENDPOINTS; e++) {
+        for (int c = 0; c < 5; c++) {
+            if (!total->responses[e][c]) continue;
+            evbuffer_add_printf(res, "explorer_responses_total{endpoint=\"%s\",code=\"%dxx\"} %" PRIu64 "\n",
+                                ENDPOINT_NAMES[e], c + 1, total->responses[e][c]);
+        }
+    }
+
+    // Handler time, from dispatch until the reply is queued.
+    evbuffer_add_printf(res, "# TYPE explorer_request_duration_seconds histogram\n");
+    for (int e = 0; e < NUM_ENDPOINTS; e++) {
+        snprintf(labels, sizeof(labels), "endpoint=\"%s\"", ENDPOINT_NAMES[e]);
+        render_histogram(res, "explorer_request_duration_seconds", labels, &total->latency[e], 10, 34, 1e-9);
+    }
+
+    evbuffer_add_printf(res, "# TYPE explorer_request_duration_quantile_seconds gauge\n");
+    for (int e = 0; e < NUM_ENDPOINTS; e++) {
+        snprintf(labels, sizeof(labels), "endpoint=\"%s\"", ENDPOINT_NAMES[e]);
+        render_quantiles(res, "explorer_request_duration_quantile_seconds", labels, &total->latency[e], 1e-9);
+    }
+
+    evbuffer_add_printf(res, "# TYPE explorer_kcdbget_duration_seconds histogram\n");
+    render_histogram(res, "explorer_kcdbget_duration_seconds", "", &total->kcdbget_latency, 8, 30, 1e-9);
+    evbuffer_add_printf(res, "# TYPE explorer_kcdbget_duration_quantile_seconds gauge\n");
+    render_quantiles(res, "explorer_kcdbget_duration_quantile_seconds", "", &total->kcdbget_latency, 1e-9);
+    evbuffer_add_printf(res, "# TYPE explorer_kcdbget_bytes_total counter\n");
+    evbuffer_add_printf(res, "explorer_kcdbget_bytes_total %" PRIu64 "\n", total->kcdbget_bytes);
+    evbuffer_add_printf(res, "# TYPE explorer_kcdbget_misses_total counter\n");
+    evbuffer_add_printf(res, "explorer_kcdbget_misses_total %" PRIu64 "\n", total->kcdbget_misses);
+
+    evbuffer_add_printf(res, "# TYPE explorer_master_coalesced_total counter\n");
+    evbuffer_add_printf(res, "explorer_master_coalesced_total %" PRIu64 "\n", total->master_coalesced);
+
+    evbuffer_add_printf(res, "# TYPE explorer_prefetch_positions_total counter\n");
+    evbuffer_add_printf(res, "explorer_prefetch_positions_total %" PRIu64 "\n", total->prefetch_positions);
+    evbuffer_add_printf(res, "# TYPE explorer_prefetch_dropped_total counter\n");
+    evbuffer_add_printf(res, "explorer_prefetch_dropped_total %" PRIu64 "\n", total->prefetch_dropped);
+
+    evbuffer_add_printf(res, "# TYPE explorer_shed_total counter\n");
+    for (int r = SHED_NONE + 1; r < NUM_SHED_REASONS; r++) {
+        evbuffer_add_printf(res, "explorer_shed_total{reason=\"%s\"} %" PRIu64 "\n", SHED_REASON_NAMES[r], total->shed[r]);
+    }
+
+    // Rendering of uncached bodies, including record lookups and SAN.
+    evbuffer_add_printf(res, "# TYPE explorer_render_duration_seconds histogram\n");
+    render_histogram(res, "explorer_render_duration_seconds", "", &total->render_latency, 8, 30, 1e-9);
+
+    evbuffer_add_printf(res, "# TYPE explorer_record_decode_bytes histogram\n");
+    render_histogram(res, "explorer_record_decode_bytes", "", &total->record_size, 4, 20, 1);
+
+    evbuffer_add_printf(res, "# TYPE explorer_loop_lag_seconds histogram\n");
+    render_histogram(res, "explorer_loop_lag_seconds", "", &total->loop_lag, 10, 34, 1e-9);
+    evbuffer_add_printf(res, "# TYPE explorer_loop_lag_quantile_seconds gauge\n");
+    render_quantiles(res, "explorer_loop_lag_quantile_seconds", "", &total->loop_lag, 1e-9);
+
+    render_cache_stats(res);
+
+    // As seen by this worker. Lags behind for a moment after a reload.
+    evbuffer_add_printf(res, "# TYPE explorer_dataset_generation gauge\n");
+    evbuffer_add_printf(res, "explorer_dataset_generation %lu\n", dataset->generation);
+
+    free(total);
+
+    evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type", "text/plain; version=0.0.4");
+    evhttp_send_reply(req, HTTP_OK, "OK", res);
+    evbuffer_free(res);
+}
+
+struct warmup_node {
+    unsigned long total;
+    board_t pos;
+};
+
+struct warmup_heap {
+    struct warmup_node *nodes;
+    size_t size;
+    size_t capacity;
+};
+
+static void warmup_heap_push(struct warmup_heap *heap, unsigned long total, const board_t *pos) {
+    if (heap->size == heap->capacity) {
+        heap->capacity = heap->capacity ? heap->capacity * 2 : 256;
+        heap->nodes = realloc(heap->nodes, heap->capacity * sizeof(struct warmup_node));
+        if (!heap->nodes) abort();
+    }
+
+    size_t i = heap->size++;
+    for (; i > 0 && heap->nodes[(i - 1) / 2].total < total; i = (i - 1) / 2) {
+        heap->nodes[i] = heap->nodes[(i - 1) / 2];
+    }
+    heap->nodes[i].total = total;
+    heap->nodes[i].pos = *pos;
+}
+
+static void warmup_heap_pop(struct warmup_heap *heap, struct warmup_node *top) {
+    *top = heap->nodes[0];
+
+    struct warmup_node last = heap->nodes[--heap->size];
+    size_t i = 0;
+    while (2 * i + 1 < heap->size) {
+        size_t child = 2 * i + 1;
+        if (child + 1 < heap->size && heap->nodes[child + 1].total > heap->nodes[child].total) child++;
+        if (heap->nodes[child].total <= last.total) break;
+        heap->nodes[i] = heap->nodes[child];
+        i = child;
+    }
+    if (heap->size) heap->nodes[i] = last;
+}
+
+// Positions seen by the walk, so that transpositions are expanded only
+// once, no matter what the cache evicted in the meantime.
+struct warmup_set {
+    uint64_t *hashes;  // 0 for empty slots
+    size_t mask;
+    size_t size;
+    bool zero;
+};
+
+// Returns false if the hash was already in the set.
+static bool warmup_set_add(struct warmup_set *set, uint64_t zobrist_hash) {
+    if (!zobrist_hash) {
+        bool added = !set->zero;
+        set->zero = true;
+        return added;
+    }
+
+    if (2 * (set->size + 1) > set->mask + 1) {
+        size_t capacity = set->hashes ? 2 * (set->mask + 1) : 1024;
+        uint64_t *hashes = calloc(capacity, sizeof(uint64_t));
+        if (!hashes) abort();
+        for (size_t i = 0; set->hashes && i <= set->mask; i++) {
+            if (!set->hashes[i]) continue;
+            size_t j = set->hashes[i] & (capacity - 1);
+            while (hashes[j]) j = (j + 1) & (capacity - 1);
+            hashes[j] = set->hashes[i];
+        }
+        free(set->hashes);
+        set->hashes = hashes;
+        set->mask = capacity - 1;
+    }
+
+    size_t i = zobrist_hash & set->mask;
+    for (; set->hashes[i]; i = (i + 1) & set->mask) {
+        if (set->hashes[i] == zobrist_hash) return false;
+    }
+    set->hashes[i] = zobrist_hash;
+    set->size++;
+    return true;
+}
+
+// Lower bound of the memory a cached record takes, so that the walk does
+// not visit far more positions than the record cache can hold.
+static const size_t WARMUP_MIN_ENTRY_SIZE = 64;
+
+// Walk the opening tree, most popular positions first, and load every
+// position that was reached by at least min_games games. Stops when the
+// record cache would be full.
+size_t warmup_walk(unsigned long min_games) {
+    struct warmup_heap heap = {};
+    struct warmup_set visited = {};
+    size_t loaded = 0;
+
+    size_t max_nodes = record_cache_budget / WARMUP_MIN_ENTRY_SIZE;
+
+    board_t pos;
+    board_reset(&pos);
+    warmup_heap_push(&heap, ULONG_MAX, &pos);
+
+    struct master_record *record = master_record_new();
+
+    while (heap.size && loaded < max_nodes && !__atomic_load_n(&stopping, __ATOMIC_RELAXED)) {
+        struct warmup_node node;
+        warmup_heap_pop(&heap, &node);
+
+        // Skip transpositions that have already been expanded.
+        uint64_t zobrist_hash = board_zobrist_hash(&node.pos, POLYGLOT);
+        if (!warmup_set_add(&visited, zobrist_hash)) continue;
+
+        if (!lookup_master_record(zobrist_hash, record)) continue;
+        loaded++;
+
+        for (size_t i = 0; i < record->num_moves; i++) {
+            unsigned long move_total = record->moves[i].white + record->moves[i].draws + record->moves[i].black;
+            if (move_total < min_games) continue;
+
+            // Bounded frontier. Moves are sorted by popularity, so the
+            // ones that do not fit are the least played.
+            if (heap.size >= max_nodes) break;
+
+            board_t child = node.pos;
+            board_move(&child, record->moves[i].move);
+            warmup_heap_push(&heap, move_total, &child);
+        }
+    }
+
+    master_record_free(record);
+    free(heap.nodes);
+    free(visited.hashes);
+    return loaded;
+}
+
+size_t warmup_replay(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) return 0;
+
+    struct master_record *record = master_record_new();
+    size_t loaded = 0;
+
+    uint64_t zobrist_hash;
+    while (!__atomic_load_n(&stopping, __ATOMIC_RELAXED) && 1 == fread(&zobrist_hash, sizeof(uint64_t), 1, file)) {
+        if (lookup_master_record(zobrist_hash, record)) loaded++;
+    }
+
+    master_record_free(record);
+    fclose(file);
+    return loaded;
+}
+
+static void dump_hot_key(const char *key, size_t key_size, const struct cache_value *value, void *file) {
+    if (key_size == 8 && value->size) fwrite(key, 8, 1, file);
+}
+
+bool dump_hot_keys(struct cache *record_cache, const char *path) {
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    FILE *file = fopen(tmp_path, "wb");
+    if (!file) return false;
+
+    cache_foreach(record_cache, dump_hot_key, file);
+
+    if (fclose(file) != 0) return false;
+    return rename(tmp_path, path) == 0;
+}
+
+struct warmup_config {
+    unsigned long min_games;
+    const char *hot_keys_path;
+};
+
+void *warmup_run(void *arg) {
+    const struct warmup_config *config = arg;
+
+    dataset = dataset_acquire();
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    size_t walked = 0, replayed = 0;
+    if (config->min_games) walked = warmup_walk(config->min_games);
+    if (config->hot_keys_path) replayed = warmup_replay(config->hot_keys_path);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("warm-up finished: %zu positions from the opening tree, %zu hot keys in %.1fs\n",
+           walked, replayed, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+
+    dataset_release(dataset);
+    dataset = NULL;
+
+    __atomic_store_n(&ready, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// At most one reload at a time. Guarded by reload_lock.
+static pthread_mutex_t reload_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool reloading = false;
+static bool reload_started = false;
+static pthread_t reload_thread;
+
+struct hot_keys {
+    uint64_t *keys;
+    size_t size;
+    size_t capacity;
+};
+
+static void collect_hot_key(const char *key, size_t key_size, const struct cache_value *value, void *opq) {
+    struct hot_keys *hot = opq;
+    if (key_size != 8 || !value->size) return;
+
+    if (hot->size == hot->capacity) {
+        hot->capacity = hot->capacity ? hot->capacity * 2 : 1024;
+        hot->keys = realloc(hot->keys, hot->capacity * sizeof(uint64_t));
+        if (!hot->keys) abort();
+    }
+    memcpy(&hot->keys[hot->size++], key, 8);
+}
+
+// Load the records that are hot in the current dataset into the record cache
+// of the new one, before any request is routed to it.
+static size_t reload_warm(struct dataset *ds) {
+    struct hot_keys hot = {};
+
+    struct dataset *old = dataset_acquire();
+    if (old->record_cache) cache_foreach(old->record_cache, collect_hot_key, &hot);
+    dataset_release(old);
+
+    dataset = ds;
+    struct master_record *record = master_record_new();
+    size_t loaded = 0;
+    for (size_t i = 0; i < hot.size && !__atomic_load_n(&stopping, __ATOMIC_RELAXED); i++) {
+        if (lookup_master_record(hot.keys[i], record)) loaded++;
+    }
+    master_record_free(record);
+    dataset = NULL;
+
+    free(hot.keys);
+    return loaded;
+}
+
+void *reload_run(void *arg) {
+    bool warm = arg != NULL;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    struct dataset *ds = dataset_open();
+    if (!ds) {
+        puts("reload failed, still serving the previous dataset");
+    } else {
+        size_t warmed = warm && ds->record_cache ? reload_warm(ds) : 0;
+
+        dataset_publish(ds);
+
+        // Workers pick up the new dataset between requests. In-flight
+        // requests finish on the one they started with.
+        for (int i = 0; i < num_workers; i++) event_active(workers[i].swap, EV_TIMEOUT, 0);
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("reloaded dataset generation %lu with %zu hot keys in %.1fs\n", ds->generation, warmed,
+               (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    }
+
+    pthread_mutex_lock(&reload_lock);
+    reloading = false;
+    pthread_mutex_unlock(&reload_lock);
+    return NULL;
+}
+
+// Returns false if a reload is already in progress.
+static bool start_reload(bool warm) {
+    pthread_mutex_lock(&reload_lock);
+    if (reloading) {
+        pthread_mutex_unlock(&reload_lock);
+        return false;
+    }
+
+    // The previous reload thread has finished, collect it.
+    if (reload_started) pthread_join(reload_thread, NULL);
+
+    if (pthread_create(&reload_thread, NULL, reload_run, warm ? (void *) 1 : NULL)) {
+        puts("could not start reload thread");
+        abort();
+    }
+    reloading = reload_started = true;
+    pthread_mutex_unlock(&reload_lock);
+    return true;
+}
+
+void post_admin_reload(struct evhttp_request *req, void *context) {
+    if (evhttp_request_get_command(req) != EVHTTP_REQ_POST) {
+        evhttp_send_error(req, HTTP_BADMETHOD, "Method Not Allowed");
+        return;
+    }
+
+    const char *uri = evhttp_request_get_uri(req);
+    if (!uri) {
+        puts("evhttp_request_get_uri failed");
+        return;
+    }
+
+    bool warm = true;
+    struct evkeyvalq query;
+    if (0 == evhttp_parse_query(uri, &query)) {
+        const char *warm_arg = evhttp_find_header(&query, "warm");
+        if (warm_arg && strcmp(warm_arg, "0") == 0) warm = false;
+        evhttp_clear_headers(&query);
+    }
+
+    struct evbuffer *res = evbuffer_new();
+    if (!res) {
+        puts("could not allocate response buffer");
+        abort();
+    }
+
+    struct evkeyvalq *headers = evhttp_request_get_output_headers(req);
+    evhttp_add_header(headers, "Content-Type", "text/plain");
+
+    if (start_reload(warm)) {
+        evbuffer_add_printf(res, "reloading\n");
+        evhttp_send_reply(req, 202, "Accepted", res);
+    } else {
+        evbuffer_add_printf(res, "reload in progress\n");
+        evhttp_send_reply(req, 409, "Conflict", res);
+    }
+
+    evbuffer_free(res);
+}
+
+struct route {
+    enum endpoint endpoint;
+    void (*handler)(struct evhttp_request *req, void *context);
+};
+
+static const struct route ROUTES[NUM_ENDPOINTS] = {
+    { ENDPOINT_MASTER, get_master },
+    { ENDPOINT_MASTER_PGN, get_master_pgn },
+    { ENDPOINT_MASTER_BATCH, post_master_batch },
+    { ENDPOINT_MASTER_LINE, get_master_line },
+    { ENDPOINT_READY, get_ready },
+    { ENDPOINT_METRICS, get_metrics },
+    { ENDPOINT_ADMIN_RELOAD, post_admin_reload },
+    { ENDPOINT_MASTER_GAME_STATS, get_master_game_stats },
+};
+
+static void request_complete(struct evhttp_request *req, void *context) {
+    const struct route *route = context;
+
+    // Runs on the same event loop as the handler.
+    int code = evhttp_request_get_response_code(req);
+    if (code >= 100 && code < 600) counter_add(&thread_metrics()->responses[route->endpoint][code / 100 - 1], 1);
+}
+
+static void handle_request(struct evhttp_request *req, void *context) {
+    const struct route *route = context;
+
+    evhttp_request_set_on_complete_cb(req, request_complete, context);
+
+    request_start = now_ns();
+    request_deferred = false;
+    route->handler(req, NULL);
+    if (!request_deferred) record_request(route->endpoint, request_start);
+
+    // In case the handler bailed out before finishing its timing.
+    request_timing = NULL;
+}
+
+// Paths with parameters: /master/pgn/{id} and /master/game/{id}/stats.
+static void handle_generic(struct evhttp_request *req, void *context) {
+    const char *path = evhttp_uri_get_path(evhttp_request_get_evhttp_uri(req));
+    bool game = path && strncmp(path, "/master/game/", strlen("/master/game/")) == 0;
+    handle_request(req, (void *) &ROUTES[game ? ENDPOINT_MASTER_GAME_STATS : ENDPOINT_MASTER_PGN]);
+}
+
+static const struct timeval TICK_INTERVAL = { 0, 100000 };
+
+static void worker_tick(evutil_socket_t fd, short events, void *arg) {
+    // How late the timer fired measures how long the loop was blocked.
+    struct worker *worker = arg;
+    uint64_t now = now_ns();
+    uint64_t expected = worker->last_tick + TICK_INTERVAL.tv_usec * 1000ULL;
+    histogram_record(&thread_metrics()->loop_lag, now > expected ? now - expected : 0);
+    worker->last_tick = now;
+}
+
+static void worker_swap(evutil_socket_t fd, short events, void *arg) {
+    struct dataset *previous = dataset;
+    dataset = dataset_acquire();
+    dataset_release(previous);
+}
+
+void *worker_run(void *arg) {
+    struct worker *worker = arg;
+
+    if (worker->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(worker->cpu, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus)) {
+            printf("worker %d: could not pin to cpu %d\n", worker->id, worker->cpu);
+        }
+    }
+
+    io_loop = worker->io_loop;
+    dataset = dataset_acquire();
+
+    worker->last_tick = now_ns();
+    event_add(worker->tick, &TICK_INTERVAL);
+
+    event_base_dispatch(worker->base);
+
+    dataset_release(dataset);
+    dataset = NULL;
+    return NULL;
+}
+
+static bool worker_listen(struct worker *worker, int port) {
+    // Every worker gets its own listening socket on the same port, so that
+    // the kernel distributes incoming connections between the event loops.
+    struct sockaddr_in sin = {};
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    struct evconnlistener *listener = evconnlistener_new_bind(
+        worker->base, NULL, NULL,
+        LEV_OPT_CLOSE_ON_FREE | LEV_OPT_CLOSE_ON_EXEC | LEV_OPT_REUSEABLE | LEV_OPT_REUSEABLE_PORT,
+        -1, (struct sockaddr *) &sin, sizeof(sin));
+    if (!listener) return false;
+
+    return evhttp_bind_listener(worker->http, listener) != NULL;
+}
+
+bool worker_init(struct worker *worker) {
+    worker->base = event_base_new();
+    if (!worker->base) {
+        puts("could not initialize event_base");
+        abort();
+    }
+
+    worker->http = evhttp_new(worker->base);
+    if (!worker->http) {
+        puts("could not initialize evhttp");
+        abort();
+    }
+
+    evhttp_set_cb(worker->http, "/master", handle_request, (void *) &ROUTES[ENDPOINT_MASTER]); // master
+    evhttp_set_cb(worker->http, "/master/batch", handle_request, (void *) &ROUTES[ENDPOINT_MASTER_BATCH]);
+    evhttp_set_cb(worker->http, "/master/line", handle_request, (void *) &ROUTES[ENDPOINT_MASTER_LINE]);
+    evhttp_set_cb(worker->http, "/ready", handle_request, (void *) &ROUTES[ENDPOINT_READY]);
+    evhttp_set_cb(worker->http, "/metrics", handle_request, (void *) &ROUTES[ENDPOINT_METRICS]);
+    evhttp_set_cb(worker->http, "/admin/reload", handle_request, (void *) &ROUTES[ENDPOINT_ADMIN_RELOAD]);
+    evhttp_set_max_body_size(worker->http, MAX_BATCH_POSITIONS * 128);
+    evhttp_set_gencb(worker->http, handle_generic, NULL);
+
+    worker->tick = event_new(worker->base, -1, EV_PERSIST, worker_tick, worker);
+    if (!worker->tick) abort();
+
+    worker->swap = event_new(worker->base, -1, 0, worker_swap, worker);
+    if (!worker->swap) abort();
+
+    worker->io_loop = iopool_loop_new(worker->base);
+
+    return worker_listen(worker, worker->port) && (!priority_port || worker_listen(worker, priority_port));
+}
+
+void stop_workers(evutil_socket_t sig, short events, void *arg) {
+    puts("shutting down ...");
+    __atomic_store_n(&stopping, true, __ATOMIC_RELAXED);
+    for (int i = 0; i < num_workers; i++) event_base_loopexit(workers[i].base, NULL);
+}
+
+void reload_signal(evutil_socket_t sig, short events, void *arg) {
+    if (!start_reload(true)) puts("reload already in progress");
+}
+
+int serve(int port, const int *cpus, int num_cpus) {
+    workers = calloc(num_workers, sizeof(struct worker));
+    if (!workers) abort();
+
+    if (num_io_threads > 0) {
+        io_pool = iopool_new(num_io_threads, MAX_QUEUED_IO);
+        master_flight = flight_new();
+    }
+
+    for (int i = 0; i < num_workers; i++) {
+        workers[i].id = i;
+        workers[i].port = port;
+        workers[i].cpu = num_cpus ? cpus[i % num_cpus] : -1;
+
+        if (!worker_init(&workers[i])) {
+            printf("could not bind socket to http://127.0.0.1:%d/\n", port);
+            return 1;
+        }
+    }
+
+    struct event *sigint = evsignal_new(workers[0].base, SIGINT, stop_workers, NULL);
+    struct event *sigterm = evsignal_new(workers[0].base, SIGTERM, stop_workers, NULL);
+    struct event *sighup = evsignal_new(workers[0].base, SIGHUP, reload_signal, NULL);
+    if (!sigint || !sigterm || !sighup ||
+            evsignal_add(sigint, NULL) || evsignal_add(sigterm, NULL) || evsignal_add(sighup, NULL)) {
+        puts("could not install signal handlers");
+        abort();
+    }
+
+    printf("listening on http://127.0.0.1:%d/ with %d worker(s) and %d i/o thread(s) ...\n",
+           port, num_workers, io_pool ? num_io_threads : 0);
+    if (priority_port) printf("priority lane on http://127.0.0.1:%d/\n", priority_port);
+
+    for (int i = 0; i < num_workers; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_run, &workers[i])) {
+            puts("could not start worker thread");
+            abort();
+        }
+    }
+
+    for (int i = 0; i < num_workers; i++) pthread_join(workers[i].thread, NULL);
+
+    event_free(sigint);
+    event_free(sigterm);
+    event_free(sighup);
+
+    // No more reloads can be started. Wait for a running one, which still
+    // signals the workers.
+    if (reload_started) pthread_join(reload_thread, NULL);
+    reload_started = false;
+
+    // No more completions after this.
+    if (io_pool) iopool_free(io_pool);
+    io_pool = NULL;
+    if (master_flight) flight_free(master_flight);
+    master_flight = NULL;
+
+    for (int i = 0; i < num_workers; i++) {
+        iopool_loop_free(workers[i].io_loop);
+        event_free(workers[i].tick);
+        event_free(workers[i].swap);
+        evhttp_free(workers[i].http);
+        event_base_free(workers[i].base);
+    }
+
+    free(workers);
+    workers = NULL;
+    return 0;
+}
+
+int parse_cpus(char *arg, int *cpus) {
+    int num_cpus = 0;
+    char *save_ptr;
+
+    for (char *token = strtok_r(arg, ",", &save_ptr); token; token = strtok_r(NULL, ",", &save_ptr)) {
+        if (num_cpus >= MAX_WORKERS) break;
+        cpus[num_cpus++] = atoi(token);
+    }
+
+    return num_cpus;
+}
+
+void usage(const char *name) {
+    printf("usage: %s [-p port] [-t threads] [-a cpu,cpu,...] [-m cache-mb] [-r record-cache-mb]\n"
+           "          [-W warmup-min-games] [-w hot-keys-file] [-s timing-sample-rate] [-S slow-ms]\n"
+           "          [-l query-log] [-i io-threads] [-Q max-queued] [-E max-queued-expensive]\n"
+           "          [-D queue-deadline-ms] [-P priority-port] [-k prefetch-moves] [-q]\n", name);
+}
+
+int main(int argc, char *argv[]) {
+    int port = 5555;
+    int cpus[MAX_WORKERS];
+    int num_cpus = 0;
+    size_t cache_mb = 64;
+    size_t record_cache_mb = 64;
+    struct warmup_config warmup = {};
+    const char *query_log_path = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "p:t:a:m:r:W:w:s:S:l:i:Q:E:D:P:k:qh")) != -1) {
+        switch (opt) {
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 't':
+                num_workers = atoi(optarg);
+                if (num_workers <= 0) num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+                if (num_workers > MAX_WORKERS) num_workers = MAX_WORKERS;
+                break;
+            case 'a':
+                num_cpus = parse_cpus(optarg, cpus);
+                break;
+            case 'm':
+                cache_mb = atol(optarg);
+                break;
+            case 'r':
+                record_cache_mb = atol(optarg);
+                break;
+            case 'W':
+                warmup.min_games = atol(optarg);
+                break;
+            case 'w':
+                warmup.hot_keys_path = optarg;
+                break;
+            case 's':
+                timing_sample_rate = atof(optarg);
+                break;
+            case 'S':
+                slow_request_ns = atol(optarg) * 1000000ULL;
+                break;
+            case 'l':
+                query_log_path = optarg;
+                break;
+            case 'i':
+                num_io_threads = atoi(optarg);
+                break;
+            case 'Q':
+                max_deferred = atoi(optarg);
+                break;
+            case 'E':
+                max_deferred_expensive = atoi(optarg);
+                break;
+            case 'D':
+                queue_deadline_ns = atol(optarg) * 1000000ULL;
+                break;
+            case 'P':
+                priority_port = atoi(optarg);
+                break;
+            case 'k':
+                prefetch_moves = atoi(optarg);
+                if (prefetch_moves < 0) prefetch_moves = 0;
+                if (prefetch_moves > MAX_PREFETCH_MOVES) prefetch_moves = MAX_PREFETCH_MOVES;
+                break;
+            case 'q':
+                verbose = false;
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    attacks_init();
+    evthread_use_pthreads();
+
+    master_cache_budget = cache_mb * 1024 * 1024;
+    record_cache_budget = record_cache_mb * 1024 * 1024;
+
+    // Warm-up needs somewhere to put the records.
+    if (!record_cache_budget) {
+        warmup.min_games = 0;
+        warmup.hot_keys_path = NULL;
+    }
+
+    struct dataset *ds = dataset_open();
+    if (!ds) return 1;
+    dataset_publish(ds);
+
+    puts("opened all databases.");
+
+    if (query_log_path) {
+        query_log = querylog_writer_open(query_log_path);
+        if (!query_log) {
+            printf("could not open query log %s\n", query_log_path);
+            return 1;
+        }
+        printf("recording queries to %s\n", query_log_path);
+    }
+
+    pthread_t warmup_thread;
+    bool warming_up = warmup.min_games || warmup.hot_keys_path;
+    if (warming_up) {
+        if (pthread_create(&warmup_thread, NULL, warmup_run, &warmup)) {
+            puts("could not start warm-up thread");
+            abort();
+        }
+    } else {
+        __atomic_store_n(&ready, true, __ATOMIC_RELEASE);
+    }
+
+    int ret = serve(port, cpus, num_cpus);
+
+    __atomic_store_n(&stopping, true, __ATOMIC_RELAXED);
+    if (warming_up) pthread_join(warmup_thread, NULL);
+
+    if (warmup.hot_keys_path) {
+        if (dump_hot_keys(current_dataset->record_cache, warmup.hot_keys_path)) printf("dumped hot keys to %s\n", warmup.hot_keys_path);
+        else printf("could not dump hot keys to %s\n", warmup.hot_keys_path);
+    }
+
+    dataset_release(current_dataset);
+    current_dataset = NULL;
+
+    if (query_log && !querylog_writer_close(query_log)) printf("could not close query log %s\n", query_log_path);
 
-    if (!kcdbclose(master_db)) {
-        printf("master.kch close error: %s\n", kcecodename(kcdbecode(master_db)));
+    while (all_metrics) {
+        struct thread_metrics *next = all_metrics->next;
+        free(all_metrics);
+        all_metrics = next;
     }
 
-    kcdbdel(master_pgn_db);
     return ret;
 }
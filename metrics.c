@@ -0,0 +1,61 @@
+#include "metrics.h"
+
+static const uint64_t HISTOGRAM_SUB_BUCKETS = 1 << HISTOGRAM_SUB_BITS;
+
+static size_t histogram_bucket(uint64_t value) {
+    if (value < HISTOGRAM_SUB_BUCKETS) return value;
+
+    int exponent = 63 - __builtin_clzll(value);
+    int shift = exponent - HISTOGRAM_SUB_BITS;
+    return ((size_t) (shift + 1) << HISTOGRAM_SUB_BITS) + ((value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+static uint64_t histogram_bucket_lower(size_t bucket) {
+    if (bucket < HISTOGRAM_SUB_BUCKETS) return bucket;
+
+    int shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+    return (HISTOGRAM_SUB_BUCKETS + (bucket & (HISTOGRAM_SUB_BUCKETS - 1))) << shift;
+}
+
+static uint64_t histogram_bucket_width(size_t bucket) {
+    if (bucket < HISTOGRAM_SUB_BUCKETS) return 1;
+    return 1ULL << ((bucket >> HISTOGRAM_SUB_BITS) - 1);
+}
+
+void histogram_record(struct histogram *histogram, uint64_t value) {
+    counter_add(&histogram->buckets[histogram_bucket(value)], 1);
+    counter_add(&histogram->sum, value);
+    counter_add(&histogram->count, 1);
+}
+
+void histogram_merge(struct histogram *dst, const struct histogram *src) {
+    dst->count += counter_get(&src->count);
+    dst->sum += counter_get(&src->sum);
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) dst->buckets[i] += counter_get(&src->buckets[i]);
+}
+
+uint64_t histogram_count_below(const struct histogram *histogram, int exponent) {
+    // Powers of two are bucket boundaries.
+    size_t end = histogram_bucket(1ULL << exponent);
+
+    uint64_t count = 0;
+    for (size_t i = 0; i < end; i++) count += histogram->buckets[i];
+    return count;
+}
+
+uint64_t histogram_quantile(const struct histogram *histogram, double q) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) total += histogram->buckets[i];
+    if (!total) return 0;
+
+    uint64_t rank = q * total;
+    if (rank >= total) rank = total - 1;
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen > rank) return histogram_bucket_lower(i) + (histogram_bucket_width(i) - 1) / 2;
+    }
+
+    return 0;
+}
@@ -0,0 +1,41 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Counters and histograms with a single writer thread. Updates are plain
+// relaxed stores without locks or read-modify-write instructions. Readers on
+// other threads see slightly stale, but never torn, values.
+
+static inline void counter_add(uint64_t *counter, uint64_t n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t counter_get(const uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+// Log-linear buckets: 16 linear sub-buckets per power of two, so the
+// relative error of any recorded value is below 1/16.
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+void histogram_record(struct histogram *histogram, uint64_t value);
+
+// Adds a snapshot of src to dst. dst must be private to the caller.
+void histogram_merge(struct histogram *dst, const struct histogram *src);
+
+// Number of recorded values less than the given power of two.
+uint64_t histogram_count_below(const struct histogram *histogram, int exponent);
+
+// Approximate value at quantile q (0 <= q <= 1).
+uint64_t histogram_quantile(const struct histogram *histogram, double q);
+
+#endif  // #ifndef METRICS_H_
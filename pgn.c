@@ -3,6 +3,17 @@
 
 #include "pgn.h"
 
+// Undo PGN string escapes (\\ and \") in place.
+static char *pgn_unescape(char *value) {
+    char *out = value;
+    for (const char *in = value; *in; in++) {
+        if (*in == '\\' && (in[1] == '\\' || in[1] == '"')) in++;
+        *out++ = *in;
+    }
+    *out = 0;
+    return value;
+}
+
 struct pgn_game_info *pgn_game_info_read(char *pgn, char **saveptr_pgn) {
     struct pgn_game_info *game_info = calloc(1, sizeof(struct pgn_game_info));
     if (!game_info) abort();
@@ -17,10 +28,10 @@ struct pgn_game_info *pgn_game_info_read(char *pgn, char **saveptr_pgn) {
         else if (1 == sscanf(line, "[BlackElo \"%d\"]", &game_info->black_elo)) continue;
         else if (1 == sscanf(line, "[Date \"%d", &game_info->year)) continue;
         else if (strncmp("[White \"", line, strlen("[White \"")) == 0 && line[strlen(line) - 2] == '"') {
-            game_info->white = strndup(line + strlen("[White \""), strlen(line) - strlen("[White \"") - 2);
+            game_info->white = pgn_unescape(strndup(line + strlen("[White \""), strlen(line) - strlen("[White \"") - 2));
         }
         else if (strncmp("[Black \"", line, strlen("[Black \"")) == 0 && line[strlen(line) - 2] == '"') {
-            game_info->black = strndup(line + strlen("[Black \""), strlen(line) - strlen("[Black \"") - 2);
+            game_info->black = pgn_unescape(strndup(line + strlen("[Black \""), strlen(line) - strlen("[Black \"") - 2));
         }
     }
 
@@ -32,3 +43,73 @@ void pgn_game_info_free(struct pgn_game_info *game_info) {
     if (game_info->black) free(game_info->black);
     free(game_info);
 }
+
+static bool pgn_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+const char *pgn_skip_headers(const char *pgn, const char *end) {
+    while (pgn < end) {
+        const char *eol = memchr(pgn, '\n', end - pgn);
+        if (!eol) eol = end;
+
+        size_t line_size = eol - pgn;
+        if (line_size && pgn[line_size - 1] == '\r') line_size--;
+        if (line_size && pgn[0] != '[') break;
+
+        pgn = eol + (eol < end);
+    }
+    return pgn;
+}
+
+bool pgn_movetext_next(struct pgn_movetext *movetext, char *san, size_t san_size,
+                       const char **token, size_t *token_size) {
+    const char *pgn = movetext->pgn, *end = movetext->end;
+
+    while (pgn && pgn < end) {
+        // Skip comments and variations.
+        if (*pgn == '{') {
+            pgn = memchr(pgn, '}', end - pgn);
+            if (pgn) pgn++;
+            continue;
+        } else if (*pgn == ';') {
+            pgn = memchr(pgn, '\n', end - pgn);
+            continue;
+        } else if (*pgn == '(') {
+            movetext->depth++;
+            pgn++;
+            continue;
+        } else if (*pgn == ')') {
+            if (movetext->depth) movetext->depth--;
+            pgn++;
+            continue;
+        } else if (pgn_space(*pgn)) {
+            pgn++;
+            continue;
+        }
+
+        const char *start = pgn;
+        while (pgn < end && !pgn_space(*pgn) && *pgn != '{' && *pgn != ';' && *pgn != '(' && *pgn != ')') pgn++;
+        size_t size = pgn - start;
+
+        // Skip move numbers, game results and annotations.
+        if (movetext->depth || ('0' <= start[0] && start[0] <= '9') || start[0] == '*' || start[0] == '$') continue;
+
+        *token = start;
+        *token_size = size;
+
+        while (size && (start[size - 1] == '!' || start[size - 1] == '?')) size--;
+        if (size && size < san_size) {
+            memcpy(san, start, size);
+            san[size] = 0;
+        } else {
+            san[0] = 0;
+        }
+
+        movetext->pgn = pgn;
+        return true;
+    }
+
+    movetext->pgn = end;
+    return false;
+}
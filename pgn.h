@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 struct pgn_game_info {
     char *white;
@@ -20,4 +21,21 @@ struct pgn_game_info *pgn_game_info_read(char *pgn, char **saveptr_pgn);
 
 void pgn_game_info_free(struct pgn_game_info *game_info);
 
+// Start of the movetext, after the headers.
+const char *pgn_skip_headers(const char *pgn, const char *end);
+
+// Main line of PGN movetext, read in place.
+struct pgn_movetext {
+    const char *pgn;
+    const char *end;
+    int depth;  // of variations
+};
+
+// Next move of the main line, or false at the end. Skips comments,
+// variations, move numbers, game results and NAGs. token is the move as it
+// appears in the game. san is the move without !? annotations, or empty if
+// it does not fit.
+bool pgn_movetext_next(struct pgn_movetext *movetext, char *san, size_t san_size,
+                       const char **token, size_t *token_size);
+
 #endif  // #ifndef PGN_H_
@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <zlib.h>
+#include <zstd.h>
+
+#include "pgnfile.h"
+
+enum pgnfile_format {
+    PGNFILE_PLAIN,
+    PGNFILE_GZIP,
+    PGNFILE_ZSTD,
+};
+
+struct pgnfile {
+    enum pgnfile_format format;
+
+    // Text that was not handed out yet starts at pos. Plain files are
+    // mapped as a whole.
+    char *data;
+    size_t size;
+    size_t capacity;
+    size_t pos;
+
+    // Scan state of the current game.
+    size_t scan;
+    bool moves;  // seen movetext
+
+    bool eof;
+    bool error;
+
+    gzFile gz;
+
+    FILE *file;
+    ZSTD_DCtx *zstd;
+    ZSTD_inBuffer input;
+    size_t frame_remaining;  // last hint, 0 at the end of a frame
+};
+
+static const size_t PGNFILE_BLOCK_SIZE = 1024 * 1024;
+
+static bool pgnfile_has_suffix(const char *path, const char *suffix) {
+    size_t len = strlen(path), suffix_len = strlen(suffix);
+    return len >= suffix_len && strcmp(path + len - suffix_len, suffix) == 0;
+}
+
+static bool pgnfile_map(struct pgnfile *file, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+
+    if (st.st_size) {
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+        madvise(data, st.st_size, MADV_SEQUENTIAL);
+        file->data = data;
+        file->size = st.st_size;
+    }
+
+    close(fd);
+    file->eof = true;
+    return true;
+}
+
+struct pgnfile *pgnfile_open(const char *path) {
+    struct pgnfile *file = calloc(1, sizeof(struct pgnfile));
+    if (!file) abort();
+
+    bool ok;
+    if (pgnfile_has_suffix(path, ".gz")) {
+        file->format = PGNFILE_GZIP;
+        file->gz = gzopen(path, "rb");
+        ok = file->gz && gzbuffer(file->gz, PGNFILE_BLOCK_SIZE) == 0;
+    } else if (pgnfile_has_suffix(path, ".zst")) {
+        file->format = PGNFILE_ZSTD;
+        file->file = fopen(path, "rb");
+        file->zstd = ZSTD_createDCtx();
+        file->input.src = malloc(ZSTD_DStreamInSize());
+        ok = file->file && file->zstd && file->input.src;
+    } else {
+        file->format = PGNFILE_PLAIN;
+        ok = pgnfile_map(file, path);
+    }
+
+    if (!ok) {
+        pgnfile_close(file);
+        return NULL;
+    }
+
+    return file;
+}
+
+void pgnfile_close(struct pgnfile *file) {
+    if (file->format == PGNFILE_PLAIN) {
+        if (file->data) munmap(file->data, file->size);
+    } else {
+        free(file->data);
+    }
+
+    if (file->gz) gzclose(file->gz);
+    if (file->file) fclose(file->file);
+    if (file->zstd) ZSTD_freeDCtx(file->zstd);
+    free((void *) file->input.src);
+    free(file);
+}
+
+bool pgnfile_ok(const struct pgnfile *file) {
+    return !file->error;
+}
+
+// Decompresses up to one block. Returns the number of bytes.
+static size_t pgnfile_read(struct pgnfile *file, char *buffer, size_t size) {
+    if (file->format == PGNFILE_GZIP) {
+        int n = gzread(file->gz, buffer, size);
+        if (n < 0) file->error = true;
+        return n > 0 ? n : 0;
+    }
+
+    ZSTD_outBuffer output = { buffer, size, 0 };
+    while (!output.pos) {
+        if (file->input.pos == file->input.size) {
+            file->input.size = fread((void *) file->input.src, 1, ZSTD_DStreamInSize(), file->file);
+            file->input.pos = 0;
+            if (!file->input.size) {
+                // Truncated in the middle of a frame.
+                if (ferror(file->file) || file->frame_remaining) file->error = true;
+                return 0;
+            }
+        }
+
+        file->frame_remaining = ZSTD_decompressStream(file->zstd, &output, &file->input);
+        if (ZSTD_isError(file->frame_remaining)) {
+            file->error = true;
+            return 0;
+        }
+    }
+    return output.pos;
+}
+
+static void pgnfile_fill(struct pgnfile *file) {
+    // Drop what was handed out.
+    if (file->pos) memmove(file->data, file->data + file->pos, file->size - file->pos);
+    file->size -= file->pos;
+    file->scan -= file->pos;
+    file->pos = 0;
+
+    if (file->capacity - file->size < PGNFILE_BLOCK_SIZE) {
+        file->capacity = file->size + PGNFILE_BLOCK_SIZE > 2 * file->capacity ? file->size + PGNFILE_BLOCK_SIZE : 2 * file->capacity;
+        file->data = realloc(file->data, file->capacity);
+        if (!file->data) abort();
+    }
+
+    size_t n = pgnfile_read(file, file->data + file->size, file->capacity - file->size);
+    file->size += n;
+    if (!n) file->eof = true;
+}
+
+static bool pgnfile_blank(const char *line, const char *end) {
+    for (; line < end; line++) {
+        if (*line != ' ' && *line != '\t' && *line != '\r' && *line != '\n') return false;
+    }
+    return true;
+}
+
+// Looks for the first header line after movetext, which starts the next
+// game. Resumes where the previous call stopped, and only looks at
+// complete lines until the end of the file.
+static bool pgnfile_scan(struct pgnfile *file, size_t *end) {
+    while (file->scan < file->size) {
+        const char *line = file->data + file->scan;
+        const char *eol = memchr(line, '\n', file->size - file->scan);
+        if (!eol && !file->eof) return false;
+        if (!eol) eol = file->data + file->size;
+
+        if (line[0] == '[') {
+            if (file->moves) {
+                *end = file->scan;
+                return true;
+            }
+        } else if (!pgnfile_blank(line, eol)) {
+            file->moves = true;
+        }
+
+        file->scan = eol - file->data + (eol < file->data + file->size);
+    }
+    return false;
+}
+
+bool pgnfile_next(struct pgnfile *file, const char **game, size_t *size) {
+    size_t end;
+    while (!pgnfile_scan(file, &end)) {
+        if (file->eof) {
+            end = file->size;
+            break;
+        }
+        pgnfile_fill(file);
+    }
+
+    // Trim blank lines.
+    const char *begin = file->data + file->pos;
+    const char *stop = file->data + end;
+    while (begin < stop && (*begin == '\n' || *begin == '\r' || *begin == ' ' || *begin == '\t')) begin++;
+    while (stop > begin && (stop[-1] == '\n' || stop[-1] == '\r' || stop[-1] == ' ' || stop[-1] == '\t')) stop--;
+
+    file->pos = end;
+    file->moves = false;
+
+    if (begin == stop) return false;
+    *game = begin;
+    *size = stop - begin;
+    return true;
+}
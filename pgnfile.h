@@ -0,0 +1,23 @@
+#ifndef PGNFILE_H_
+#define PGNFILE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Reads games from a PGN file, without copying them. Plain files are memory
+// mapped. Files ending in .gz or .zst are decompressed block by block.
+
+struct pgnfile;
+
+struct pgnfile *pgnfile_open(const char *path);
+void pgnfile_close(struct pgnfile *file);
+
+// Next game, headers and movetext, without surrounding blank lines. Valid
+// until the next call. Returns false at the end of the file or on error.
+bool pgnfile_next(struct pgnfile *file, const char **game, size_t *size);
+
+// After pgnfile_next() returned false: whether the file was read to the
+// end.
+bool pgnfile_ok(const struct pgnfile *file);
+
+#endif  // #ifndef PGNFILE_H_
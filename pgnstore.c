@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "encode.h"
+#include "pgnstore.h"
+
+static const char PGNSTORE_MAGIC[8] = "MSTRPGN\0";
+static const uint32_t PGNSTORE_VERSION = 1;
+
+struct pgnstore {
+    const char *data;
+    size_t size;
+
+    const struct pgnstore_entry *entries;
+    uint32_t num_games;
+};
+
+struct pgnstore *pgnstore_open(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < sizeof(struct pgnstore_header)) {
+        close(fd);
+        return NULL;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return NULL;
+
+    const struct pgnstore_header *header = data;
+    if (memcmp(header->magic, PGNSTORE_MAGIC, 8) != 0 ||
+            header->version != PGNSTORE_VERSION ||
+            header->index_offset % _Alignof(struct pgnstore_entry) ||
+            header->index_offset + header->num_games * sizeof(struct pgnstore_entry) > st.st_size) {
+        munmap(data, st.st_size);
+        return NULL;
+    }
+
+    // Games are requested in no particular order.
+    madvise(data, st.st_size, MADV_RANDOM);
+
+    struct pgnstore *store = malloc(sizeof(struct pgnstore));
+    if (!store) abort();
+
+    store->data = data;
+    store->size = st.st_size;
+    store->entries = (const struct pgnstore_entry *) (store->data + header->index_offset);
+    store->num_games = header->num_games;
+    return store;
+}
+
+void pgnstore_close(struct pgnstore *store) {
+    munmap((void *) store->data, store->size);
+    free(store);
+}
+
+const char *pgnstore_find(const struct pgnstore *store, const char *game_id, size_t *size) {
+    uint64_t id;
+    if (!game_id_number(game_id, &id)) return NULL;
+
+    size_t lo = 0, hi = store->num_games;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const struct pgnstore_entry *entry = &store->entries[mid];
+        if (entry->id < id) {
+            lo = mid + 1;
+        } else if (entry->id > id) {
+            hi = mid;
+        } else {
+            if (entry->offset + entry->size > store->size) return NULL;
+            *size = entry->size;
+            return store->data + entry->offset;
+        }
+    }
+
+    return NULL;
+}
+
+size_t pgnstore_size(const struct pgnstore *store) {
+    return store->num_games;
+}
+
+struct pgnstore_writer {
+    char *path;
+    char *tmp_path;
+    FILE *file;
+    uint64_t offset;
+
+    struct pgnstore_entry *entries;
+    size_t num_games;
+    size_t capacity;
+
+    bool ok;
+};
+
+struct pgnstore_writer *pgnstore_writer_open(const char *path) {
+    struct pgnstore_writer *writer = calloc(1, sizeof(struct pgnstore_writer));
+    if (!writer) abort();
+
+    writer->path = strdup(path);
+    writer->tmp_path = malloc(strlen(path) + 5);
+    if (!writer->path || !writer->tmp_path) abort();
+    sprintf(writer->tmp_path, "%s.tmp", path);
+
+    writer->file = fopen(writer->tmp_path, "wb");
+    if (!writer->file) {
+        free(writer->path);
+        free(writer->tmp_path);
+        free(writer);
+        return NULL;
+    }
+
+    // Placeholder, rewritten once the index is known.
+    struct pgnstore_header header = {};
+    writer->ok = 1 == fwrite(&header, sizeof(header), 1, writer->file);
+    writer->offset = sizeof(header);
+    return writer;
+}
+
+bool pgnstore_writer_add(struct pgnstore_writer *writer, const char *game_id, const char *pgn, size_t size) {
+    uint64_t id;
+    if (!game_id_number(game_id, &id)) return false;
+
+    if (writer->num_games == writer->capacity) {
+        writer->capacity = writer->capacity ? writer->capacity * 2 : 1024;
+        writer->entries = realloc(writer->entries, writer->capacity * sizeof(struct pgnstore_entry));
+        if (!writer->entries) abort();
+    }
+
+    struct pgnstore_entry *entry = &writer->entries[writer->num_games++];
+    entry->id = id;
+    entry->offset = writer->offset;
+    entry->size = size;
+
+    writer->ok = writer->ok && size == fwrite(pgn, 1, size, writer->file);
+    writer->offset += size;
+    return writer->ok;
+}
+
+static int cmp_pgnstore_entry(const void *l, const void *r) {
+    const struct pgnstore_entry *a = (struct pgnstore_entry *) l;
+    const struct pgnstore_entry *b = (struct pgnstore_entry *) r;
+    return (a->id > b->id) - (a->id < b->id);
+}
+
+bool pgnstore_writer_close(struct pgnstore_writer *writer) {
+    qsort(writer->entries, writer->num_games, sizeof(struct pgnstore_entry), cmp_pgnstore_entry);
+
+    // The index is read in place.
+    static const char padding[_Alignof(struct pgnstore_entry)] = {};
+    size_t padding_size = -writer->offset % _Alignof(struct pgnstore_entry);
+
+    struct pgnstore_header header = {};
+    memcpy(header.magic, PGNSTORE_MAGIC, 8);
+    header.version = PGNSTORE_VERSION;
+    header.num_games = writer->num_games;
+    header.index_offset = writer->offset + padding_size;
+
+    bool ok = writer->ok;
+    ok = ok && padding_size == fwrite(padding, 1, padding_size, writer->file);
+    if (writer->num_games) ok = ok && writer->num_games == fwrite(writer->entries, sizeof(struct pgnstore_entry), writer->num_games, writer->file);
+    ok = ok && 0 == fseek(writer->file, 0, SEEK_SET);
+    ok = ok && 1 == fwrite(&header, sizeof(header), 1, writer->file);
+    ok = (fclose(writer->file) == 0) && ok;
+    ok = ok && rename(writer->tmp_path, writer->path) == 0;
+
+    free(writer->entries);
+    free(writer->path);
+    free(writer->tmp_path);
+    free(writer);
+    return ok;
+}
+
+// Leaves the previous file, if any, in place.
+void pgnstore_writer_abort(struct pgnstore_writer *writer) {
+    fclose(writer->file);
+    unlink(writer->tmp_path);
+
+    free(writer->entries);
+    free(writer->path);
+    free(writer->tmp_path);
+    free(writer);
+}
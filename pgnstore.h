@@ -0,0 +1,42 @@
+#ifndef PGNSTORE_H_
+#define PGNSTORE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Read-only, memory mapped store of PGN texts, so that they can be served
+// straight from the page cache.
+//
+// Layout: header, PGN texts, padding, index entries sorted by 48-bit game
+// id, aligned to be read in place.
+
+struct pgnstore_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_games;
+    uint64_t index_offset;
+};
+
+struct pgnstore_entry {
+    uint64_t id;
+    uint64_t offset;
+    uint64_t size;
+};
+
+struct pgnstore;
+
+struct pgnstore *pgnstore_open(const char *path);
+void pgnstore_close(struct pgnstore *store);
+
+const char *pgnstore_find(const struct pgnstore *store, const char *game_id, size_t *size);
+size_t pgnstore_size(const struct pgnstore *store);
+
+struct pgnstore_writer;
+
+struct pgnstore_writer *pgnstore_writer_open(const char *path);
+bool pgnstore_writer_add(struct pgnstore_writer *writer, const char *game_id, const char *pgn, size_t size);
+bool pgnstore_writer_close(struct pgnstore_writer *writer);
+void pgnstore_writer_abort(struct pgnstore_writer *writer);
+
+#endif  // #ifndef PGNSTORE_H_
@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "querylog.h"
+
+static const char QUERYLOG_MAGIC[8] = "MSTRQLOG";
+
+struct querylog_writer {
+    FILE *file;
+};
+
+struct querylog_writer *querylog_writer_open(const char *path) {
+    FILE *file = fopen(path, "ab");
+    if (!file) return NULL;
+
+    // Only new files get a header, so that logs can be appended to.
+    fseek(file, 0, SEEK_END);
+    if (ftell(file) == 0 && fwrite(QUERYLOG_MAGIC, sizeof(QUERYLOG_MAGIC), 1, file) != 1) {
+        fclose(file);
+        return NULL;
+    }
+
+    struct querylog_writer *writer = malloc(sizeof(struct querylog_writer));
+    if (!writer) abort();
+    writer->file = file;
+    return writer;
+}
+
+void querylog_writer_add(struct querylog_writer *writer, const char *query) {
+    size_t size = strlen(query);
+    if (size > QUERYLOG_MAX_QUERY_SIZE) return;
+
+    uint8_t record[2 + QUERYLOG_MAX_QUERY_SIZE];
+    record[0] = size & 0xff;
+    record[1] = size >> 8;
+    memcpy(record + 2, query, size);
+
+    // A single stdio call locks the stream, so concurrent records do not
+    // interleave.
+    fwrite(record, 2 + size, 1, writer->file);
+}
+
+bool querylog_writer_close(struct querylog_writer *writer) {
+    bool ok = fclose(writer->file) == 0;
+    free(writer);
+    return ok;
+}
+
+struct querylog *querylog_read(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) return NULL;
+
+    char magic[sizeof(QUERYLOG_MAGIC)];
+    if (fread(magic, sizeof(magic), 1, file) != 1 || memcmp(magic, QUERYLOG_MAGIC, sizeof(magic)) != 0) {
+        fclose(file);
+        return NULL;
+    }
+
+    struct querylog *log = calloc(1, sizeof(struct querylog));
+    if (!log) abort();
+
+    size_t capacity = 0;
+    uint8_t size_bytes[2];
+    while (fread(size_bytes, 2, 1, file) == 1) {
+        size_t size = size_bytes[0] | (size_bytes[1] << 8);
+
+        char *query = malloc(size + 1);
+        if (!query) abort();
+        if (size && fread(query, size, 1, file) != 1) {
+            // Truncated by a crash. Keep what is complete.
+            free(query);
+            break;
+        }
+        query[size] = '\0';
+
+        if (log->num_queries == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            log->queries = realloc(log->queries, capacity * sizeof(char *));
+            if (!log->queries) abort();
+        }
+        log->queries[log->num_queries++] = query;
+    }
+
+    fclose(file);
+    return log;
+}
+
+void querylog_free(struct querylog *log) {
+    for (size_t i = 0; i < log->num_queries; i++) free(log->queries[i]);
+    free(log->queries);
+    free(log);
+}
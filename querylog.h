@@ -0,0 +1,33 @@
+#ifndef QUERYLOG_H_
+#define QUERYLOG_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Compact binary log of /master query strings, recorded by the explorer and
+// replayed by the benchmark.
+//
+// Layout: 8 byte magic, then records of a little endian uint16 length
+// followed by the query string (without the leading '?').
+
+static const size_t QUERYLOG_MAX_QUERY_SIZE = 4096;
+
+struct querylog_writer;
+
+struct querylog_writer *querylog_writer_open(const char *path);
+
+// Thread safe. Longer queries are skipped.
+void querylog_writer_add(struct querylog_writer *writer, const char *query);
+
+bool querylog_writer_close(struct querylog_writer *writer);
+
+struct querylog {
+    size_t num_queries;
+    char **queries;
+};
+
+struct querylog *querylog_read(const char *path);
+void querylog_free(struct querylog *log);
+
+#endif  // #ifndef QUERYLOG_H_
@@ -0,0 +1,76 @@
+#include <stdlib.h>
+#include <sched.h>
+#include <time.h>
+
+#include "queue.h"
+
+struct queue {
+    void **items;
+    size_t mask;
+
+    // On separate cache lines, so that producer and consumer do not
+    // invalidate each other on every operation.
+    size_t head __attribute__((aligned(64)));  // next to pop
+    size_t tail __attribute__((aligned(64)));  // next to push
+};
+
+struct queue *queue_new(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) size <<= 1;
+
+    struct queue *queue;
+    if (posix_memalign((void **) &queue, 64, sizeof(struct queue))) abort();
+    queue->items = calloc(size, sizeof(void *));
+    if (!queue->items) abort();
+
+    queue->mask = size - 1;
+    queue->head = 0;
+    queue->tail = 0;
+    return queue;
+}
+
+void queue_free(struct queue *queue) {
+    free(queue->items);
+    free(queue);
+}
+
+bool queue_try_push(struct queue *queue, void *item) {
+    size_t tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    size_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+    if (tail - head > queue->mask) return false;
+
+    queue->items[tail & queue->mask] = item;
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+bool queue_try_pop(struct queue *queue, void **item) {
+    size_t head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    size_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+    if (head == tail) return false;
+
+    *item = queue->items[head & queue->mask];
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+void queue_backoff(int attempt) {
+    if (attempt < 64) {
+        sched_yield();
+    } else {
+        struct timespec ts = { 0, 100 * 1000 };
+        nanosleep(&ts, NULL);
+    }
+}
+
+bool queue_push(struct queue *queue, void *item) {
+    int attempt = 0;
+    while (!queue_try_push(queue, item)) queue_backoff(attempt++);
+    return attempt > 0;
+}
+
+bool queue_pop(struct queue *queue, void **item) {
+    int attempt = 0;
+    while (!queue_try_pop(queue, item)) queue_backoff(attempt++);
+    return attempt > 0;
+}
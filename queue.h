@@ -0,0 +1,30 @@
+#ifndef QUEUE_H_
+#define QUEUE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Bounded queue of pointers between exactly one producer thread and one
+// consumer thread. Lock-free: the producer only advances the tail, the
+// consumer only advances the head.
+
+struct queue;
+
+// Capacity is rounded up to a power of two.
+struct queue *queue_new(size_t capacity);
+void queue_free(struct queue *queue);
+
+// Return false if the queue is full or empty.
+bool queue_try_push(struct queue *queue, void *item);
+bool queue_try_pop(struct queue *queue, void **item);
+
+// Wait until there is room or an item, first yielding, then sleeping.
+// Return whether they had to wait.
+bool queue_push(struct queue *queue, void *item);
+bool queue_pop(struct queue *queue, void **item);
+
+// The wait of the above, for polling several queues. Waits longer as the
+// attempts go up.
+void queue_backoff(int attempt);
+
+#endif  // #ifndef QUEUE_H_
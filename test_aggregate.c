@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+
+#include "aggregate.h"
+
+static const size_t NUM_POSITIONS = 300;
+static const size_t NUM_DELTAS = 20000;
+
+struct expected {
+    struct master_record **records;
+    size_t num_visited;
+    uint64_t last;
+};
+
+static uint64_t position_hash(size_t i) {
+    return (i + 1) * 0x9e3779b97f4a7c15ULL;
+}
+
+static size_t position_index(uint64_t zobrist_hash) {
+    for (size_t i = 0; i < NUM_POSITIONS; i++) {
+        if (position_hash(i) == zobrist_hash) return i;
+    }
+    assert(false);
+    return 0;
+}
+
+static void check_record(uint64_t zobrist_hash, const struct master_record *record, void *opq) {
+    struct expected *expected = opq;
+    assert(!expected->num_visited || expected->last < zobrist_hash);
+    expected->last = zobrist_hash;
+    expected->num_visited++;
+
+    const struct master_record *reference = expected->records[position_index(zobrist_hash)];
+    assert(record->num_moves == reference->num_moves);
+    assert(record->num_refs == reference->num_refs);
+    assert(master_record_white(record) == master_record_white(reference));
+    assert(master_record_draws(record) == master_record_draws(reference));
+    assert(master_record_black(record) == master_record_black(reference));
+    assert(master_record_average_rating_sum(record) == master_record_average_rating_sum(reference));
+
+    // Byte for byte, whether or not runs were spilled and merged.
+    uint8_t buffer[4096], reference_buffer[4096];
+    size_t size = encode_master_record(buffer, record) - buffer;
+    size_t reference_size = encode_master_record(reference_buffer, reference) - reference_buffer;
+    assert(size == reference_size);
+    assert(memcmp(buffer, reference_buffer, size) == 0);
+}
+
+static void test_aggregate_budget(size_t budget, bool spills) {
+    printf("test_aggregate_budget %zu\n", budget);
+
+    struct aggregate *agg = aggregate_new(budget, "test_aggregate");
+
+    struct expected expected = {};
+    expected.records = calloc(NUM_POSITIONS, sizeof(struct master_record *));
+    assert(expected.records);
+    for (size_t i = 0; i < NUM_POSITIONS; i++) expected.records[i] = master_record_new();
+
+    srand(1);
+    for (size_t i = 0; i < NUM_DELTAS; i++) {
+        // Skewed towards the first positions, like openings.
+        size_t position = (rand() % NUM_POSITIONS) * (rand() % NUM_POSITIONS) / NUM_POSITIONS;
+        move_t move = move_make(rand() % 8, 8 + rand() % 8, 0);
+        char game_id[9];
+        snprintf(game_id, sizeof(game_id), "%08zu", i);
+        struct master_ref ref;
+        memcpy(ref.game_id, game_id, 8);
+        ref.average_rating = 2000 + rand() % 800;
+        int wdl = rand() % 3 - 1;
+
+        master_record_add_move(expected.records[position], move, &ref, wdl);
+        assert(aggregate_add(agg, position_hash(position), move, &ref, wdl));
+    }
+
+    assert((aggregate_num_runs(agg) > 0) == spills);
+    assert(aggregate_finish(agg, check_record, &expected));
+
+    size_t num_positions = 0;
+    for (size_t i = 0; i < NUM_POSITIONS; i++) {
+        if (expected.records[i]->num_moves) num_positions++;
+        master_record_free(expected.records[i]);
+    }
+    assert(expected.num_visited == num_positions);
+    assert(aggregate_num_runs(agg) == 0);
+
+    free(expected.records);
+    aggregate_free(agg);
+}
+
+int main() {
+    test_aggregate_budget(64 * 1024 * 1024, false);
+    test_aggregate_budget(128 * 1024, true);
+    return 0;
+}
@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "board.h"
@@ -224,6 +225,31 @@ void test_board_parse_san() {
     assert(move == move_make(SQ_G7, SQ_G8, kQueen));
 }
 
+void test_board_parse_uci() {
+    puts("test_board_parse_uci");
+    board_t pos;
+    move_t move;
+
+    board_reset(&pos);
+    assert(board_parse_uci(&pos, "g1f3", &move));
+    assert(move == move_make(SQ_G1, SQ_F3, 0));
+    assert(!board_parse_uci(&pos, "e2e5", &move));
+    assert(!board_parse_uci(&pos, "e2", &move));
+
+    // Standard and king captures rook castling notation.
+    assert(board_set_fen(&pos, "r1bqkb1r/pppp1ppp/2n2n2/4p3/2B1P3/5N2/PPPP1PPP/RNBQK2R w KQkq - 4 4"));
+    assert(board_parse_uci(&pos, "e1g1", &move));
+    assert(move == move_make(SQ_E1, SQ_H1, 0));
+    assert(board_parse_uci(&pos, "e1h1", &move));
+    assert(move == move_make(SQ_E1, SQ_H1, 0));
+
+    // Promotion.
+    assert(board_set_fen(&pos, "4k3/8/8/8/8/8/6p1/4K3 b - - 0 1"));
+    assert(board_parse_uci(&pos, "g2g1n", &move));
+    assert(move == move_make(SQ_G2, SQ_G1, kKnight));
+    assert(!board_parse_uci(&pos, "g2g1", &move));
+}
+
 void test_board_san() {
     puts("test_board_san");
     board_t pos;
@@ -303,6 +329,60 @@ void test_initial_legal_moves() {
     assert(end - moves == 20);
 }
 
+static void assert_san_all(const board_t *pos) {
+    move_t moves[255];
+    move_t *end = board_legal_moves(pos, moves, BB_ALL, BB_ALL);
+    size_t num_moves = end - moves;
+
+    char sans[255 * LEN_SAN];
+    board_san_all(pos, moves, num_moves, sans);
+
+    for (size_t i = 0; i < num_moves; i++) {
+        char san[LEN_SAN];
+        board_san(pos, moves[i], san);
+        assert(strcmp(san, sans + i * LEN_SAN) == 0);
+    }
+}
+
+void test_board_san_all() {
+    puts("test_board_san_all");
+
+    static const char *const FENS[] = {
+        "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+        "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+        // Discovered checks by knight, pawn and en passant.
+        "4k3/8/8/4N3/8/8/4R3/4K3 w - - 0 1",
+        "4k3/8/8/2B5/3P4/8/8/4K3 w - - 0 1",
+        "8/8/8/KPp4r/8/8/8/4k3 w - c6 0 2",
+        // Mates and promotions.
+        "6k1/5ppp/8/8/8/8/8/R5K1 w - - 0 1",
+        "1n2k3/P7/8/8/8/8/8/4K3 w - - 0 1",
+    };
+
+    char san[LEN_SAN];
+    board_t pos;
+    assert(board_set_fen(&pos, FENS[5]));
+    move_t mate = move_make(SQ_A1, SQ_A8, kNone);
+    board_san_all(&pos, &mate, 1, san);
+    assert(strcmp(san, "Ra8#") == 0);
+
+    // And along random games.
+    srand(1);
+    for (size_t f = 0; f < sizeof(FENS) / sizeof(FENS[0]); f++) {
+        for (int game = 0; game < 20; game++) {
+            assert(board_set_fen(&pos, FENS[f]));
+            for (int ply = 0; ply < 80; ply++) {
+                assert_san_all(&pos);
+
+                move_t moves[255];
+                move_t *end = board_legal_moves(&pos, moves, BB_ALL, BB_ALL);
+                if (end == moves) break;
+                board_move(&pos, moves[rand() % (end - moves)]);
+            }
+        }
+    }
+}
+
 int main() {
     attacks_init();
 
@@ -320,7 +400,9 @@ int main() {
     test_legal_promotion();
     test_board_zobrist_hash();
     test_board_parse_san();
+    test_board_parse_uci();
     test_board_san();
+    test_board_san_all();
     test_board_evasive_capture();
     test_board_pin();
     test_initial_legal_moves();
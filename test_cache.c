@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+
+#include "cache.h"
+
+void test_cache_get_put() {
+    puts("test_cache_get_put");
+
+    struct cache *cache = cache_new(1024 * 1024);
+
+    assert(!cache_get(cache, "abc", 3));
+
+    struct cache_value *value = cache_value_new("hello", 5);
+    cache_put(cache, "abc", 3, value);
+    cache_value_release(value);
+
+    struct cache_value *hit = cache_get(cache, "abc", 3);
+    assert(hit);
+    assert(hit->size == 5);
+    assert(memcmp(hit->data, "hello", 5) == 0);
+    cache_value_release(hit);
+
+    assert(!cache_get(cache, "ab", 2));
+
+    struct cache_stats stats;
+    cache_stats(cache, &stats);
+    assert(stats.hits == 1);
+    assert(stats.misses == 2);
+    assert(stats.entries == 1);
+
+    cache_free(cache);
+}
+
+void test_cache_budget() {
+    puts("test_cache_budget");
+
+    const size_t budget = 64 * 1024;
+    struct cache *cache = cache_new(budget);
+
+    char data[512] = {};
+    for (int i = 0; i < 10000; i++) {
+        struct cache_value *value = cache_value_new(data, sizeof(data));
+        cache_put(cache, (const char *) &i, sizeof(i), value);
+        cache_value_release(value);
+    }
+
+    struct cache_stats stats;
+    cache_stats(cache, &stats);
+    printf("- %lu entries, %zu bytes, %lu evictions\n", stats.entries, stats.bytes, stats.evictions);
+    assert(stats.bytes <= budget);
+    assert(stats.entries > 0);
+    assert(stats.insertions == 10000);
+    assert(stats.evictions == stats.insertions - stats.entries);
+
+    // The most recent entry survived.
+    int last = 9999;
+    struct cache_value *hit = cache_get(cache, (const char *) &last, sizeof(last));
+    assert(hit);
+    cache_value_release(hit);
+
+    cache_free(cache);
+}
+
+void test_cache_value_outlives_eviction() {
+    puts("test_cache_value_outlives_eviction");
+
+    struct cache *cache = cache_new(16 * 1024);
+
+    struct cache_value *value = cache_value_new("pinned", 6);
+    cache_put(cache, "pinned", 6, value);
+    cache_value_release(value);
+
+    struct cache_value *hit = cache_get(cache, "pinned", 6);
+    assert(hit);
+
+    char data[256] = {};
+    for (int i = 0; i < 1000; i++) {
+        struct cache_value *other = cache_value_new(data, sizeof(data));
+        cache_put(cache, (const char *) &i, sizeof(i), other);
+        cache_value_release(other);
+    }
+
+    assert(memcmp(hit->data, "pinned", 6) == 0);
+    cache_value_release(hit);
+
+    cache_free(cache);
+}
+
+static void count_entry(const char *key, size_t key_size, const struct cache_value *value, void *opq) {
+    (*(size_t *) opq) += value->size;
+}
+
+void test_cache_foreach() {
+    puts("test_cache_foreach");
+
+    struct cache *cache = cache_new(1024 * 1024);
+
+    for (int i = 0; i < 100; i++) {
+        struct cache_value *value = cache_value_new("abc", 3);
+        cache_put(cache, (const char *) &i, sizeof(i), value);
+        cache_value_release(value);
+    }
+
+    size_t total = 0;
+    cache_foreach(cache, count_entry, &total);
+    assert(total == 300);
+
+    cache_free(cache);
+}
+
+int main() {
+    test_cache_get_put();
+    test_cache_budget();
+    test_cache_value_outlives_eviction();
+    test_cache_foreach();
+    return 0;
+}
@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+
+#include <zlib.h>
+#include <brotli/decode.h>
+
+#include "compress.h"
+
+void test_compress_negotiate() {
+    puts("test_compress_negotiate");
+
+    assert(compress_negotiate(NULL) == ENCODING_IDENTITY);
+    assert(compress_negotiate("") == ENCODING_IDENTITY);
+    assert(compress_negotiate("gzip") == ENCODING_GZIP);
+    assert(compress_negotiate("gzip, deflate, br") == ENCODING_BROTLI);
+    assert(compress_negotiate("br;q=0, gzip") == ENCODING_GZIP);
+    assert(compress_negotiate("br;q=0.5, gzip;q=0.8") == ENCODING_GZIP);
+    assert(compress_negotiate("deflate") == ENCODING_IDENTITY);
+    assert(compress_negotiate("*") == ENCODING_BROTLI);
+    assert(compress_negotiate("GZIP;q=1") == ENCODING_GZIP);
+    assert(compress_negotiate("gzip;q=0, *") == ENCODING_BROTLI);
+    assert(compress_negotiate("*, br;q=0") == ENCODING_GZIP);
+    assert(compress_negotiate("br;q=0, gzip;q=0, *") == ENCODING_IDENTITY);
+    assert(compress_negotiate("*;q=0, gzip") == ENCODING_GZIP);
+}
+
+static const char TEXT[] =
+    "[Event \"Test\"]\n[Site \"London\"]\n[Date \"1986.09.08\"]\n[White \"Kasparov, Garry\"]\n[Black \"Karpov, Anatoly\"]\n\n"
+    "1. e4 e5 2. Nf3 Nc6 3. Bb5 a6 4. Ba4 Nf6 5. O-O Be7 6. Re1 b5 7. Bb3 d6 1-0\n";
+
+void test_compress_gzip() {
+    puts("test_compress_gzip");
+
+    struct cache_value *value = compress_value(TEXT, strlen(TEXT), ENCODING_GZIP);
+    assert(value);
+    assert((uint8_t) value->data[0] == 0x1f && (uint8_t) value->data[1] == 0x8b);
+
+    char out[1024];
+    z_stream stream = {};
+    assert(inflateInit2(&stream, 15 + 16) == Z_OK);
+    stream.next_in = (Bytef *) value->data;
+    stream.avail_in = value->size;
+    stream.next_out = (Bytef *) out;
+    stream.avail_out = sizeof(out);
+    assert(inflate(&stream, Z_FINISH) == Z_STREAM_END);
+    assert(stream.total_out == strlen(TEXT));
+    assert(memcmp(out, TEXT, strlen(TEXT)) == 0);
+    inflateEnd(&stream);
+
+    cache_value_release(value);
+}
+
+void test_compress_brotli() {
+    puts("test_compress_brotli");
+
+    struct cache_value *value = compress_value(TEXT, strlen(TEXT), ENCODING_BROTLI);
+    assert(value);
+    assert(value->size < strlen(TEXT));
+
+    uint8_t out[1024];
+    size_t out_size = sizeof(out);
+    assert(BrotliDecoderDecompress(value->size, (const uint8_t *) value->data, &out_size, out) == BROTLI_DECODER_RESULT_SUCCESS);
+    assert(out_size == strlen(TEXT));
+    assert(memcmp(out, TEXT, out_size) == 0);
+
+    cache_value_release(value);
+}
+
+int main() {
+    test_compress_negotiate();
+    test_compress_gzip();
+    test_compress_brotli();
+    return 0;
+}
@@ -64,6 +64,33 @@ void test_encode_game_id() {
     decode_game_id(encoded, decoded);
     printf("- %s %s\n", id_6, decoded);
     assert(strcmp(id_6, decoded) == 0);
+
+    const char *id_7 = "_zAAj00z";
+    encode_game_id(encoded, id_7);
+    decode_game_id(encoded, decoded);
+    printf("- %s %s\n", id_7, decoded);
+    assert(strcmp(id_7, decoded) == 0);
+}
+
+void test_game_id_number() {
+    puts("test_game_id_number");
+    uint64_t number;
+
+    assert(game_id_number("00000000", &number));
+    assert(number == 0);
+
+    assert(game_id_number("0000000a", &number));
+    assert(number == 36);
+
+    assert(game_id_number("zzzzzzzz", &number));
+    assert(number == 218340105584895ULL);
+
+    assert(game_id_number("_0000000", &number));
+    assert(number == 218340105584896ULL);
+
+    assert(!game_id_number("0000-000", &number));
+    assert(!game_id_number("0_000000", &number));
+    assert(!game_id_number("0000000", &number));
 }
 
 void test_master_record() {
@@ -89,9 +116,62 @@ void test_master_record() {
     master_record_free(decoded);
 }
 
+void test_master_record_merge() {
+    puts("test_master_record_merge");
+
+    const struct master_ref refs[6] = {
+        { "aaaaaaaa", 2500 }, { "bbbbbbbb", 2700 }, { "cccccccc", 2600 },
+        { "dddddddd", 2500 }, { "eeeeeeee", 2650 }, { "ffffffff", 2500 },
+    };
+    const move_t moves[6] = {
+        move_make(SQ_E2, SQ_E4, 0), move_make(SQ_D2, SQ_D4, 0), move_make(SQ_E2, SQ_E4, 0),
+        move_make(SQ_C2, SQ_C4, 0), move_make(SQ_D2, SQ_D4, 0), move_make(SQ_E2, SQ_E4, 0),
+    };
+    const int wdl[6] = { 1, 0, -1, 1, 1, 0 };
+
+    // All at once, and in two halves merged afterwards.
+    struct master_record *all = master_record_new();
+    struct master_record *first = master_record_new();
+    struct master_record *second = master_record_new();
+    for (int i = 0; i < 6; i++) {
+        master_record_add_move(all, moves[i], &refs[i], wdl[i]);
+        master_record_add_move(i < 3 ? first : second, moves[i], &refs[i], wdl[i]);
+    }
+    master_record_merge(first, second);
+
+    assert(first->num_moves == 3 && first->num_refs == MASTER_MAX_REFS);
+    assert(master_record_white(first) == master_record_white(all));
+    assert(master_record_draws(first) == master_record_draws(all));
+    assert(master_record_black(first) == master_record_black(all));
+    assert(master_record_average_rating_sum(first) == master_record_average_rating_sum(all));
+    assert(first->moves[0].move == move_make(SQ_E2, SQ_E4, 0));
+    assert(first->moves[0].white == 1 && first->moves[0].draws == 1 && first->moves[0].black == 1);
+    for (int i = 0; i < MASTER_MAX_REFS; i++) {
+        assert(memcmp(first->refs[i].game_id, all->refs[i].game_id, 8) == 0);
+    }
+
+    // Ties are broken the same way, whatever the order.
+    struct master_record *reversed = master_record_new();
+    for (int i = 5; i >= 0; i--) master_record_add_move(reversed, moves[i], &refs[i], wdl[i]);
+
+    uint8_t buffer[255], reversed_buffer[255], merged_buffer[255];
+    size_t size = encode_master_record(buffer, all) - buffer;
+    assert(size == encode_master_record(reversed_buffer, reversed) - reversed_buffer);
+    assert(size == encode_master_record(merged_buffer, first) - merged_buffer);
+    assert(memcmp(buffer, reversed_buffer, size) == 0);
+    assert(memcmp(buffer, merged_buffer, size) == 0);
+
+    master_record_free(all);
+    master_record_free(first);
+    master_record_free(second);
+    master_record_free(reversed);
+}
+
 int main() {
     test_encode_uint();
     test_encode_game_id();
+    test_game_id_number();
     test_master_record();
+    test_master_record_merge();
     return 0;
 }
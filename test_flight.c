@@ -0,0 +1,34 @@
+#include <stdio.h>
+#include <assert.h>
+
+#include "flight.h"
+
+void test_flight_coalesce() {
+    puts("test_flight_coalesce");
+
+    struct flight *flight = flight_new();
+    struct iopool_job jobs[4] = {};
+
+    assert(flight_join(flight, "a", 1, &jobs[0]));
+    assert(!flight_join(flight, "a", 1, &jobs[1]));
+    assert(flight_join(flight, "b", 1, &jobs[2]));
+    assert(!flight_join(flight, "a", 1, &jobs[3]));
+
+    struct iopool_job *waiters = flight_land(flight, "a", 1);
+    assert(waiters == &jobs[1]);
+    assert(waiters->next == &jobs[3]);
+    assert(!waiters->next->next);
+
+    assert(!flight_land(flight, "b", 1));
+
+    // Landed keys start a new flight.
+    assert(flight_join(flight, "a", 1, &jobs[0]));
+    assert(!flight_land(flight, "a", 1));
+
+    flight_free(flight);
+}
+
+int main() {
+    test_flight_coalesce();
+    return 0;
+}
@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "gameinfo.h"
+
+void test_gameinfo_roundtrip() {
+    puts("test_gameinfo_roundtrip");
+
+    char path[] = "/tmp/test_gameinfo_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+
+    struct gameinfo_writer *writer = gameinfo_writer_new();
+
+    char white[] = "Carlsen, Magnus", black[] = "Aronian, Levon";
+    struct pgn_game_info game_info = { white, black, 2826, 2805, 2010, -1 };
+    gameinfo_writer_add(writer, "BE73q6WU", &game_info);
+
+    // Same players again, names are interned.
+    game_info.white = black;
+    game_info.black = white;
+    game_info.result = 0;
+    gameinfo_writer_add(writer, "000ZABE7", &game_info);
+
+    // Games without names are skipped.
+    game_info.white = NULL;
+    gameinfo_writer_add(writer, "aaaaaaaa", &game_info);
+
+    char name[1000];
+    memset(name, 'x', sizeof(name) - 1);
+    name[sizeof(name) - 1] = 0;
+    for (int i = 0; i < 2000; i++) {
+        char game_id[9];
+        snprintf(game_id, sizeof(game_id), "%08d", i);
+        name[i % 900] = 'a' + (i % 26);
+        struct pgn_game_info other = { name, black, 2000, 2000, 2000, 1 };
+        gameinfo_writer_add(writer, game_id, &other);
+    }
+
+    assert(gameinfo_writer_write(writer, path));
+    gameinfo_writer_free(writer);
+
+    struct gameinfo_table *table = gameinfo_open(path);
+    assert(table);
+    assert(gameinfo_size(table) == 2002);
+
+    const struct gameinfo_entry *entry = gameinfo_find(table, "BE73q6WU");
+    assert(entry);
+    assert(strcmp(gameinfo_string(table, entry->white), "Carlsen, Magnus") == 0);
+    assert(strcmp(gameinfo_string(table, entry->black), "Aronian, Levon") == 0);
+    assert(entry->white_elo == 2826);
+    assert(entry->year == 2010);
+    assert(entry->result == -1);
+
+    const struct gameinfo_entry *other = gameinfo_find(table, "000ZABE7");
+    assert(other);
+    assert(other->white == entry->black);
+    assert(other->black == entry->white);
+    assert(other->result == 0);
+
+    assert(!gameinfo_find(table, "aaaaaaaa"));
+    assert(gameinfo_find(table, "00001999"));
+
+    gameinfo_close(table);
+    unlink(path);
+}
+
+int main() {
+    test_gameinfo_roundtrip();
+    return 0;
+}
@@ -0,0 +1,309 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <kclangc.h>
+#include <zlib.h>
+#include <zstd.h>
+
+#include "attacks.h"
+#include "board.h"
+
+// Runs the index_master binary on the same games in different ways and
+// compares the resulting records.
+
+static const int NUM_GAMES = 1000;
+
+// Game g of a fixed sequence, optionally with a lichess URL.
+static int make_game(int g, bool site, const char *newline, char *pgn, size_t capacity) {
+    static const char *const RESULTS[] = { "1-0", "0-1", "1/2-1/2" };
+
+    srand(g + 1);
+    const char *result = RESULTS[rand() % 3];
+
+    // Few distinct ratings and openings, so that there are ties.
+    int len = snprintf(pgn, capacity, "[Result \"%s\"]%s", result, newline);
+    if (site) len += snprintf(pgn + len, capacity - len, "[Site \"https://lichess.org/%08d\"]%s", g, newline);
+    len += snprintf(pgn + len, capacity - len, "[WhiteElo \"%d\"]%s[BlackElo \"%d\"]%s%s",
+                    2500 + rand() % 4 * 10, newline, 2500 + rand() % 4 * 10, newline, newline);
+
+    board_t pos;
+    board_reset(&pos);
+    for (int ply = 0; ply < 30; ply++) {
+        move_t moves[256];
+        size_t num_moves = board_legal_moves(&pos, moves, ~0ULL, ~0ULL) - moves;
+        if (!num_moves) break;
+
+        move_t move = moves[rand() % (num_moves < 3 ? num_moves : 3)];
+        char san[LEN_SAN];
+        board_san(&pos, move, san);
+        if (pos.turn) len += snprintf(pgn + len, capacity - len, "%d. ", pos.fmvn);
+        len += snprintf(pgn + len, capacity - len, "%s ", san);
+        board_move(&pos, move);
+    }
+    len += snprintf(pgn + len, capacity - len, "%s%s", result, newline);
+    return len;
+}
+
+// Adds games from..to-1 to master-pgn.kct.
+static void write_games(const char *path, int from, int to) {
+    KCDB *db = kcdbnew();
+    assert(kcdbopen(db, path, KCOWRITER | KCOCREATE));
+
+    for (int g = from; g < to; g++) {
+        char game_id[9];
+        snprintf(game_id, sizeof(game_id), "%08d", g);
+
+        char pgn[4096];
+        int len = make_game(g, false, "\n", pgn, sizeof(pgn));
+        assert(kcdbset(db, game_id, 8, pgn, len));
+    }
+
+    assert(kcdbclose(db));
+    kcdbdel(db);
+}
+
+// Writes games from..to-1 to a .pgn, .pgn.gz or .pgn.zst file. Every other
+// game has a lichess URL.
+static void write_pgn_file(const char *path, int from, int to, const char *newline) {
+    char *pgn = malloc((to - from) * 4096);
+    assert(pgn);
+
+    size_t size = 0;
+    for (int g = from; g < to; g++) {
+        size += make_game(g, g % 2 == 0, newline, pgn + size, 4096 - strlen(newline));
+        size += sprintf(pgn + size, "%s", newline);
+    }
+
+    size_t path_size = strlen(path);
+    if (path_size > 3 && strcmp(path + path_size - 3, ".gz") == 0) {
+        gzFile gz = gzopen(path, "wb");
+        assert(gz);
+        assert(gzwrite(gz, pgn, size) == size);
+        assert(gzclose(gz) == Z_OK);
+    } else {
+        FILE *file = fopen(path, "wb");
+        assert(file);
+
+        if (path_size > 4 && strcmp(path + path_size - 4, ".zst") == 0) {
+            char *compressed = malloc(ZSTD_compressBound(size));
+            assert(compressed);
+            size_t compressed_size = ZSTD_compress(compressed, ZSTD_compressBound(size), pgn, size, 3);
+            assert(!ZSTD_isError(compressed_size));
+            assert(compressed_size == fwrite(compressed, 1, compressed_size, file));
+            free(compressed);
+        } else {
+            assert(size == fwrite(pgn, 1, size, file));
+        }
+
+        assert(fclose(file) == 0);
+    }
+
+    free(pgn);
+}
+
+// Returns the exit status. Output goes to index_master.log.
+static int run_index_master(const char *dir, const char *args) {
+    char cwd[4096], command[8192];
+    assert(getcwd(cwd, sizeof(cwd)));
+    snprintf(command, sizeof(command), "cd %s && %s/index_master %s > index_master.log", dir, cwd, args);
+    return system(command);
+}
+
+static bool log_contains(const char *dir, const char *text) {
+    char path[4096], log[65536] = {};
+    snprintf(path, sizeof(path), "%s/index_master.log", dir);
+
+    FILE *file = fopen(path, "r");
+    assert(file);
+    fread(log, 1, sizeof(log) - 1, file);
+    assert(fclose(file) == 0);
+
+    return strstr(log, text) != NULL;
+}
+
+struct compare {
+    KCDB *other;
+    size_t num_records;
+};
+
+static const char *compare_record(const char *key, size_t key_size,
+                                  const char *value, size_t value_size,
+                                  size_t *sp, void *opq) {
+    struct compare *compare = opq;
+    compare->num_records++;
+
+    size_t other_size;
+    char *other_value = kcdbget(compare->other, key, key_size, &other_size);
+    assert(other_value);
+    assert(other_size == value_size);
+    assert(memcmp(other_value, value, value_size) == 0);
+    kcfree(other_value);
+
+    return KCVISNOP;
+}
+
+static void compare_master(const char *serial_path, const char *parallel_path) {
+    KCDB *serial = kcdbnew(), *parallel = kcdbnew();
+    assert(kcdbopen(serial, serial_path, KCOREADER));
+    assert(kcdbopen(parallel, parallel_path, KCOREADER));
+
+    struct compare compare = { parallel, 0 };
+    assert(kcdbiterate(serial, compare_record, &compare, false));
+    assert(compare.num_records > (size_t) NUM_GAMES);
+    assert(kcdbcount(parallel) == (int64_t) compare.num_records);
+
+    assert(kcdbclose(serial));
+    assert(kcdbclose(parallel));
+    kcdbdel(serial);
+    kcdbdel(parallel);
+}
+
+void test_index_master_parallel() {
+    puts("test_index_master_parallel");
+
+    char dir[] = "/tmp/test_index_master.XXXXXX";
+    assert(mkdtemp(dir));
+
+    char path[4096], serial[4096], parallel[4096], command[8192];
+    snprintf(serial, sizeof(serial), "%s/serial", dir);
+    snprintf(parallel, sizeof(parallel), "%s/parallel", dir);
+    assert(mkdir(serial, 0755) == 0 && mkdir(parallel, 0755) == 0);
+
+    snprintf(path, sizeof(path), "%s/master-pgn.kct", serial);
+    write_games(path, 0, NUM_GAMES);
+    snprintf(path, sizeof(path), "%s/master-pgn.kct", parallel);
+    write_games(path, 0, NUM_GAMES);
+
+    assert(run_index_master(serial, "-j 1") == 0);
+    assert(run_index_master(parallel, "-j 3 -M 1") == 0);
+
+    char serial_path[4096], parallel_path[4096];
+    snprintf(serial_path, sizeof(serial_path), "%s/master.kch", serial);
+    snprintf(parallel_path, sizeof(parallel_path), "%s/master.kch", parallel);
+    compare_master(serial_path, parallel_path);
+
+    snprintf(command, sizeof(command), "rm -r %s", dir);
+    assert(system(command) == 0);
+}
+
+// Includes the indexed-games key.
+void test_index_master_update() {
+    puts("test_index_master_update");
+
+    char dir[] = "/tmp/test_index_master.XXXXXX";
+    assert(mkdtemp(dir));
+
+    char path[4096], full[4096], update[4096], command[8192];
+    snprintf(full, sizeof(full), "%s/full", dir);
+    snprintf(update, sizeof(update), "%s/update", dir);
+    assert(mkdir(full, 0755) == 0 && mkdir(update, 0755) == 0);
+
+    snprintf(path, sizeof(path), "%s/master-pgn.kct", full);
+    write_games(path, 0, NUM_GAMES);
+    assert(run_index_master(full, "-j 2") == 0);
+
+    snprintf(path, sizeof(path), "%s/master-pgn.kct", update);
+    write_games(path, 0, NUM_GAMES / 2);
+    assert(run_index_master(update, "-j 2") == 0);
+    write_games(path, NUM_GAMES / 2, NUM_GAMES);
+    assert(run_index_master(update, "-u -j 3 -M 1") == 0);
+
+    char full_path[4096], update_path[4096];
+    snprintf(full_path, sizeof(full_path), "%s/master.kch", full);
+    snprintf(update_path, sizeof(update_path), "%s/master.kch", update);
+    compare_master(full_path, update_path);
+
+    // Nothing new.
+    assert(run_index_master(update, "-u -j 2") == 0);
+    compare_master(full_path, update_path);
+
+    snprintf(command, sizeof(command), "rm -r %s", dir);
+    assert(system(command) == 0);
+}
+
+static const char *count_synthetic(const char *key, size_t key_size,
+                                   const char *value, size_t value_size,
+                                   size_t *sp, void *opq) {
+    if (key[0] == '_') (*(size_t *) opq)++;
+    return KCVISNOP;
+}
+
+void test_index_master_files() {
+    puts("test_index_master_files");
+
+    char dir[] = "/tmp/test_index_master.XXXXXX";
+    assert(mkdtemp(dir));
+
+    char path[4096], files[4096], crlf[4096], command[8192];
+    snprintf(files, sizeof(files), "%s/files", dir);
+    snprintf(crlf, sizeof(crlf), "%s/crlf", dir);
+    assert(mkdir(files, 0755) == 0 && mkdir(crlf, 0755) == 0);
+
+    snprintf(path, sizeof(path), "%s/games.pgn", files);
+    write_pgn_file(path, 0, 333, "\n");
+    snprintf(path, sizeof(path), "%s/games.pgn.gz", files);
+    write_pgn_file(path, 333, 666, "\n");
+    snprintf(path, sizeof(path), "%s/games.pgn.zst", files);
+    write_pgn_file(path, 666, NUM_GAMES, "\n");
+
+    assert(run_index_master(files, "-j 2 games.pgn games.pgn.gz games.pgn.zst") == 0);
+    assert(log_contains(files, "games.pgn: 333 games, 0 already in master-pgn.kct"));
+    assert(log_contains(files, "games.pgn.zst: 334 games, 0 already in master-pgn.kct"));
+
+    char first_path[4096], master_path[4096];
+    snprintf(first_path, sizeof(first_path), "%s/master.kch.first", files);
+    snprintf(master_path, sizeof(master_path), "%s/master.kch", files);
+    snprintf(command, sizeof(command), "cp %s %s", master_path, first_path);
+    assert(system(command) == 0);
+
+    // Ingesting the same files again finds only duplicates.
+    assert(run_index_master(files, "-u -j 2 games.pgn games.pgn.gz games.pgn.zst") == 0);
+    assert(log_contains(files, "games.pgn: 0 games, 333 already in master-pgn.kct"));
+    assert(log_contains(files, "games.pgn.gz: 0 games, 333 already in master-pgn.kct"));
+    assert(log_contains(files, "games.pgn.zst: 0 games, 334 already in master-pgn.kct"));
+    assert(log_contains(files, "indexed 0 new games, skipped 1000 already in master.kch."));
+    compare_master(first_path, master_path);
+
+    // A truncated file fails the run.
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/games.pgn.zst", files);
+    assert(stat(path, &st) == 0 && truncate(path, st.st_size / 2) == 0);
+    assert(run_index_master(files, "-u games.pgn.zst") != 0);
+    assert(log_contains(files, "games.pgn.zst: read error"));
+    compare_master(first_path, master_path);
+
+    // Games without a lichess URL get ids from their text, regardless of
+    // line endings and the order of the files.
+    snprintf(path, sizeof(path), "%s/games.pgn", crlf);
+    write_pgn_file(path, 0, NUM_GAMES, "\r\n");
+    assert(run_index_master(crlf, "-j 3 games.pgn") == 0);
+
+    char crlf_path[4096];
+    snprintf(crlf_path, sizeof(crlf_path), "%s/master.kch", crlf);
+    compare_master(first_path, crlf_path);
+
+    KCDB *master_pgn_db = kcdbnew();
+    snprintf(path, sizeof(path), "%s/master-pgn.kct", crlf);
+    assert(kcdbopen(master_pgn_db, path, KCOREADER));
+    size_t num_synthetic = 0;
+    assert(kcdbiterate(master_pgn_db, count_synthetic, &num_synthetic, false));
+    assert(num_synthetic == NUM_GAMES / 2);
+    assert(kcdbcount(master_pgn_db) == NUM_GAMES);
+    assert(kcdbclose(master_pgn_db));
+    kcdbdel(master_pgn_db);
+
+    snprintf(command, sizeof(command), "rm -r %s", dir);
+    assert(system(command) == 0);
+}
+
+int main() {
+    attacks_init();
+    test_index_master_parallel();
+    test_index_master_update();
+    test_index_master_files();
+    return 0;
+}
@@ -0,0 +1,245 @@
+#include <stdio.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+
+#include <event2/event.h>
+#include <event2/thread.h>
+
+#include "iopool.h"
+
+struct test_job {
+    struct iopool_job job;
+    int index;
+    pthread_t ran_on;
+    int *completed;
+    struct event_base *base;
+};
+
+static pthread_t loop_thread;
+
+static void test_timeout(evutil_socket_t fd, short events, void *arg) {
+    assert(false);
+}
+
+static void test_job_run(struct iopool_job *job) {
+    struct test_job *test = (struct test_job *) job;
+    test->ran_on = pthread_self();
+}
+
+static void test_job_done(struct iopool_job *job) {
+    struct test_job *test = (struct test_job *) job;
+    assert(pthread_equal(pthread_self(), loop_thread));
+    assert(!pthread_equal(test->ran_on, loop_thread));
+    if (++*test->completed == 100) event_base_loopexit(test->base, NULL);
+}
+
+void test_iopool_complete_on_loop() {
+    puts("test_iopool_complete_on_loop");
+
+    struct event_base *base = event_base_new();
+    assert(base);
+    loop_thread = pthread_self();
+
+    struct iopool *pool = iopool_new(4, 128);
+    struct iopool_loop *loop = iopool_loop_new(base);
+
+    int completed = 0;
+    struct test_job jobs[100];
+    for (int i = 0; i < 100; i++) {
+        jobs[i].job.run = test_job_run;
+        jobs[i].job.done = test_job_done;
+        jobs[i].index = i;
+        jobs[i].completed = &completed;
+        jobs[i].base = base;
+        assert(iopool_submit(pool, loop, &jobs[i].job));
+    }
+
+    // Keeps the loop alive until all completions arrived.
+    struct event *timeout = evtimer_new(base, test_timeout, NULL);
+    struct timeval tv = { 10, 0 };
+    evtimer_add(timeout, &tv);
+
+    event_base_dispatch(base);
+    assert(completed == 100);
+    event_free(timeout);
+
+    iopool_free(pool);
+    iopool_loop_free(loop);
+    event_base_free(base);
+}
+
+static pthread_mutex_t block = PTHREAD_MUTEX_INITIALIZER;
+static bool running = false;
+
+static void blocking_run(struct iopool_job *job) {
+    __atomic_store_n(&running, true, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&block);
+    pthread_mutex_unlock(&block);
+}
+
+static void blocking_done(struct iopool_job *job) {
+}
+
+void test_iopool_bounded() {
+    puts("test_iopool_bounded");
+
+    struct event_base *base = event_base_new();
+    assert(base);
+
+    struct iopool *pool = iopool_new(1, 2);
+    struct iopool_loop *loop = iopool_loop_new(base);
+
+    struct iopool_job jobs[4] = {};
+    for (int i = 0; i < 4; i++) {
+        jobs[i].run = blocking_run;
+        jobs[i].done = blocking_done;
+    }
+
+    // One job blocks the only thread, two more fill the queue.
+    pthread_mutex_lock(&block);
+    assert(iopool_submit(pool, loop, &jobs[0]));
+    while (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) sched_yield();
+    assert(iopool_submit(pool, loop, &jobs[1]));
+    assert(iopool_submit(pool, loop, &jobs[2]));
+    assert(!iopool_submit(pool, loop, &jobs[3]));
+    pthread_mutex_unlock(&block);
+
+    iopool_free(pool);
+    iopool_loop_free(loop);
+    event_base_free(base);
+}
+
+static int run_order[2];
+static int num_run = 0;
+
+static void ordered_run(struct iopool_job *job) {
+    // Only one pool thread.
+    run_order[num_run] = job->priority;
+    __atomic_store_n(&num_run, num_run + 1, __ATOMIC_RELEASE);
+}
+
+void test_iopool_priority() {
+    puts("test_iopool_priority");
+
+    struct event_base *base = event_base_new();
+    assert(base);
+
+    struct iopool *pool = iopool_new(1, 1);
+    struct iopool_loop *loop = iopool_loop_new(base);
+
+    struct iopool_job jobs[4] = {};
+    for (int i = 0; i < 4; i++) jobs[i].done = blocking_done;
+    jobs[0].run = blocking_run;
+    jobs[1].run = jobs[2].run = jobs[3].run = ordered_run;
+    jobs[2].priority = jobs[3].priority = true;
+
+    // The normal queue is full, the priority lane still takes a job, and
+    // it overtakes.
+    __atomic_store_n(&running, false, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&block);
+    assert(iopool_submit(pool, loop, &jobs[0]));
+    while (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) sched_yield();
+    assert(iopool_submit(pool, loop, &jobs[1]));
+    assert(iopool_submit(pool, loop, &jobs[2]));
+    assert(!iopool_submit(pool, loop, &jobs[3]));
+    pthread_mutex_unlock(&block);
+
+    while (__atomic_load_n(&num_run, __ATOMIC_ACQUIRE) < 2) sched_yield();
+    assert(run_order[0] == 1 && run_order[1] == 0);
+
+    iopool_free(pool);
+    iopool_loop_free(loop);
+    event_base_free(base);
+}
+
+static int background_order[2];
+static int num_background_run = 0;
+
+static void background_run(struct iopool_job *job) {
+    // Only one pool thread.
+    background_order[num_background_run] = job->background;
+    __atomic_store_n(&num_background_run, num_background_run + 1, __ATOMIC_RELEASE);
+}
+
+void test_iopool_background() {
+    puts("test_iopool_background");
+
+    struct event_base *base = event_base_new();
+    assert(base);
+
+    struct iopool *pool = iopool_new(1, 1);
+    struct iopool_loop *loop = iopool_loop_new(base);
+
+    struct iopool_job jobs[4] = {};
+    for (int i = 0; i < 4; i++) jobs[i].done = blocking_done;
+    jobs[0].run = blocking_run;
+    jobs[1].run = jobs[2].run = jobs[3].run = background_run;
+    jobs[1].background = jobs[2].background = true;
+
+    // Background jobs have a queue of their own, and wait for jobs that
+    // were submitted after them.
+    __atomic_store_n(&running, false, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&block);
+    assert(iopool_submit(pool, loop, &jobs[0]));
+    while (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) sched_yield();
+    assert(iopool_submit(pool, loop, &jobs[1]));
+    assert(!iopool_submit(pool, loop, &jobs[2]));
+    assert(iopool_submit(pool, loop, &jobs[3]));
+    pthread_mutex_unlock(&block);
+
+    while (__atomic_load_n(&num_background_run, __ATOMIC_ACQUIRE) < 2) sched_yield();
+    assert(background_order[0] == 0 && background_order[1] == 1);
+
+    iopool_free(pool);
+    iopool_loop_free(loop);
+    event_base_free(base);
+}
+
+static int handed_back = 0;
+
+static void handed_back_done(struct iopool_job *job) {
+    assert(pthread_equal(pthread_self(), loop_thread));
+    handed_back++;
+}
+
+static void *hand_back(void *arg) {
+    iopool_complete(arg);
+    return NULL;
+}
+
+void test_iopool_complete_foreign() {
+    puts("test_iopool_complete_foreign");
+
+    struct event_base *base = event_base_new();
+    assert(base);
+    loop_thread = pthread_self();
+
+    struct iopool_loop *loop = iopool_loop_new(base);
+
+    // Never submitted, completed from another thread.
+    struct iopool_job job = {};
+    job.done = handed_back_done;
+    job.loop = loop;
+
+    pthread_t thread;
+    assert(!pthread_create(&thread, NULL, hand_back, &job));
+    pthread_join(thread, NULL);
+
+    event_base_loop(base, EVLOOP_ONCE);
+    assert(handed_back == 1);
+
+    iopool_loop_free(loop);
+    event_base_free(base);
+}
+
+int main() {
+    evthread_use_pthreads();
+    test_iopool_complete_on_loop();
+    test_iopool_bounded();
+    test_iopool_priority();
+    test_iopool_background();
+    test_iopool_complete_foreign();
+    return 0;
+}
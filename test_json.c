@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <string.h>
+#include <limits.h>
+
+#include "json.h"
+
+static bool json_equals(const struct json *json, const char *expected) {
+    return json->size == strlen(expected) && memcmp(json->data, expected, json->size) == 0;
+}
+
+void test_json_int() {
+    puts("test_json_int");
+
+    struct json json = {};
+
+    json_clear(&json);
+    json_uint(&json, 0);
+    assert(json_equals(&json, "0"));
+
+    json_clear(&json);
+    json_uint(&json, 1234567890UL);
+    json_literal(&json, ",");
+    json_int(&json, -42);
+    assert(json_equals(&json, "1234567890,-42"));
+
+    char expected[32];
+    json_clear(&json);
+    json_uint(&json, ULONG_MAX);
+    snprintf(expected, sizeof(expected), "%lu", ULONG_MAX);
+    assert(json_equals(&json, expected));
+
+    json_clear(&json);
+    json_int(&json, LONG_MIN);
+    snprintf(expected, sizeof(expected), "%ld", LONG_MIN);
+    assert(json_equals(&json, expected));
+
+    json_free(&json);
+}
+
+void test_json_string() {
+    puts("test_json_string");
+
+    struct json json = {};
+
+    json_clear(&json);
+    json_string(&json, "Carlsen, Magnus");
+    assert(json_equals(&json, "\"Carlsen, Magnus\""));
+
+    json_clear(&json);
+    json_string(&json, "a \"quote\" and a \\ backslash\n\x01");
+    assert(json_equals(&json, "\"a \\\"quote\\\" and a \\\\ backslash\\n\\u0001\""));
+
+    // UTF-8 passes through.
+    json_clear(&json);
+    json_string(&json, "Gukesh D \xc3\xa9");
+    assert(json_equals(&json, "\"Gukesh D \xc3\xa9\""));
+
+    json_free(&json);
+}
+
+void test_json_grow() {
+    puts("test_json_grow");
+
+    struct json json = {};
+    json_clear(&json);
+    for (int i = 0; i < 100000; i++) json_literal(&json, "abcdefghij");
+    assert(json.size == 1000000);
+    assert(json.data[999999] == 'j');
+    json_free(&json);
+}
+
+int main() {
+    test_json_int();
+    test_json_string();
+    test_json_grow();
+    return 0;
+}
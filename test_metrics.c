@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+
+#include "metrics.h"
+
+void test_histogram_exact() {
+    puts("test_histogram_exact");
+
+    struct histogram *histogram = calloc(1, sizeof(struct histogram));
+    for (uint64_t i = 0; i < 16; i++) histogram_record(histogram, i);
+
+    assert(histogram->count == 16);
+    assert(histogram->sum == 120);
+    assert(histogram_quantile(histogram, 0) == 0);
+    assert(histogram_quantile(histogram, 0.5) == 8);
+    assert(histogram_quantile(histogram, 1) == 15);
+    assert(histogram_count_below(histogram, 3) == 8);
+    assert(histogram_count_below(histogram, 4) == 16);
+
+    free(histogram);
+}
+
+void test_histogram_relative_error() {
+    puts("test_histogram_relative_error");
+
+    const uint64_t values[] = { 17, 1000, 123456, 999999999, 1ULL << 40, UINT64_MAX };
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        struct histogram *histogram = calloc(1, sizeof(struct histogram));
+        histogram_record(histogram, values[i]);
+
+        uint64_t approx = histogram_quantile(histogram, 0.5);
+        uint64_t error = approx > values[i] ? approx - values[i] : values[i] - approx;
+        assert(error <= values[i] / 16);
+
+        free(histogram);
+    }
+}
+
+void test_histogram_merge() {
+    puts("test_histogram_merge");
+
+    struct histogram *a = calloc(1, sizeof(struct histogram));
+    struct histogram *b = calloc(1, sizeof(struct histogram));
+    struct histogram *total = calloc(1, sizeof(struct histogram));
+
+    for (uint64_t i = 0; i < 990; i++) histogram_record(a, 1000);
+    for (uint64_t i = 0; i < 10; i++) histogram_record(b, 1000000);
+
+    histogram_merge(total, a);
+    histogram_merge(total, b);
+    assert(total->count == 1000);
+    assert(histogram_quantile(total, 0.5) < 1100);
+    assert(histogram_quantile(total, 0.999) > 900000);
+    assert(histogram_count_below(total, 10) == 990);
+    assert(histogram_count_below(total, 20) == 1000);
+
+    free(a);
+    free(b);
+    free(total);
+}
+
+int main() {
+    test_histogram_exact();
+    test_histogram_relative_error();
+    test_histogram_merge();
+    return 0;
+}
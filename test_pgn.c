@@ -20,9 +20,48 @@ void test_pgn_read_game() {
     pgn_game_info_free(game_info);
 }
 
+void test_pgn_read_escaped() {
+    puts("test_pgn_read_escaped");
+    char pgn[] = "[White \"Karpov, \\\"Anatoly\\\"\"]\n[Black \"back\\\\slash\"]\n";
+
+    char *save_ptr;
+    struct pgn_game_info *game_info = pgn_game_info_read(pgn, &save_ptr);
+
+    puts(game_info->white);
+    assert(strcmp(game_info->white, "Karpov, \"Anatoly\"") == 0);
+    assert(strcmp(game_info->black, "back\\slash") == 0);
+
+    pgn_game_info_free(game_info);
+}
+
+void test_pgn_movetext() {
+    puts("test_pgn_movetext");
+    const char pgn[] = "[Event \"A\"]\r\n[Result \"1-0\"]\r\n\r\n"
+                       "1. e4 { 1. d4 } e5 (1... c5 2. Nf3 (2. c3) d6) 2. Nf3! $1 ; Nc3\r\n"
+                       "2... Nc6?! {(} 3. Bb5 Qh4xf2# 1-0";
+    static const char *const SANS[] = { "e4", "e5", "Nf3", "Nc6", "Bb5", NULL };
+    static const char *const TOKENS[] = { "e4", "e5", "Nf3!", "Nc6?!", "Bb5", "Qh4xf2#" };
+
+    struct pgn_movetext movetext = { pgn_skip_headers(pgn, pgn + strlen(pgn)), pgn + strlen(pgn), 0 };
+    assert(movetext.pgn[0] == '1');
+
+    char san[6];
+    const char *token;
+    size_t token_size;
+    for (size_t i = 0; i < 6; i++) {
+        assert(pgn_movetext_next(&movetext, san, sizeof(san), &token, &token_size));
+        assert(token_size == strlen(TOKENS[i]) && memcmp(token, TOKENS[i], token_size) == 0);
+        if (SANS[i]) assert(strcmp(san, SANS[i]) == 0);
+        else assert(!san[0]);  // does not fit
+    }
+    assert(!pgn_movetext_next(&movetext, san, sizeof(san), &token, &token_size));
+}
+
 int main() {
     attacks_init();
 
     test_pgn_read_game();
+    test_pgn_read_escaped();
+    test_pgn_movetext();
     return 0;
 }
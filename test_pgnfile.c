@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <zlib.h>
+#include <zstd.h>
+
+#include "pgnfile.h"
+
+static const char *const GAMES[] = {
+    "[Event \"A\"]\n[Result \"1-0\"]\n\n1. e4 e5 2. Nf3 { [%clk 0:01:00] } Nc6 1-0",
+    "[Event \"B\"]\r\n[Result \"0-1\"]\r\n\r\n1. d4 d5\r\n2. c4 0-1",
+    "[Event \"C\"]\n[Result \"*\"]\n1. c4 *",
+};
+
+static const size_t NUM_GAMES = 3;
+
+// Separated by varying blank lines, without a trailing newline.
+static char *make_pgn(size_t repeat, size_t *size) {
+    size_t capacity = 1024;
+    for (size_t i = 0; i < NUM_GAMES; i++) capacity += repeat * (strlen(GAMES[i]) + 4);
+
+    char *pgn = malloc(capacity);
+    assert(pgn);
+
+    *size = 0;
+    *size += sprintf(pgn + *size, "\n\n");
+    for (size_t r = 0; r < repeat; r++) {
+        for (size_t i = 0; i < NUM_GAMES; i++) {
+            *size += sprintf(pgn + *size, "%s%s", GAMES[i], (r + i) % 2 ? "\n\n" : "\n\n\n");
+        }
+    }
+    while (pgn[*size - 1] == '\n') (*size)--;
+    return pgn;
+}
+
+static void write_file(const char *path, const char *data, size_t size) {
+    FILE *file = fopen(path, "wb");
+    assert(file);
+    assert(size == fwrite(data, 1, size, file));
+    assert(fclose(file) == 0);
+}
+
+static void check_games(const char *path, size_t repeat) {
+    struct pgnfile *file = pgnfile_open(path);
+    assert(file);
+
+    const char *game;
+    size_t size;
+    for (size_t r = 0; r < repeat; r++) {
+        for (size_t i = 0; i < NUM_GAMES; i++) {
+            assert(pgnfile_next(file, &game, &size));
+            assert(size == strlen(GAMES[i]));
+            assert(memcmp(game, GAMES[i], size) == 0);
+        }
+    }
+
+    assert(!pgnfile_next(file, &game, &size));
+    assert(pgnfile_ok(file));
+    pgnfile_close(file);
+}
+
+void test_pgnfile_plain() {
+    puts("test_pgnfile_plain");
+
+    size_t size;
+    char *pgn = make_pgn(3, &size);
+    write_file("/tmp/test_pgnfile.pgn", pgn, size);
+    check_games("/tmp/test_pgnfile.pgn", 3);
+    free(pgn);
+
+    write_file("/tmp/test_pgnfile.pgn", "", 0);
+    check_games("/tmp/test_pgnfile.pgn", 0);
+
+    unlink("/tmp/test_pgnfile.pgn");
+    assert(!pgnfile_open("/tmp/test_pgnfile.pgn"));
+}
+
+void test_pgnfile_gzip() {
+    puts("test_pgnfile_gzip");
+
+    // Spans several blocks.
+    size_t size;
+    char *pgn = make_pgn(20000, &size);
+
+    gzFile gz = gzopen("/tmp/test_pgnfile.pgn.gz", "wb");
+    assert(gz);
+    assert(gzwrite(gz, pgn, size) == size);
+    assert(gzclose(gz) == Z_OK);
+
+    check_games("/tmp/test_pgnfile.pgn.gz", 20000);
+    unlink("/tmp/test_pgnfile.pgn.gz");
+    free(pgn);
+}
+
+void test_pgnfile_zstd() {
+    puts("test_pgnfile_zstd");
+
+    size_t size;
+    char *pgn = make_pgn(20000, &size);
+
+    char *compressed = malloc(ZSTD_compressBound(size));
+    assert(compressed);
+    size_t compressed_size = ZSTD_compress(compressed, ZSTD_compressBound(size), pgn, size, 3);
+    assert(!ZSTD_isError(compressed_size));
+
+    write_file("/tmp/test_pgnfile.pgn.zst", compressed, compressed_size);
+    check_games("/tmp/test_pgnfile.pgn.zst", 20000);
+
+    // Truncated.
+    write_file("/tmp/test_pgnfile.pgn.zst", compressed, compressed_size / 2);
+    struct pgnfile *file = pgnfile_open("/tmp/test_pgnfile.pgn.zst");
+    assert(file);
+    const char *game;
+    while (pgnfile_next(file, &game, &size));
+    assert(!pgnfile_ok(file));
+    pgnfile_close(file);
+
+    unlink("/tmp/test_pgnfile.pgn.zst");
+    free(compressed);
+    free(pgn);
+}
+
+int main() {
+    test_pgnfile_plain();
+    test_pgnfile_gzip();
+    test_pgnfile_zstd();
+    return 0;
+}
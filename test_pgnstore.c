@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pgnstore.h"
+
+void test_pgnstore_roundtrip() {
+    puts("test_pgnstore_roundtrip");
+
+    char path[] = "/tmp/test_pgnstore_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+
+    struct pgnstore_writer *writer = pgnstore_writer_open(path);
+    assert(writer);
+
+    const char *pgn_1 = "[Result \"1-0\"]\n\n1. e4 1-0\n";
+    const char *pgn_2 = "[Result \"0-1\"]\n\n1. d4 0-1\n";
+    assert(pgnstore_writer_add(writer, "zzzzzzzz", pgn_1, strlen(pgn_1)));
+    assert(pgnstore_writer_add(writer, "00000001", pgn_2, strlen(pgn_2)));
+    assert(!pgnstore_writer_add(writer, "0000-001", pgn_2, strlen(pgn_2)));
+    assert(pgnstore_writer_close(writer));
+
+    struct pgnstore *store = pgnstore_open(path);
+    assert(store);
+    assert(pgnstore_size(store) == 2);
+
+    size_t size;
+    const char *pgn = pgnstore_find(store, "zzzzzzzz", &size);
+    assert(pgn);
+    assert(size == strlen(pgn_1) && memcmp(pgn, pgn_1, size) == 0);
+
+    pgn = pgnstore_find(store, "00000001", &size);
+    assert(pgn);
+    assert(size == strlen(pgn_2) && memcmp(pgn, pgn_2, size) == 0);
+
+    assert(!pgnstore_find(store, "00000002", &size));
+    assert(!pgnstore_find(store, "0000-001", &size));
+
+    pgnstore_close(store);
+
+    // An aborted writer leaves the previous store in place.
+    writer = pgnstore_writer_open(path);
+    assert(writer);
+    assert(pgnstore_writer_add(writer, "00000002", pgn_2, strlen(pgn_2)));
+    pgnstore_writer_abort(writer);
+
+    store = pgnstore_open(path);
+    assert(store);
+    assert(pgnstore_size(store) == 2);
+    assert(!pgnstore_find(store, "00000002", &size));
+    pgnstore_close(store);
+
+    // Misaligned index.
+    FILE *file = fopen(path, "r+b");
+    assert(file);
+    struct pgnstore_header header;
+    assert(1 == fread(&header, sizeof(header), 1, file));
+    assert(header.index_offset % _Alignof(struct pgnstore_entry) == 0);
+    header.index_offset--;
+    assert(0 == fseek(file, 0, SEEK_SET));
+    assert(1 == fwrite(&header, sizeof(header), 1, file));
+    assert(fclose(file) == 0);
+    assert(!pgnstore_open(path));
+
+    unlink(path);
+}
+
+int main() {
+    test_pgnstore_roundtrip();
+    return 0;
+}
@@ -0,0 +1,47 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "querylog.h"
+
+void test_querylog_roundtrip() {
+    puts("test_querylog_roundtrip");
+
+    char path[] = "/tmp/test_querylog_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+
+    struct querylog_writer *writer = querylog_writer_open(path);
+    assert(writer);
+    querylog_writer_add(writer, "fen=rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR%20w%20KQkq%20-%200%201");
+    querylog_writer_add(writer, "");
+    assert(querylog_writer_close(writer));
+
+    // Appending keeps the existing records.
+    writer = querylog_writer_open(path);
+    assert(writer);
+    char long_query[QUERYLOG_MAX_QUERY_SIZE + 2];
+    memset(long_query, 'a', sizeof(long_query) - 1);
+    long_query[sizeof(long_query) - 1] = '\0';
+    querylog_writer_add(writer, long_query);
+    querylog_writer_add(writer, "fen=8/8/8/8/8/8/8/8&moves=3");
+    assert(querylog_writer_close(writer));
+
+    struct querylog *log = querylog_read(path);
+    assert(log);
+    assert(log->num_queries == 3);
+    assert(strcmp(log->queries[0], "fen=rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR%20w%20KQkq%20-%200%201") == 0);
+    assert(strcmp(log->queries[1], "") == 0);
+    assert(strcmp(log->queries[2], "fen=8/8/8/8/8/8/8/8&moves=3") == 0);
+    querylog_free(log);
+
+    unlink(path);
+}
+
+int main() {
+    test_querylog_roundtrip();
+    return 0;
+}
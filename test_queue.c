@@ -0,0 +1,58 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "queue.h"
+
+static const uintptr_t NUM_ITEMS = 200000;
+
+void test_queue_bounded() {
+    puts("test_queue_bounded");
+
+    struct queue *queue = queue_new(3);
+
+    // Rounded up to 4.
+    for (uintptr_t i = 1; i <= 4; i++) assert(queue_try_push(queue, (void *) i));
+    assert(!queue_try_push(queue, (void *) 5));
+
+    void *item;
+    for (uintptr_t i = 1; i <= 4; i++) {
+        assert(queue_try_pop(queue, &item));
+        assert(item == (void *) i);
+    }
+    assert(!queue_try_pop(queue, &item));
+
+    queue_free(queue);
+}
+
+static void *test_queue_producer(void *arg) {
+    struct queue *queue = arg;
+    for (uintptr_t i = 1; i <= NUM_ITEMS; i++) queue_push(queue, (void *) i);
+    queue_push(queue, NULL);
+    return NULL;
+}
+
+void test_queue_threads() {
+    puts("test_queue_threads");
+
+    struct queue *queue = queue_new(16);
+
+    pthread_t producer;
+    assert(pthread_create(&producer, NULL, test_queue_producer, queue) == 0);
+
+    // Items arrive complete and in order.
+    uintptr_t expected = 1;
+    void *item;
+    while (queue_pop(queue, &item), item) assert(item == (void *) expected++);
+    assert(expected == NUM_ITEMS + 1);
+
+    pthread_join(producer, NULL);
+    queue_free(queue);
+}
+
+int main() {
+    test_queue_bounded();
+    test_queue_threads();
+    return 0;
+}